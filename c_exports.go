@@ -11,6 +11,11 @@ void c_goScrcpyFrameImageCallback(char * token,char *device_id, uint8_t * img_da
     goScrcpyFrameImageCallback(token, device_id, img_data, img_data_len, img_size, screen_size);
 }
 
+extern void goScrcpyRawFrameCallback(char*, char*, scrcpy_frame*, scrcpy_rect);
+void c_goScrcpyRawFrameCallback(char *token, char *device_id, scrcpy_frame *frame, scrcpy_rect screen_size) {
+    goScrcpyRawFrameCallback(token, device_id, frame, screen_size);
+}
+
 extern void goScrcpyDeviceInfoCallback(char*, char*, int, int);
 void c_goScrcpyDeviceInfoCallback(char *token, char *device_id, int width, int height) {
     goScrcpyDeviceInfoCallback(token, device_id, width, height);
@@ -0,0 +1,339 @@
+/*
+ * Replay benchmark for the video decoding pipeline.
+ *
+ * Feeds a recorded scrcpy video stream (e.g. tests/data.h264) through socket_decode over a loopback
+ * connection as fast as possible, then reports frames/s and per-stage latency percentiles.
+ * Afterwards it compares the per-frame cpu time of creating a scaler for every frame with reusing a cached one,
+ * and bicubic scaling with the area filter of the low resolution path.
+ *
+ * Usage: bench_scrcpy_decoder <recorded stream> [loops] [image width] [image height] [png|jpeg|webp|bgra|rgb24|nv12|i420] [quality]
+ *        [max fps] [default|low-latency|throughput|reduced-cost] [auto|full-res]
+ * Frames are delivered as png images by default, as jpeg/webp images with the optional quality(png compression level),
+ * or as raw frames of the given pixel format. With max fps, frames are converted at most that often by their pts.
+ * Then the h264 decoder profile, and full-res to keep the full quality path when the image is a third of the screen
+ * or smaller, for comparing with the low resolution path taken automatically.
+ */
+#include "logging.h"
+#include "model.h"
+#include "pipeline_stats.h"
+#include "scrcpy_video_decoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include "Windows.h"
+#endif
+#include "boost/asio.hpp"
+#include "opencv2/core.hpp"
+
+extern "C" {
+#include "libavutil/frame.h"
+#include "libswscale/swscale.h"
+}
+
+using boost::asio::ip::tcp;
+
+// recorded stream layout: 80 bytes socket header, 68 bytes device info, then video packets
+#define BENCH_SOCKET_HEADER_SIZE 80
+#define BENCH_DEVICE_INFO_SIZE 68
+#define BENCH_DEFAULT_LOOPS 10
+#define BENCH_SAMPLE_WINDOW 65536
+#define BENCH_NET_BUFFER_KB 2048
+#define BENCH_SCALER_FRAMES 200
+
+const char *bench_output_formats[] = { "bgra", "rgb24", "nv12", "i420" };
+const char *bench_image_formats[] = { "png", "jpeg", "webp" };
+const char *bench_decoder_profiles[] = { "default", "low-latency", "throughput", "reduced-cost" };
+
+const char *bench_stage_names[PIPELINE_STAGE_COUNT] = {
+    "receive", "prepare_packet", "decode", "sws_scale", "imencode", "frame total", "convert", "callback"
+};
+
+class bench_decode_callback : public video_decode_callback {
+    public:
+        bench_decode_callback(int w, int h) : stats(new pipeline_stats(BENCH_SAMPLE_WINDOW)) {
+            this->img_size.width = w;
+            this->img_size.height = h;
+        }
+        ~bench_decode_callback() {
+            delete this->stats;
+        }
+        void on_video_callback(char* device_id, std::vector<uint8_t>* frame_data, int w, int h, int raw_w, int raw_h) {
+            this->frames++;
+            this->frame_bytes += frame_data->size();
+        }
+        image_size* get_configured_img_size(char* device_id) {
+            if (this->img_size.width <= 0 || this->img_size.height <= 0) {
+                return NULL;
+            }
+            return &this->img_size;
+        }
+        void on_device_info(char* device_id, int screen_width, int screen_height) {
+            this->screen_size.width = screen_width;
+            this->screen_size.height = screen_height;
+        }
+        void add_frame_img_size_cfg_callback(char *device_id, scrcpy_frame_img_size_cfg_callback callback) {}
+        void remove_frame_img_size_cfg_callback(char *device_id) {}
+        pipeline_stats* get_pipeline_stats(char *device_id) {
+            return this->stats;
+        }
+        void on_raw_frame_callback(char *device_id, scrcpy_frame *frame, int raw_w, int raw_h) {
+            this->frames++;
+            for (int i = 0; i < frame->planes; i++) {
+                // chroma planes of nv12/i420 have half the rows
+                this->frame_bytes += frame->linesize[i] * (i > 0 ? (frame->height + 1) / 2 : frame->height);
+            }
+        }
+        int get_raw_frame_format(char *device_id) {
+            return this->raw_format;
+        }
+        bool has_frame_img_callback(char *device_id) {
+            return this->raw_format < 0;
+        }
+        image_output_format get_output_format(char *device_id) {
+            return this->output_format;
+        }
+        device_delivery_cfg get_delivery_cfg(char *device_id) {
+            return this->delivery_cfg;
+        }
+        void set_frame_ready_callback(char *device_id, scrcpy_frame_ready_callback callback) {}
+        void request_frame_ready(char *device_id) {}
+        void set_snapshot_callback(char *device_id, scrcpy_snapshot_callback callback) {}
+        bool wait_for_frame_slot(char *device_id, int timeout_ms) {
+            return true;
+        }
+        int get_decoder_profile(char *device_id) {
+            // taken from connection_buffer_config
+            return -1;
+        }
+
+        pipeline_stats *stats = NULL;
+        image_size img_size = {0, 0};
+        image_size screen_size = {0, 0};
+        // -1 for png
+        int raw_format = -1;
+        image_output_format output_format = { SCRCPY_OUTPUT_FORMAT_PNG, SCRCPY_OUTPUT_QUALITY_DEFAULT };
+        // frames are never kept for latest frame only mode, there's no callback thread to pick them up
+        device_delivery_cfg delivery_cfg = {};
+        std::atomic<uint64_t> frames = 0;
+        std::atomic<uint64_t> frame_bytes = 0;
+};
+
+/*
+ * write the device info and then the video packets for @loops times, close the connection afterwards
+ */
+void bench_send_stream(uint16_t port, std::vector<char> *stream, int loops) {
+    try {
+        boost::asio::io_context io_context;
+        tcp::socket socket(io_context);
+        socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+        char *device_info = stream->data() + BENCH_SOCKET_HEADER_SIZE;
+        boost::asio::write(socket, boost::asio::buffer(device_info, BENCH_DEVICE_INFO_SIZE));
+        char *packets = device_info + BENCH_DEVICE_INFO_SIZE;
+        size_t packets_size = stream->size() - BENCH_SOCKET_HEADER_SIZE - BENCH_DEVICE_INFO_SIZE;
+        for (int i = 0; i < loops; i++) {
+            boost::asio::write(socket, boost::asio::buffer(packets, packets_size));
+        }
+        socket.shutdown(tcp::socket::shutdown_both);
+        socket.close();
+    } catch (boost::system::system_error &e) {
+        fprintf(stderr, "Failed to send stream: %s\n", e.what());
+    }
+}
+
+void bench_print_report(bench_decode_callback *callback, double wall_seconds, uint64_t input_bytes) {
+    pipeline_stats *stats = callback->stats;
+    uint64_t frames = callback->frames;
+    printf("screen %dx%d, image %dx%d\n", callback->screen_size.width, callback->screen_size.height,
+            callback->img_size.width, callback->img_size.height);
+    printf("packets %llu, frames %llu, wall %.3f s, %.2f frames/s, %.2f MB/s input, %.2f KB/frame output\n",
+            (unsigned long long)stats->count(PIPELINE_STAGE_FRAME), (unsigned long long)frames, wall_seconds,
+            wall_seconds > 0 ? frames / wall_seconds : 0.0,
+            wall_seconds > 0 ? input_bytes / wall_seconds / (1024.0 * 1024.0) : 0.0,
+            frames > 0 ? callback->frame_bytes / (double)frames / 1024.0 : 0.0);
+    printf("%-16s %8s %10s %10s %10s %10s %10s\n", "stage(us)", "count", "mean", "p50", "p90", "p99", "max");
+    for (int i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+        uint64_t count = stats->count(i);
+        double mean = count > 0 ? stats->total_ns(i) / (double)count / 1000.0 : 0.0;
+        printf("%-16s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", bench_stage_names[i], (unsigned long long)count, mean,
+                stats->percentile(i, 50) / 1000.0, stats->percentile(i, 90) / 1000.0,
+                stats->percentile(i, 99) / 1000.0, stats->percentile(i, 100) / 1000.0);
+    }
+}
+
+/*
+ * cpu time spent by the calling thread in us, std::clock is the wall time on windows
+ */
+double bench_thread_cpu_us() {
+#ifdef _WIN32
+    FILETIME created_at, exited_at, kernel_time, user_time;
+    if (!GetThreadTimes(GetCurrentThread(), &created_at, &exited_at, &kernel_time, &user_time)) {
+        return 0;
+    }
+    // in 100ns
+    uint64_t kernel = ((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime;
+    uint64_t user = ((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime;
+    return (kernel + user) / 10.0;
+#else
+    struct timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0) {
+        return 0;
+    }
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+#endif
+}
+
+/*
+ * scale a yuv420p frame for BENCH_SCALER_FRAMES times
+ * @param cached    reuse the scaler and the output image like the decoder does, otherwise create them for every frame
+ * @param flags     sws flags of the scaler
+ * @return          cpu time per frame in us
+ */
+double bench_scale_frames(AVFrame *frame, int target_width, int target_height, bool cached, int flags) {
+    struct SwsContext *sws_ctx = NULL;
+    cv::Mat image;
+    double started_at = bench_thread_cpu_us();
+    for (int i = 0; i < BENCH_SCALER_FRAMES; i++) {
+        if (!cached) {
+            image = cv::Mat(target_height, target_width, CV_8UC4);
+            sws_ctx = sws_getContext(frame->width, frame->height, AV_PIX_FMT_YUV420P,
+                    target_width, target_height, AV_PIX_FMT_RGB32, flags, NULL, NULL, NULL);
+        } else {
+            image.create(target_height, target_width, CV_8UC4);
+            sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, AV_PIX_FMT_YUV420P,
+                    target_width, target_height, AV_PIX_FMT_RGB32, flags, NULL, NULL, NULL);
+        }
+        if (!sws_ctx) {
+            return 0;
+        }
+        int line_size[1] = { (int)image.step1() };
+        sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, &image.data, line_size);
+        if (!cached) {
+            sws_freeContext(sws_ctx);
+            sws_ctx = NULL;
+        }
+    }
+    double cpu_us = (bench_thread_cpu_us() - started_at) / BENCH_SCALER_FRAMES;
+    if (sws_ctx) {
+        sws_freeContext(sws_ctx);
+    }
+    return cpu_us;
+}
+
+void bench_compare_scaler(int width, int height, int target_width, int target_height) {
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    if (target_width <= 0 || target_height <= 0) {
+        target_width = width;
+        target_height = height;
+    }
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        return;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) != 0) {
+        av_frame_free(&frame);
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        memset(frame->data[i], 128, frame->linesize[i] * (i == 0 ? height : (height + 1) / 2));
+    }
+    double per_frame_us = bench_scale_frames(frame, target_width, target_height, false, SWS_BICUBIC);
+    double cached_us = bench_scale_frames(frame, target_width, target_height, true, SWS_BICUBIC);
+    double area_us = bench_scale_frames(frame, target_width, target_height, true, SWS_AREA);
+    printf("scaler %dx%d -> %dx%d cpu/frame: %.1f us new context, %.1f us cached context, %.1f us cached area filter\n",
+            width, height, target_width, target_height, per_frame_us, cached_us, area_us);
+    av_frame_free(&frame);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <recorded stream> [loops] [image width] [image height] [png|jpeg|webp|bgra|rgb24|nv12|i420] [quality] [max fps]"
+                " [default|low-latency|throughput|reduced-cost] [auto|full-res]\n",
+                argv[0]);
+        return 1;
+    }
+    int loops = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_LOOPS;
+    int img_width = argc > 3 ? atoi(argv[3]) : 0;
+    int img_height = argc > 4 ? atoi(argv[4]) : 0;
+    int raw_format = -1;
+    for (int i = 0; argc > 5 && i < (int)(sizeof(bench_output_formats) / sizeof(bench_output_formats[0])); i++) {
+        if (strcmp(argv[5], bench_output_formats[i]) == 0) {
+            raw_format = SCRCPY_PIXEL_FORMAT_BGRA + i;
+        }
+    }
+    image_output_format output_format = { SCRCPY_OUTPUT_FORMAT_PNG, argc > 6 ? atoi(argv[6]) : SCRCPY_OUTPUT_QUALITY_DEFAULT };
+    for (int i = 0; argc > 5 && i < (int)(sizeof(bench_image_formats) / sizeof(bench_image_formats[0])); i++) {
+        if (strcmp(argv[5], bench_image_formats[i]) == 0) {
+            output_format.format = SCRCPY_OUTPUT_FORMAT_PNG + i;
+        }
+    }
+
+    std::ifstream input(argv[1], std::ios::in | std::ios::binary);
+    std::vector<char> *stream = new std::vector<char>(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    input.close();
+    if (stream->size() <= BENCH_SOCKET_HEADER_SIZE + BENCH_DEVICE_INFO_SIZE) {
+        fprintf(stderr, "%s is not a recorded scrcpy video stream\n", argv[1]);
+        delete stream;
+        return 1;
+    }
+    uint64_t input_bytes = (stream->size() - BENCH_SOCKET_HEADER_SIZE - BENCH_DEVICE_INFO_SIZE) * (uint64_t)loops;
+    printf("Replaying %s %d time(s), %llu bytes in total\n", argv[1], loops, (unsigned long long)input_bytes);
+
+    bench_decode_callback *callback = new bench_decode_callback(img_width, img_height);
+    callback->raw_format = raw_format;
+    callback->output_format = output_format;
+    callback->delivery_cfg.max_fps = argc > 7 ? atoi(argv[7]) : 0;
+    callback->delivery_cfg.full_res_decoding = argc > 9 && strcmp(argv[9], "full-res") == 0;
+    connection_buffer_config cfg = connection_buffer_config{ BENCH_NET_BUFFER_KB, BENCH_NET_BUFFER_KB * 2, SCRCPY_DECODER_PROFILE_DEFAULT };
+    for (int i = 0; argc > 8 && i < (int)(sizeof(bench_decoder_profiles) / sizeof(bench_decoder_profiles[0])); i++) {
+        if (strcmp(argv[8], bench_decoder_profiles[i]) == 0) {
+            cfg.decoder_profile = SCRCPY_DECODER_PROFILE_DEFAULT + i;
+        }
+    }
+    printf("Decoder profile is %s, %s\n", bench_decoder_profiles[cfg.decoder_profile],
+            callback->delivery_cfg.full_res_decoding ? "full resolution path" : "low resolution path if scaled down enough");
+    int keep_running = 1;
+    int disconnect_flag = 0;
+    int result = 0;
+    double wall_seconds = 0;
+    try {
+        boost::asio::io_context io_context;
+        tcp::acceptor acceptor(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        uint16_t port = acceptor.local_endpoint().port();
+        auto socket = boost::shared_ptr<tcp::socket>(new tcp::socket(io_context));
+        std::thread sender(bench_send_stream, port, stream, loops);
+        acceptor.accept(*socket);
+
+        auto started_at = std::chrono::steady_clock::now();
+        result = socket_decode(socket, callback, &cfg, &keep_running, &disconnect_flag);
+        wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started_at).count();
+        sender.join();
+    } catch (boost::system::system_error &e) {
+        fprintf(stderr, "Failed to setup loopback connection: %s\n", e.what());
+        result = 1;
+    }
+    bench_print_report(callback, wall_seconds, input_bytes);
+    bench_compare_scaler(callback->screen_size.width, callback->screen_size.height, img_width, img_height);
+    // the decoder always ends with a read failure once the stream is drained, so judge by frames delivered
+    int status = callback->frames > 0 ? 0 : 1;
+    if (status != 0) {
+        fprintf(stderr, "No frame decoded, decoder status is %d\n", result);
+    }
+
+    delete callback;
+    delete stream;
+    logging_cleanup();
+    return status;
+}
@@ -0,0 +1,166 @@
+#include "callback_dispatcher.h"
+#include "logging.h"
+
+// the dispatcher a worker thread belongs to, so the tasks it schedules stay in its own queue
+static thread_local callback_dispatcher *current_dispatcher = NULL;
+static thread_local int current_worker = -1;
+
+static std::mutex shared_dispatcher_lock;
+static callback_dispatcher *shared_dispatcher = NULL;
+static int shared_dispatcher_workers = 0;
+
+callback_dispatcher::callback_dispatcher(int workers) {
+    this->workers = workers > 0 ? workers : (int)std::thread::hardware_concurrency();
+    if (this->workers <= 0) {
+        this->workers = 1;
+    }
+    this->queues = new worker_queue[this->workers];
+    for (int i = 0; i < this->workers; i++) {
+        this->threads.emplace_back(&callback_dispatcher::worker_thread, this, i);
+    }
+    SPDLOG_INFO("Started callback dispatcher with {} workers", this->workers);
+}
+callback_dispatcher::~callback_dispatcher() {
+    {
+        std::lock_guard<std::mutex> guard{ this->idle_lock };
+        this->stopping = true;
+    }
+    this->task_arrived.notify_all();
+    for (std::thread &thread : this->threads) {
+        thread.join();
+    }
+    delete[] this->queues;
+    this->queues = NULL;
+}
+callback_dispatcher* callback_dispatcher::shared() {
+    std::lock_guard<std::mutex> guard{ shared_dispatcher_lock };
+    if (NULL == shared_dispatcher) {
+        // kept until the process exits, the receivers could be freed in any order
+        shared_dispatcher = new callback_dispatcher(shared_dispatcher_workers);
+    }
+    return shared_dispatcher;
+}
+int callback_dispatcher::config_shared(int workers) {
+    std::lock_guard<std::mutex> guard{ shared_dispatcher_lock };
+    if (NULL != shared_dispatcher) {
+        SPDLOG_ERROR("Callback dispatcher was started with {} workers already", shared_dispatcher->worker_count());
+        return 1;
+    }
+    shared_dispatcher_workers = workers > 0 ? workers : 0;
+    return 0;
+}
+int callback_dispatcher::worker_count() {
+    return this->workers;
+}
+void callback_dispatcher::schedule(dispatch_task *task) {
+    if (task->signals.fetch_add(1) == 0) {
+        this->push_task(task, false);
+    }
+}
+void callback_dispatcher::schedule_locked(dispatch_task *task) {
+    if (task->signals.fetch_add(1) == 0) {
+        this->push_task(task, true);
+    }
+}
+void callback_dispatcher::schedule_at(dispatch_task *task, dispatch_time at) {
+    std::lock_guard<std::mutex> guard{ this->idle_lock };
+    if (task->has_timer) {
+        this->timers.erase(task->timer);
+    }
+    task->timer = this->timers.emplace(at, task);
+    task->has_timer = true;
+    // the waiting workers could be waiting for a later timer
+    this->task_arrived.notify_one();
+}
+void callback_dispatcher::cancel(dispatch_task *task) {
+    std::lock_guard<std::mutex> guard{ this->idle_lock };
+    if (task->has_timer) {
+        this->timers.erase(task->timer);
+        task->has_timer = false;
+    }
+}
+void callback_dispatcher::push_task(dispatch_task *task, bool idle_locked) {
+    int index = current_worker;
+    if (current_dispatcher != this || index < 0) {
+        if (task->home_worker < 0) {
+            task->home_worker = (int)(this->next_home_worker.fetch_add(1) % (uint32_t)this->workers);
+        }
+        index = task->home_worker;
+    }
+    {
+        std::lock_guard<std::mutex> guard{ this->queues[index].lock };
+        this->queues[index].tasks.push_back(task);
+    }
+    if (idle_locked) {
+        this->queued++;
+    } else {
+        // increased with the lock, so a worker going to wait sees it
+        std::lock_guard<std::mutex> guard{ this->idle_lock };
+        this->queued++;
+    }
+    this->task_arrived.notify_one();
+}
+dispatch_task* callback_dispatcher::take_task(int index) {
+    {
+        worker_queue &own = this->queues[index];
+        std::lock_guard<std::mutex> guard{ own.lock };
+        if (!own.tasks.empty()) {
+            dispatch_task *task = own.tasks.front();
+            own.tasks.pop_front();
+            return task;
+        }
+    }
+    // steal from the back, the owner takes from the front
+    for (int i = 1; i < this->workers; i++) {
+        worker_queue &other = this->queues[(index + i) % this->workers];
+        std::lock_guard<std::mutex> guard{ other.lock };
+        if (!other.tasks.empty()) {
+            dispatch_task *task = other.tasks.back();
+            other.tasks.pop_back();
+            return task;
+        }
+    }
+    return NULL;
+}
+void callback_dispatcher::worker_thread(int index) {
+    current_dispatcher = this;
+    current_worker = index;
+    while (true) {
+        dispatch_task *task = this->take_task(index);
+        if (task) {
+            this->queued--;
+            uint64_t signals = task->signals.load();
+            int status = task->run();
+            if (status == DISPATCH_TASK_PENDING) {
+                this->push_task(task, false);
+            } else if (status == DISPATCH_TASK_IDLE && task->signals.fetch_sub(signals) != signals) {
+                // scheduled again while running
+                this->push_task(task, false);
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> wait_lock{ this->idle_lock };
+        if (this->stopping) {
+            break;
+        }
+        dispatch_time now = std::chrono::steady_clock::now();
+        bool timer_fired = false;
+        while (!this->timers.empty() && this->timers.begin()->first <= now) {
+            dispatch_task *timer_task = this->timers.begin()->second;
+            this->timers.erase(this->timers.begin());
+            timer_task->has_timer = false;
+            // with the lock held, so the task can't free itself in between
+            this->schedule_locked(timer_task);
+            timer_fired = true;
+        }
+        if (timer_fired || this->queued > 0) {
+            continue;
+        }
+        if (this->timers.empty()) {
+            this->task_arrived.wait(wait_lock);
+        } else {
+            this->task_arrived.wait_until(wait_lock, this->timers.begin()->first);
+        }
+    }
+    SPDLOG_DEBUG("Callback dispatcher worker {} stopped", index);
+}
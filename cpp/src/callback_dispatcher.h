@@ -0,0 +1,105 @@
+#ifndef SCRCPY_CALLBACK_DISPATCHER
+#define SCRCPY_CALLBACK_DISPATCHER
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// the task has nothing to do until it's scheduled again
+#define DISPATCH_TASK_IDLE 0
+// the task yielded with work left, it's queued again behind the others
+#define DISPATCH_TASK_PENDING 1
+// the task was freed by itself, the dispatcher must not touch it anymore
+#define DISPATCH_TASK_RELEASED 2
+
+typedef std::chrono::steady_clock::time_point dispatch_time;
+
+/*
+ * a unit of work run by the dispatcher, e.g. delivering the frames of a device
+ * it's never run by two workers at once, so the work of a task is done in order
+ */
+typedef struct dispatch_task {
+    // @return DISPATCH_TASK_IDLE, DISPATCH_TASK_PENDING or DISPATCH_TASK_RELEASED
+    std::function<int()> run;
+    // times scheduled since it was last run, it's only queued on the first one
+    std::atomic<uint64_t> signals = 0;
+    // queue the task is pushed to by threads other than the workers, -1 before it's first scheduled
+    int home_worker = -1;
+    // the timer of the task, guarded by the idle lock of the dispatcher
+    bool has_timer = false;
+    std::multimap<dispatch_time, struct dispatch_task*>::iterator timer;
+} dispatch_task;
+
+/*
+ * a bounded pool of workers running tasks of many devices
+ * every worker has its own queue, idle workers steal tasks from the queues of the others
+ */
+class callback_dispatcher {
+    public:
+        /*
+         * @param       workers             worker threads, 0 for the core count
+         */
+        callback_dispatcher(int workers);
+        ~callback_dispatcher();
+        /*
+         * make sure the task runs after this call, it's queued only if it's not queued or running yet
+         */
+        void schedule(dispatch_task *task);
+        /*
+         * schedule the task at a time, replacing its earlier timer
+         */
+        void schedule_at(dispatch_task *task, dispatch_time at);
+        /*
+         * cancel the timer of the task, must be called from its run before it frees itself
+         */
+        void cancel(dispatch_task *task);
+        int worker_count();
+        /*
+         * the dispatcher shared by all receivers, started on first use
+         */
+        static callback_dispatcher* shared();
+        /*
+         * set the workers of the shared dispatcher
+         * @param       workers             worker threads, 0 for the core count
+         * @return      0 if ok, 1 if the shared dispatcher was started already
+         */
+        static int config_shared(int workers);
+    private:
+        typedef struct worker_queue {
+            std::mutex lock;
+            std::deque<dispatch_task*> tasks;
+        } worker_queue;
+        std::vector<std::thread> threads;
+        worker_queue *queues = NULL;
+        int workers = 0;
+        // tasks in all queues, only increased while holding the idle_lock
+        std::atomic<int> queued = 0;
+        std::atomic<uint32_t> next_home_worker = 0;
+        // workers wait on it for tasks and timers
+        std::mutex idle_lock;
+        std::condition_variable task_arrived;
+        std::multimap<dispatch_time, dispatch_task*> timers;
+        bool stopping = false;
+
+        void worker_thread(int index);
+        /*
+         * get a task from the worker's own queue, or steal one from the others
+         * @return      NULL if all queues are empty
+         */
+        dispatch_task* take_task(int index);
+        /*
+         * queue the task, the idle_lock must be held if @idle_locked
+         */
+        void push_task(dispatch_task *task, bool idle_locked);
+        /*
+         * @see schedule, the idle_lock must be held
+         */
+        void schedule_locked(dispatch_task *task);
+};
+#endif //!SCRCPY_CALLBACK_DISPATCHER
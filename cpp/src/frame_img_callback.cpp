@@ -4,114 +4,247 @@
 #include "logging.h"
 #define MAX_IMG_BUFFER_SIZE 1 * 1024 * 1024
 
-int frame_img_processor::callback_thread(device_frame_img_callback *callback_item) {
-    SPDLOG_DEBUG("Running thread for frame callback of device {}", callback_item->device_id);
-    BOOL wait_for_next = FALSE;
-    while (true) {
-        if (wait_for_next) {
-            wait_for_next = FALSE;
-            std::this_thread::sleep_for(std::chrono::nanoseconds(50));
-            continue;
+static void free_frame_ring(device_frame_img_callback *callback_item) {
+    for (int i = 0; i < callback_item->depth; i++) {
+        if (NULL != callback_item->frames[i].frame_data) {
+            free(callback_item->frames[i].frame_data);
+            callback_item->frames[i].frame_data = NULL;
         }
-        auto *frames = callback_item->frames;
-        // gaint lock for whole callback_item
-        std::lock_guard<std::mutex> wait_lock(callback_item->lock);
+    }
+    delete[] callback_item->frames;
+    callback_item->frames = NULL;
+}
+
+int frame_img_processor::deliver_frames(device_frame_img_callback *callback_item) {
+    // copied while holding the lock, so they could be invoked after releasing it
+    std::vector<frame_callback_handler> &handlers = callback_item->delivering_handlers;
+    std::vector<frame_raw_callback_handler> &raw_handlers = callback_item->delivering_raw_handlers;
+    int delivered_frames = 0;
+    // only released while invoking the handlers or calling the ready callback
+    std::unique_lock<std::mutex> wait_lock(callback_item->lock);
+    callback_item->delivering_thread = std::this_thread::get_id();
+    while (true) {
         if (callback_item->stop > 0) {
-            SPDLOG_WARN("Stopping frame image callback thread  for device {}", callback_item->device_id);
+            SPDLOG_WARN("Stopping frame image callbacks for device {}", callback_item->device_id);
             break;
         }
-        frame_img_callback_params* allocated_frame = NULL;
-        if (!frames->empty()) {
-            //grab a frame from front
-            int total = (int)frames->size();
-            while(!frames->empty() && total > 0) {
-                frame_img_callback_params* cur_frame = frames->front();
-                frames->pop();
-                total --;
-                if (cur_frame->status == CALLBACK_PARAM_PENDING) {
-                    allocated_frame = cur_frame;
-                    break;
+        uint64_t tail = callback_item->frames_tail.load(std::memory_order_relaxed);
+        if (tail == callback_item->frames_head.load(std::memory_order_acquire)) {
+            // a frame sent before any handler was added would just be dropped
+            bool has_handlers = callback_item->handler_count > 0 || !callback_item->raw_handlers.empty();
+            bool retry_due = callback_item->ready_retry && std::chrono::steady_clock::now() >= callback_item->ready_retry_at;
+            scrcpy_frame_ready_callback ready_callback = NULL;
+            frame_ready_state *ready_state = callback_item->ready_state.get();
+            if (has_handlers && (callback_item->ready_requested || retry_due)) {
+                std::lock_guard<std::mutex> ready_guard{ ready_state->lock };
+                if (ready_state->callback) {
+                    // counted, so removing the callback waits for this call
+                    ready_callback = ready_state->callback;
+                    ready_state->calls++;
+                    ready_state->calling_thread = std::this_thread::get_id();
                 }
-                frames->push(cur_frame);
             }
+            if (ready_callback) {
+                callback_item->ready_requested = false;
+                callback_item->ready_retry = false;
+                // invoked without the lock, so it could send a new frame
+                wait_lock.unlock();
+                int retry_ms = ready_callback(callback_item->device_id);
+                {
+                    std::lock_guard<std::mutex> ready_guard{ ready_state->lock };
+                    ready_state->calls--;
+                    ready_state->calling_thread = std::thread::id();
+                }
+                ready_state->call_done.notify_all();
+                wait_lock.lock();
+                if (retry_ms > 0) {
+                    callback_item->ready_retry = true;
+                    callback_item->ready_retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(retry_ms);
+                }
+                continue;
+            }
+            if (retry_due) {
+                // nothing to call, a due timer would fire again right away
+                callback_item->ready_retry = false;
+            }
+            if (callback_item->ready_retry) {
+                callback_item->dispatcher->schedule_at(&callback_item->task, callback_item->ready_retry_at);
+            }
+            callback_item->delivering_thread = std::thread::id();
+            // run again by a new frame, request_ready, the retry timer or stopping
+            return DISPATCH_TASK_IDLE;
         }
-        if (NULL == allocated_frame) {
-            wait_for_next = TRUE;
-            continue;
+        if (delivered_frames >= callback_item->depth) {
+            callback_item->delivering_thread = std::thread::id();
+            // let the workers deliver the frames of other devices first
+            return DISPATCH_TASK_PENDING;
         }
-        // tiny lock for the allocated_frame
-        std::lock_guard<std::mutex> allocated_frame_guard{allocated_frame->lock};
-        allocated_frame->status = CALLBACK_PARAM_SENDING;
-        // put it back to queue if there's no callback handler
-        if (callback_item->handler_count <= 0) {
-            allocated_frame->status = CALLBACK_PARAM_SENT;
-            frames->push(allocated_frame);
-            continue;
+        frame_img_callback_params *frame_params = &callback_item->frames[tail % callback_item->depth];
+        // taken with the lock, so the writers dropping or replacing waiting frames leave it alone
+        callback_item->frames_tail.store(tail + 1, std::memory_order_relaxed);
+        bool is_raw = frame_params->format >= 0;
+        if (is_raw) {
+            raw_handlers.assign(callback_item->raw_handlers.begin(), callback_item->raw_handlers.end());
+        } else {
+            handlers.assign(callback_item->handlers, callback_item->handlers + callback_item->handler_count);
         }
-        SPDLOG_TRACE("Invoking frame callback device={} frame data size={} param pointer {} total handlers = {}", allocated_frame->device_id, 
-                allocated_frame->frame_data_size, (uintptr_t) allocated_frame, callback_item->handler_count);
-        // call the handlers
-        for (int i = 0; i < callback_item->handler_count; i++) {
-            frame_callback_handler callback = callback_item->handlers[i];
-            SPDLOG_TRACE("Invoking callback handler {} for device_id={} callback param is {}", (uintptr_t)callback, 
-                    callback_item->device_id, (uintptr_t) allocated_frame);
-            scrcpy_rect img_size = scrcpy_rect{ allocated_frame->w, allocated_frame->h };
-            scrcpy_rect screen_size = scrcpy_rect{ allocated_frame->raw_w, allocated_frame->raw_h };
-            callback(callback_item->token, callback_item->device_id, 
-                    allocated_frame->frame_data, allocated_frame->frame_data_size,
-                    img_size, screen_size);
-        }
-        allocated_frame->status = CALLBACK_PARAM_SENT;
-        frames->push(allocated_frame);
-    }
-    SPDLOG_DEBUG("Stopped thread for frame callback of device {}", callback_item->device_id);
-    release_device_img_callback(callback_item);
-    return 0;
+        int handler_count = is_raw ? (int)raw_handlers.size() : (int)handlers.size();
+        pipeline_stats *stats = frame_params->stats;
+        // the writers don't wait for the callbacks, they only take a slot after it's released
+        wait_lock.unlock();
+        if (handler_count <= 0) {
+            if (stats) {
+                stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
+            }
+        } else {
+            SPDLOG_TRACE("Invoking frame callback device={} frame data size={} param pointer {} total handlers = {}", callback_item->device_id,
+                    frame_params->frame_data_size, (uintptr_t) frame_params, handler_count);
+            int64_t callback_started_at = pipeline_clock_ns();
+            scrcpy_rect screen_size = scrcpy_rect{ frame_params->raw_w, frame_params->raw_h };
+            if (is_raw) {
+                scrcpy_frame frame = {};
+                frame.format = frame_params->format;
+                frame.width = frame_params->w;
+                frame.height = frame_params->h;
+                frame.planes = frame_params->planes;
+                for (int i = 0; i < frame_params->planes; i++) {
+                    frame.data[i] = frame_params->frame_data + frame_params->plane_offset[i];
+                    frame.linesize[i] = frame_params->linesize[i];
+                }
+                frame.dirty_rect_count = frame_params->dirty_rect_count;
+                for (int i = 0; i < frame_params->dirty_rect_count; i++) {
+                    frame.dirty_rects[i] = frame_params->dirty_rects[i];
+                }
+                // frames were dropped since the last one delivered, the changes of them are unknown
+                if (frame.dirty_rect_count >= 0 && frame_params->raw_seq != callback_item->raw_frames_delivered + 1) {
+                    frame.dirty_rects[0] = scrcpy_area{ 0, 0, frame.width, frame.height };
+                    frame.dirty_rect_count = 1;
+                }
+                callback_item->raw_frames_delivered = frame_params->raw_seq;
+                for (frame_raw_callback_handler callback : raw_handlers) {
+                    callback(callback_item->token, callback_item->device_id, &frame, screen_size);
+                }
+            } else {
+                // call the handlers
+                scrcpy_rect img_size = scrcpy_rect{ frame_params->w, frame_params->h };
+                for (frame_callback_handler callback : handlers) {
+                    SPDLOG_TRACE("Invoking callback handler {} for device_id={} callback param is {}", (uintptr_t)callback,
+                            callback_item->device_id, (uintptr_t) frame_params);
+                    callback(callback_item->token, callback_item->device_id,
+                            frame_params->image.data(), frame_params->frame_data_size,
+                            img_size, screen_size);
+                }
+            }
+            if (stats) {
+                stats->record(PIPELINE_STAGE_CALLBACK, pipeline_clock_ns() - callback_started_at);
+                stats->increase(PIPELINE_COUNTER_DELIVERED_CALLBACKS, handler_count);
+            }
+        }
+        // release the slot for writing
+        callback_item->frames_released.store(tail + 1, std::memory_order_release);
+        if (stats) {
+            stats->set_queue_depth((int)(callback_item->frames_head.load(std::memory_order_acquire) - tail - 1));
+        }
+        wait_lock.lock();
+        // released before locking, so a writer going to wait sees it or gets notified
+        callback_item->slot_released.notify_one();
+        delivered_frames++;
+        // the callbacks are waiting for a new frame once the ring is drained
+        callback_item->ready_requested = true;
+    }
+    wait_lock.unlock();
+    callback_item->dispatcher->cancel(&callback_item->task);
+    // a writer still holding it releases the container once the frame is written
+    unref_device_img_callback(callback_item);
+    return DISPATCH_TASK_RELEASED;
+}
+device_frame_img_callback* frame_img_processor::ref_device_img_callback(char *device_id) {
+    // a stopped container is removed from the registry with the lock, so it's never found here
+    std::lock_guard<std::mutex> lock_guard{ this->lock };
+    auto entry = this->registry->find(std::string(device_id));
+    if (entry == this->registry->end()) {
+        return NULL;
+    }
+    entry->second->refs.fetch_add(1, std::memory_order_relaxed);
+    return entry->second;
+}
+void frame_img_processor::unref_device_img_callback(device_frame_img_callback* callback_item) {
+    if (callback_item->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        release_device_img_callback(callback_item);
+    }
 }
 void frame_img_processor::release_device_img_callback(device_frame_img_callback* callback_item) {
-    std::lock_guard<std::mutex> lock(callback_item->lock);
-    SPDLOG_INFO("Relasing a device_frame_img_callback {} for device {}", (uintptr_t)callback_item, callback_item->device_id);
-    if (callback_item->device_id) {
-        free(callback_item->device_id);
-        callback_item->device_id = NULL;
-    }
-    if (callback_item->handlers) {
-        free(callback_item->handlers);
-        callback_item->handlers = NULL;
-    }
-    if  (callback_item->token) {
-        free(callback_item->token);
-        callback_item->token = NULL;
-    }
-    if (callback_item->thread_handle){
-        callback_item->thread_handle = NULL;
-    }
-    if(callback_item->frames) {
-        auto *frames = callback_item->frames;
-        while(!frames->empty()) {
-            auto item = frames->front();
-            frames->pop();
-            std::lock_guard<std::mutex> lock{ item->lock };
-            if (NULL != item->frame_data) {
-                free(item->frame_data);
-                item->frame_data = NULL;
-            }
+    {
+        // no writer holds a reference, the locks only make the frames written visible here
+        std::lock_guard<std::mutex> write_guard(callback_item->write_lock);
+        std::lock_guard<std::mutex> lock(callback_item->lock);
+        SPDLOG_INFO("Relasing a device_frame_img_callback {} for device {}", (uintptr_t)callback_item, callback_item->device_id);
+        if (callback_item->device_id) {
+            free(callback_item->device_id);
+            callback_item->device_id = NULL;
+        }
+        if (callback_item->handlers) {
+            free(callback_item->handlers);
+            callback_item->handlers = NULL;
+        }
+        if  (callback_item->token) {
+            free(callback_item->token);
+            callback_item->token = NULL;
+        }
+        if(callback_item->frames) {
+            free_frame_ring(callback_item);
         }
-        delete callback_item->frames;
-        callback_item->frames = NULL;
     }
     delete callback_item;
 }
 
-frame_img_processor::frame_img_processor() : registry(new std::map<std::string, device_frame_img_callback*>()){ }
+frame_img_processor::frame_img_processor(callback_dispatcher *dispatcher) : registry(new std::map<std::string, device_frame_img_callback*>()),
+    ready_states(new std::map<std::string, std::shared_ptr<frame_ready_state>>()),
+    delivery_policies(new std::map<std::string, frame_delivery_policy>()),
+    dispatcher(dispatcher ? dispatcher : callback_dispatcher::shared()){ }
 
-int frame_img_processor::start_callback_thread(char* device_id, device_frame_img_callback* handler_container) {
-    // start thread
-    handler_container->stop = 0;
-    std::thread callback_thread(&frame_img_processor::callback_thread, this, handler_container);
-    callback_thread.detach();
-    handler_container->thread_handle = callback_thread.native_handle();
-    return 0;
+device_frame_img_callback* frame_img_processor::create_device_img_callback(char *device_id, char *token) {
+    frame_callback_handler* handlers = (frame_callback_handler*)malloc(sizeof(frame_callback_handler) * PRE_ALLOC_CALLBASCK_SIZE);
+    if (!handlers) {
+        SPDLOG_ERROR("No enough memory for storing callbacks");
+        return NULL;
+    }
+    device_frame_img_callback* callback_item = new device_frame_img_callback();
+    if (!callback_item) {
+        SPDLOG_ERROR("No enough memory for storing callback container");
+        free(handlers);
+        return NULL;
+    }
+    char *device_id_cpy = (char*)malloc(sizeof(char) * strlen(device_id) + 1);
+    char *token_cpy = (char*)malloc(sizeof(char) * strlen(token) + 1);
+    array_copy_to(device_id, device_id_cpy, 0, (int)strlen(device_id) + 1);
+    array_copy_to(token, token_cpy, 0, (int)strlen(token) + 1);
+    callback_item->device_id = device_id_cpy;
+    callback_item->handler_count = 0;
+    callback_item->token = token_cpy;
+    callback_item->handlers = handlers;
+    auto delivery_policy = this->delivery_policies->find(std::string(device_id));
+    if (delivery_policy != this->delivery_policies->end()) {
+        callback_item->depth = delivery_policy->second.depth;
+        callback_item->policy = delivery_policy->second.policy;
+    }
+    callback_item->next_depth = callback_item->depth;
+    callback_item->frames = new frame_img_callback_params[callback_item->depth];
+    callback_item->ready_state = this->get_ready_state(std::string(device_id));
+    auto existing = this->registry->emplace(std::string(device_id_cpy), callback_item);
+    auto callback_added = existing.second;
+    SPDLOG_INFO("Creating new frame image callback handler holder for device={} ok ? {} devices registered {}", 
+            device_id_cpy, callback_added ? "YES":"NO", this->registry->size());
+    if (!callback_added) {
+        // just in case
+        SPDLOG_DEBUG("It should not be happened, the device {} already had callbacks", device_id_cpy);
+        release_device_img_callback(callback_item);
+        return NULL;
+    }
+    // run by the workers of the dispatcher whenever it's scheduled
+    callback_item->dispatcher = this->dispatcher;
+    callback_item->task.run = std::bind(&frame_img_processor::deliver_frames, callback_item);
+    return callback_item;
 }
 
 void frame_img_processor::add(char *device_id, frame_callback_handler callback, char *token) {
@@ -127,38 +260,14 @@ void frame_img_processor::add(char *device_id, frame_callback_handler callback,
             device_id, end_item == entry ? "no":"yes");
     if (end_item == entry) {
         SPDLOG_DEBUG("Need to create a new callback container for device {}", device_id);
-        frame_callback_handler* handlers = (frame_callback_handler*)malloc(sizeof(frame_callback_handler) * PRE_ALLOC_CALLBASCK_SIZE);
-        if (!handlers) {
-            SPDLOG_ERROR("No enough memory for storing callbacks");
-            return;
-        }
-        handlers[0] = callback;
-        device_frame_img_callback* callback_item = new device_frame_img_callback();
+        device_frame_img_callback* callback_item = this->create_device_img_callback(device_id, token);
         if (!callback_item) {
-            SPDLOG_ERROR("No enough memory for storing callback container");
             return;
         }
-        char *device_id_cpy = (char*)malloc(sizeof(char) * strlen(device_id) + 1);
-        char *token_cpy = (char*)malloc(sizeof(char) * strlen(token) + 1);
-        array_copy_to(device_id, device_id_cpy, 0, (int)strlen(device_id) + 1);
-        array_copy_to(token, token_cpy, 0, (int)strlen(token) + 1);
-        callback_item->device_id = device_id_cpy;
+        std::lock_guard<std::mutex> lock { callback_item->lock };
+        callback_item->handlers[0] = callback;
         callback_item->handler_count = 1;
-        callback_item->token = token_cpy;
-        callback_item->handlers = handlers;
-        callback_item->frames = new std::queue<frame_img_callback_params*>();
-        auto existing = this->registry->emplace(std::string(device_id_cpy), callback_item);
-        auto callback_added = existing.second;
-        SPDLOG_INFO("Creating new frame image callback handler holder for device={} ok ? {} devices registered {}", 
-                device_id_cpy, callback_added ? "YES":"NO", this->registry->size());
-        if (callback_added) {
-            // if failed to start thread
-            this->start_callback_thread(device_id_cpy, callback_item);
-        } else {
-            // just in case
-            SPDLOG_DEBUG("It should not be happened, the device {} already had callbacks", device_id_cpy);
-            release_device_img_callback(callback_item);
-        }
+        this->update_accepted_frames(callback_item);
     } else {
         device_frame_img_callback* handler_container = entry->second;
         SPDLOG_INFO("Trying to add callback {} to exsiting callbacks({}) for device {}", (uintptr_t)callback,
@@ -187,6 +296,7 @@ void frame_img_processor::add(char *device_id, frame_callback_handler callback,
         }
         handler_container->handlers[old_count] = callback;
         handler_container->handler_count++;
+        this->update_accepted_frames(handler_container);
     }
 }
 void frame_img_processor::del(char* device_id, frame_callback_handler callback) {
@@ -223,8 +333,9 @@ void frame_img_processor::del(char* device_id, frame_callback_handler callback)
             handlers[i] = NULL;
         }
     }
-    if (handler_container->handler_count == 0) {
-        handler_container->stop = 1;
+    this->update_accepted_frames(handler_container);
+    if (handler_container->handler_count == 0 && handler_container->raw_handlers.empty()) {
+        this->stop_device_img_callback(handler_container);
         // remove from register
         this->registry->erase(entry);
         SPDLOG_INFO("Also remove dict entry for device {}", device_id);
@@ -239,97 +350,304 @@ frame_img_processor::~frame_img_processor() {
     }
     // remove all items
     this->registry->clear();
+    delete this->ready_states;
+    this->ready_states = NULL;
+    delete this->delivery_policies;
+    this->delivery_policies = NULL;
 }
-void frame_img_processor::invoke(char *token, char* device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h) {
+void frame_img_processor::invoke(char *token, char* device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h,
+        pipeline_stats *stats) {
     if(!device_id || !token || !frame_data) {
         SPDLOG_ERROR("Invalid arguments for add a frame image data");
         return;
     }
-    auto entry = this->registry->find(std::string(device_id));
-    if (entry == this->registry->end()) {
+    std::vector<uint8_t> image(frame_data, frame_data + frame_data_size);
+    this->invoke(token, device_id, &image, w, h, raw_w, raw_h, stats);
+}
+void frame_img_processor::invoke(char *token, char* device_id, std::vector<uint8_t>* frame_data, int w, int h, int raw_w, int raw_h,
+        pipeline_stats *stats) {
+    if(!device_id || !token || !frame_data) {
+        SPDLOG_ERROR("Invalid arguments for add a frame image data");
         return;
     }
-    device_frame_img_callback* handler_container = entry->second;
-    // callback item lock
-    std::lock_guard<std::mutex> lock{ handler_container->lock };
-    if (handler_container->handler_count == 0) {
+    device_frame_img_callback* handler_container = this->ref_device_img_callback(device_id);
+    if (handler_container == NULL) {
+        if (stats) {
+            stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
+        }
         return;
     }
-    int buffed_frames = handler_container->allocated_frames;
-    SPDLOG_TRACE("Trying to add param for device {}, lock acquired, already had {} allocted frames. data size is {}", 
-            device_id, buffed_frames, frame_data_size);
-    frame_img_callback_params* params = NULL;
-    if (buffed_frames >= MAX_PENDING_FRAMES ) {
-        auto frames = handler_container->frames;
-        // get a frame from back 
-        int total = (int)frames->size();
-        while(!frames->empty() && total > 0) {
-            total --;
-            auto temp_frame = frames->front();
-            frames->pop();
-            if (temp_frame->status < CALLBACK_PARAM_PENDING) {
-                params = temp_frame;
-                // remove it from the deque
-                break;
-            } else {
-                frames->push(temp_frame);
-            }
+    if (!handler_container->accepts_png.load(std::memory_order_acquire)) {
+        if (stats) {
+            stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
         }
+        unref_device_img_callback(handler_container);
+        return;
     }
-    if(NULL == params) {
-        params = new frame_img_callback_params();
-        if (!params) {
-            SPDLOG_ERROR("No enough memory for initing CallbackParams");
-            return;
+    {
+        // only waits for the delivering task with SCRCPY_DELIVERY_BLOCK
+        std::lock_guard<std::mutex> write_guard{ handler_container->write_lock };
+        std::unique_lock<std::mutex> ring_lock{ handler_container->lock, std::defer_lock };
+        // the image is kept in its own buffer
+        frame_img_callback_params* params = this->acquire_callback_params(handler_container, 0, stats, &ring_lock);
+        if (params != NULL) {
+            SPDLOG_TRACE("Current callback param is {}", (uintptr_t)params);
+            // the slot's buffer of an earlier frame goes back to the caller for reusing
+            params->image.swap(*frame_data);
+            params->frame_data_size = (uint32_t)params->image.size();
+            params->w = w;
+            params->h = h;
+            params->raw_w = raw_w;
+            params->raw_h = raw_h;
+            params->format = -1;
+            params->planes = 0;
+            this->push_callback_params(handler_container, params, stats);
         }
-        auto buffer_size = calc_buffer_size(frame_data_size, MAX_IMG_BUFFER_SIZE);
-        SPDLOG_DEBUG("Allocating {} bytes for fram cache", buffer_size);
-        params->frame_data = (uint8_t*)malloc(buffer_size);
-        params->buffer_size = buffer_size;
-        SPDLOG_DEBUG("Allocated {} bytes for fram cache", buffer_size);
-        if (!params->frame_data) {
-            SPDLOG_ERROR("No enough memory for initing frame_data");
-            delete params;
-            return;
+    }
+    // after both locks were released, it could be the last reference
+    unref_device_img_callback(handler_container);
+}
+void frame_img_processor::invoke_raw(char *token, char* device_id, scrcpy_frame *frame, int raw_w, int raw_h, pipeline_stats *stats) {
+    if (!device_id || !token || !frame || frame->planes <= 0 || frame->planes > SCRCPY_MAX_FRAME_PLANES) {
+        SPDLOG_ERROR("Invalid arguments for add a raw frame");
+        return;
+    }
+    device_frame_img_callback* handler_container = this->ref_device_img_callback(device_id);
+    if (handler_container == NULL) {
+        if (stats) {
+            stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
         }
-        handler_container->allocated_frames++;
+        return;
     }
-    if (params == NULL) {
-        SPDLOG_ERROR("FATAL: Could not allocate a param for sending callback");
+    uint64_t raw_seq = handler_container->raw_frames_sent.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (!handler_container->accepts_raw.load(std::memory_order_acquire)) {
+        if (stats) {
+            stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
+        }
+        unref_device_img_callback(handler_container);
         return;
     }
-    SPDLOG_TRACE("Current callback param is {}", (uintptr_t)params);
-    // realloc ram
+    {
+        // only waits for the delivering task with SCRCPY_DELIVERY_BLOCK
+        std::lock_guard<std::mutex> write_guard{ handler_container->write_lock };
+        std::unique_lock<std::mutex> ring_lock{ handler_container->lock, std::defer_lock };
+        uint32_t frame_data_size = 0;
+        int plane_size[SCRCPY_MAX_FRAME_PLANES] = {0};
+        for (int i = 0; i < frame->planes; i++) {
+            plane_size[i] = frame->linesize[i] * frame_plane_height(frame->format, i, frame->height);
+            frame_data_size += plane_size[i];
+        }
+        frame_img_callback_params* params = this->acquire_callback_params(handler_container, frame_data_size, stats, &ring_lock);
+        if (params != NULL) {
+            int offset = 0;
+            for (int i = 0; i < frame->planes; i++) {
+                memcpy(params->frame_data + offset, frame->data[i], plane_size[i]);
+                params->plane_offset[i] = offset;
+                params->linesize[i] = frame->linesize[i];
+                offset += plane_size[i];
+            }
+            params->frame_data_size = frame_data_size;
+            params->format = frame->format;
+            params->planes = frame->planes;
+            params->dirty_rect_count = frame->dirty_rect_count > SCRCPY_MAX_DIRTY_RECTS ? SCRCPY_MAX_DIRTY_RECTS : frame->dirty_rect_count;
+            for (int i = 0; i < params->dirty_rect_count; i++) {
+                params->dirty_rects[i] = frame->dirty_rects[i];
+            }
+            params->raw_seq = raw_seq;
+            params->w = frame->width;
+            params->h = frame->height;
+            params->raw_w = raw_w;
+            params->raw_h = raw_h;
+            this->push_callback_params(handler_container, params, stats);
+        }
+    }
+    // after both locks were released, it could be the last reference
+    unref_device_img_callback(handler_container);
+}
+void frame_img_processor::update_accepted_frames(device_frame_img_callback* handler_container) {
+    handler_container->accepts_png.store(handler_container->handler_count > 0, std::memory_order_release);
+    handler_container->accepts_raw.store(!handler_container->raw_handlers.empty(), std::memory_order_release);
+    // the ready callback is only invoked while there are handlers
+    this->dispatcher->schedule(&handler_container->task);
+}
+frame_img_callback_params* frame_img_processor::acquire_callback_params(device_frame_img_callback* handler_container, uint32_t frame_data_size,
+        pipeline_stats *stats, std::unique_lock<std::mutex> *ring_lock) {
+    int policy = handler_container->policy.load(std::memory_order_relaxed);
+    // the default policy never takes the lock
+    if (policy == SCRCPY_DELIVERY_COALESCE || handler_container->next_depth.load(std::memory_order_relaxed) != handler_container->depth) {
+        ring_lock->lock();
+        uint64_t head = handler_container->frames_head.load(std::memory_order_relaxed);
+        int next_depth = handler_container->next_depth.load(std::memory_order_relaxed);
+        if (next_depth != handler_container->depth && head == handler_container->frames_released.load(std::memory_order_acquire)) {
+            resize_frames(handler_container, next_depth);
+        }
+        if (policy == SCRCPY_DELIVERY_COALESCE && head > handler_container->frames_tail.load(std::memory_order_relaxed)) {
+            // the frame waiting is taken back and overwritten by the new one
+            handler_container->frames_head.store(head - 1, std::memory_order_relaxed);
+            if (stats) {
+                stats->increase(PIPELINE_COUNTER_COALESCED_FRAMES);
+                stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
+            }
+        }
+    }
+    uint64_t head = handler_container->frames_head.load(std::memory_order_relaxed);
+    if (head - handler_container->frames_released.load(std::memory_order_acquire) >= (uint64_t)handler_container->depth) {
+        if (!ring_lock->owns_lock()) {
+            ring_lock->lock();
+        }
+        if (!this->make_room(handler_container, stats, *ring_lock)) {
+            return NULL;
+        }
+        head = handler_container->frames_head.load(std::memory_order_relaxed);
+    }
+    frame_img_callback_params* params = &handler_container->frames[head % handler_container->depth];
+    // allocated on first use, then grown only
     if (params->buffer_size < (int)frame_data_size) {
-        free(params->frame_data);
+        if (params->frame_data) {
+            free(params->frame_data);
+        }
         auto buffer_size = calc_buffer_size(frame_data_size, MAX_IMG_BUFFER_SIZE);
-        SPDLOG_TRACE("Re-allocating {} bytes for fram cache", buffer_size);
+        SPDLOG_DEBUG("Allocating {} bytes for fram cache", buffer_size);
         params->frame_data = (uint8_t*)malloc(buffer_size);
         if(!params->frame_data) {
-            SPDLOG_ERROR("No enough for re-allocating {} bytes for frame image", buffer_size);
-            return;
+            SPDLOG_ERROR("No enough for allocating {} bytes for frame image", buffer_size);
+            params->buffer_size = 0;
+            return NULL;
         }
         params->buffer_size = buffer_size;
-        SPDLOG_TRACE("Re-allocated {} bytes for fram cache", buffer_size);
-    }
-    // the callback param lock
-    std::lock_guard<std::mutex> param_lock{ params->lock };
-    params->token = handler_container->token;
-    params->status = CALLBACK_PARAM_PENDING;
-    params->device_id = std::string(handler_container->device_id);
-    array_copy_to((char*)frame_data, (char*)params->frame_data, 0, frame_data_size);
-    params->frame_data_size = frame_data_size;
-    params->w = w;
-    params->h = h;
-    params->raw_w = raw_w;
-    params->raw_h = raw_h;
-    // push the frame to back
-    handler_container->frames->push(params);
-    SPDLOG_TRACE("Added frame {} for device {} to callback queue, data size {}, queue size: {}", (uintptr_t)params, 
-            handler_container->device_id, 
-            frame_data_size, handler_container->frames->size());
+    }
+    return params;
+}
+bool frame_img_processor::make_room(device_frame_img_callback* handler_container, pipeline_stats *stats,
+        std::unique_lock<std::mutex> &ring_lock) {
+    bool blocked = false;
+    while (true) {
+        uint64_t head = handler_container->frames_head.load(std::memory_order_relaxed);
+        if (head - handler_container->frames_released.load(std::memory_order_acquire) < (uint64_t)handler_container->depth) {
+            return true;
+        }
+        uint64_t tail = handler_container->frames_tail.load(std::memory_order_relaxed);
+        int policy = handler_container->policy.load(std::memory_order_relaxed);
+        if (policy == SCRCPY_DELIVERY_DROP_OLDEST && head > tail) {
+            // the frames waiting move one slot towards the tail over the oldest one, the last slot is written again
+            for (uint64_t seq = tail; seq + 1 < head; seq++) {
+                std::swap(handler_container->frames[seq % handler_container->depth],
+                        handler_container->frames[(seq + 1) % handler_container->depth]);
+            }
+            handler_container->frames_head.store(head - 1, std::memory_order_relaxed);
+            if (stats) {
+                stats->increase(PIPELINE_COUNTER_DROPPED_OLDEST);
+                stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
+            }
+            return true;
+        }
+        // a ready callback sending a frame would wait for itself
+        if (policy == SCRCPY_DELIVERY_BLOCK && handler_container->stop == 0 &&
+                handler_container->delivering_thread != std::this_thread::get_id()) {
+            if (!blocked && stats) {
+                stats->increase(PIPELINE_COUNTER_BLOCKED_FRAMES);
+            }
+            blocked = true;
+            handler_container->slot_released.wait(ring_lock);
+            continue;
+        }
+        // the callbacks are behind, the frame is dropped rather than waiting for them
+        SPDLOG_TRACE("Frame ring of device {} is full, dropping the frame", handler_container->device_id);
+        if (stats) {
+            stats->increase(PIPELINE_COUNTER_DROPPED_NEWEST);
+            stats->increase(PIPELINE_COUNTER_DROPPED_FRAMES);
+        }
+        return false;
+    }
+}
+void frame_img_processor::resize_frames(device_frame_img_callback* handler_container, int depth) {
+    SPDLOG_INFO("Resizing frame ring of device {} from {} to {} frames", handler_container->device_id, handler_container->depth, depth);
+    free_frame_ring(handler_container);
+    handler_container->depth = depth;
+    handler_container->frames = new frame_img_callback_params[depth];
+}
+int frame_img_processor::set_delivery_policy(char* device_id, int depth, int policy) {
+    if (!device_id || depth < 0 || depth > SCRCPY_DELIVERY_MAX_DEPTH || policy < SCRCPY_DELIVERY_DROP_NEWEST || policy > SCRCPY_DELIVERY_BLOCK) {
+        SPDLOG_ERROR("Invalid delivery depth {} or policy {}", depth, policy);
+        return 1;
+    }
+    // no frame could wait besides the one being delivered, so there's nothing to replace
+    if (depth == 1 && (policy == SCRCPY_DELIVERY_DROP_OLDEST || policy == SCRCPY_DELIVERY_COALESCE)) {
+        SPDLOG_ERROR("Delivery policy {} needs a depth of 2 frames at least", policy);
+        return 1;
+    }
+    frame_delivery_policy delivery_policy;
+    delivery_policy.depth = depth > 0 ? depth : DEFAULT_PENDING_FRAMES;
+    delivery_policy.policy = policy;
+    std::lock_guard<std::mutex> guard{ this->lock };
+    (*this->delivery_policies)[std::string(device_id)] = delivery_policy;
+    auto entry = this->registry->find(std::string(device_id));
+    if (entry != this->registry->end()) {
+        device_frame_img_callback* handler_container = entry->second;
+        std::lock_guard<std::mutex> lock{ handler_container->lock };
+        handler_container->policy = delivery_policy.policy;
+        handler_container->next_depth = delivery_policy.depth;
+        // a writer waiting with SCRCPY_DELIVERY_BLOCK checks the new policy
+        handler_container->slot_released.notify_all();
+    }
+    return 0;
+}
+bool frame_img_processor::wait_for_slot(char* device_id, int timeout_ms, pipeline_stats *stats) {
+    if (!device_id) {
+        return true;
+    }
+    device_frame_img_callback* handler_container = this->ref_device_img_callback(device_id);
+    if (handler_container == NULL) {
+        return true;
+    }
+    bool has_room = true;
+    {
+        std::unique_lock<std::mutex> ring_lock{ handler_container->lock };
+        auto is_full = [handler_container]() {
+            return handler_container->policy.load(std::memory_order_relaxed) == SCRCPY_DELIVERY_BLOCK && handler_container->stop == 0 &&
+                handler_container->frames_head.load(std::memory_order_relaxed) -
+                handler_container->frames_released.load(std::memory_order_acquire) >= (uint64_t)handler_container->depth;
+        };
+        // a ready callback sending a frame would wait for itself
+        if (handler_container->delivering_thread != std::this_thread::get_id() && is_full()) {
+            if (timeout_ms < 0) {
+                if (stats) {
+                    stats->increase(PIPELINE_COUNTER_BLOCKED_FRAMES);
+                }
+                handler_container->slot_released.wait(ring_lock, [&is_full]() { return !is_full(); });
+            } else if (timeout_ms > 0) {
+                if (stats) {
+                    stats->increase(PIPELINE_COUNTER_BLOCKED_FRAMES);
+                }
+                has_room = handler_container->slot_released.wait_for(ring_lock, std::chrono::milliseconds(timeout_ms),
+                        [&is_full]() { return !is_full(); });
+            } else {
+                has_room = false;
+            }
+        }
+    }
+    unref_device_img_callback(handler_container);
+    return has_room;
+}
+void frame_img_processor::push_callback_params(device_frame_img_callback* handler_container, frame_img_callback_params* params,
+        pipeline_stats *stats) {
+    params->stats = stats;
+    uint64_t head = handler_container->frames_head.fetch_add(1, std::memory_order_release) + 1;
+    // only queued if the device isn't queued or being delivered already
+    this->dispatcher->schedule(&handler_container->task);
+    if (stats) {
+        stats->set_queue_depth((int)(head - handler_container->frames_tail.load(std::memory_order_acquire)));
+    }
+    SPDLOG_TRACE("Added frame {} for device {} to callback ring, data size {}", (uintptr_t)params,
+            handler_container->device_id, params->frame_data_size);
 }
 
+void frame_img_processor::stop_device_img_callback(device_frame_img_callback* handler_container) {
+    handler_container->stop = 1;
+    // a writer waiting for a slot gives up and drops its reference of the container
+    handler_container->slot_released.notify_all();
+    this->dispatcher->schedule(&handler_container->task);
+}
 void frame_img_processor::clean_device_img_callback_state(std::string key, bool remove_from_registry) {
     auto entry = this->registry->find(key);
     if (entry == this->registry->end()) {
@@ -344,8 +662,7 @@ void frame_img_processor::clean_device_img_callback_state(std::string key, bool
     // must lock first
     std::lock_guard<std::mutex> lock(handler_container->lock);
     SPDLOG_INFO("Marking callback container {} to shutdown for device {}",(uintptr_t)handler_container, handler_container->device_id);
-    // mark as stop
-    handler_container->stop = 1;
+    this->stop_device_img_callback(handler_container);
     if (remove_from_registry) {
         this->registry->erase(entry);
     }
@@ -356,7 +673,126 @@ void frame_img_processor::del_all(char* device_id) {
         return;
     }
     SPDLOG_INFO("{} Trying to remove all frame image callbacks for {}", (uintptr_t) this, device_id);
-    clean_device_img_callback_state(std::string(device_id), true);
+    clear_device_handlers(std::string(device_id), false);
+}
+void frame_img_processor::del_all_raw(char* device_id) {
+    if (!device_id) {
+        SPDLOG_ERROR("Invalid argument for del_all_raw callbacks");
+        return;
+    }
+    SPDLOG_INFO("{} Trying to remove all raw frame callbacks for {}", (uintptr_t) this, device_id);
+    clear_device_handlers(std::string(device_id), true);
+}
+void frame_img_processor::clear_device_handlers(std::string device_id, bool raw) {
+    std::lock_guard<std::mutex> guard{ this->lock };
+    auto entry = this->registry->find(device_id);
+    if (entry == this->registry->end()) {
+        return;
+    }
+    device_frame_img_callback* handler_container = entry->second;
+    std::lock_guard<std::mutex> lock(handler_container->lock);
+    if (raw) {
+        handler_container->raw_handlers.clear();
+        handler_container->raw_format = -1;
+    } else {
+        handler_container->handler_count = 0;
+    }
+    this->update_accepted_frames(handler_container);
+    if (handler_container->handler_count == 0 && handler_container->raw_handlers.empty()) {
+        SPDLOG_INFO("Marking callback container {} to shutdown for device {}",(uintptr_t)handler_container, handler_container->device_id);
+        this->stop_device_img_callback(handler_container);
+        this->registry->erase(entry);
+    }
+}
+void frame_img_processor::add_raw(char* device_id, int format, frame_raw_callback_handler callback, char *token) {
+    if (!device_id || !token || !callback || format < SCRCPY_PIXEL_FORMAT_BGRA || format > SCRCPY_PIXEL_FORMAT_I420) {
+        SPDLOG_ERROR("Invalid arguments for add a raw frame callback");
+        return;
+    }
+    std::lock_guard<std::mutex> guard{ this->lock };
+    device_frame_img_callback* handler_container = NULL;
+    auto entry = this->registry->find(std::string(device_id));
+    if (entry == this->registry->end()) {
+        handler_container = this->create_device_img_callback(device_id, token);
+        if (!handler_container) {
+            return;
+        }
+    } else {
+        handler_container = entry->second;
+    }
+    std::lock_guard<std::mutex> lock { handler_container->lock };
+    SPDLOG_INFO("Adding raw frame callback {} with format {} for device {}", (uintptr_t)callback, format, device_id);
+    handler_container->raw_format = format;
+    handler_container->raw_handlers.push_back(callback);
+    this->update_accepted_frames(handler_container);
+}
+int frame_img_processor::get_raw_format(char* device_id) {
+    std::lock_guard<std::mutex> guard{ this->lock };
+    auto entry = this->registry->find(std::string(device_id));
+    if (entry == this->registry->end()) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock { entry->second->lock };
+    return entry->second->raw_handlers.empty() ? -1 : entry->second->raw_format;
+}
+bool frame_img_processor::has_handlers(char* device_id) {
+    std::lock_guard<std::mutex> guard{ this->lock };
+    auto entry = this->registry->find(std::string(device_id));
+    if (entry == this->registry->end()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock { entry->second->lock };
+    return entry->second->handler_count > 0;
+}
+void frame_img_processor::set_ready_callback(char* device_id, scrcpy_frame_ready_callback callback) {
+    if (!device_id) {
+        SPDLOG_ERROR("Invalid arguments for set a frame ready callback");
+        return;
+    }
+    std::string key(device_id);
+    std::shared_ptr<frame_ready_state> ready_state;
+    {
+        std::lock_guard<std::mutex> guard{ this->lock };
+        // shared with the containers of the device, including the ones stopping
+        ready_state = this->get_ready_state(key);
+        {
+            std::lock_guard<std::mutex> ready_guard{ ready_state->lock };
+            ready_state->callback = callback;
+        }
+        auto entry = this->registry->find(key);
+        if (entry != this->registry->end()) {
+            std::lock_guard<std::mutex> lock { entry->second->lock };
+            entry->second->ready_requested = true;
+            this->dispatcher->schedule(&entry->second->task);
+        }
+    }
+    if (!callback) {
+        // without holding the global lock, the callback could send frames
+        std::unique_lock<std::mutex> ready_lock{ ready_state->lock };
+        ready_state->call_done.wait(ready_lock, [&ready_state]() {
+            return ready_state->calls == 0 || ready_state->calling_thread == std::this_thread::get_id();
+        });
+    }
+}
+std::shared_ptr<frame_ready_state> frame_img_processor::get_ready_state(std::string device_id) {
+    std::shared_ptr<frame_ready_state> &ready_state = (*this->ready_states)[device_id];
+    if (!ready_state) {
+        ready_state = std::make_shared<frame_ready_state>();
+    }
+    return ready_state;
+}
+void frame_img_processor::request_ready(char* device_id) {
+    if (!device_id) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard{ this->lock };
+    auto entry = this->registry->find(std::string(device_id));
+    if (entry == this->registry->end()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock { entry->second->lock };
+    entry->second->ready_requested = true;
+    this->dispatcher->schedule(&entry->second->task);
 }
 int frame_img_processor::calc_buffer_size(int frame_data_size, int current_buffer_size) {
     if (frame_data_size > current_buffer_size) {
@@ -1,28 +1,26 @@
 #ifndef FRAME_IMG_CALLBACK_DEF
 #define FRAME_IMG_CALLBACK_DEF
 #include "model.h"
+#include "pipeline_stats.h"
+#include "callback_dispatcher.h"
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
 #define PRE_ALLOC_CALLBASCK_SIZE 4
-#define MAX_PENDING_FRAMES 4
-#define CALLBACK_PARAM_SENT 0
-#define CALLBACK_PARAM_EMPTY 1
-#define CALLBACK_PARAM_PENDING 2
-#define CALLBACK_PARAM_SENDING 2
-// callback params for a single frame image
+// slots of the frame ring of a device without a delivery policy
+#define DEFAULT_PENDING_FRAMES SCRCPY_DELIVERY_DEFAULT_DEPTH
+// callback params for a single frame image, a slot of the frame ring of a device
 typedef struct frame_img_callback_params {
-    // lock
-    std::mutex lock;
-    // device id
-    std::string device_id;
-    // the image data
+    // the raw frame data
     uint8_t* frame_data = NULL;
-    // token
-    char* token = NULL;
-    // the image data length
+    // the encoded image, swapped with the buffer of the sender
+    std::vector<uint8_t> image;
+    // the raw frame or image data length
     uint32_t frame_data_size = 0;
     // the image width
     int w = -1;
@@ -32,12 +30,41 @@ typedef struct frame_img_callback_params {
     int raw_w = -1;
     //the screen height
     int raw_h = -1;
-    // the param status, @see CALLBACK_PARAM_EMPTY CALLBACK_PARAM_PENDING CALLBACK_PARAM_SENDING CALLBACK_PARAM_SENT
-    int status = CALLBACK_PARAM_EMPTY;
     // buffer size
     int buffer_size = 0;
+    // pixel format of a raw frame, -1 for png image. @see SCRCPY_PIXEL_FORMAT_BGRA
+    int format = -1;
+    // planes of a raw frame, copied one after another into frame_data
+    int planes = 0;
+    int plane_offset[SCRCPY_MAX_FRAME_PLANES] = {0};
+    int linesize[SCRCPY_MAX_FRAME_PLANES] = {0};
+    // changed regions of a raw frame, -1 if not tracked
+    int dirty_rect_count = -1;
+    scrcpy_area dirty_rects[SCRCPY_MAX_DIRTY_RECTS];
+    // number of the raw frame among the ones sent for the device, dropped ones included
+    uint64_t raw_seq = 0;
+    // pipeline stats of the device the frame was sent with, could be NULL
+    pipeline_stats *stats = NULL;
 } frame_img_callback_params;
 
+// the frame ready callback of a device, shared by the processor and the callback containers of the device
+typedef struct frame_ready_state {
+    std::mutex lock;
+    // notified when a call of the callback returned
+    std::condition_variable call_done;
+    scrcpy_frame_ready_callback callback = NULL;
+    // delivering tasks inside the callback
+    int calls = 0;
+    // thread of the last call being made, removing the callback from inside it doesn't wait for itself
+    std::thread::id calling_thread;
+} frame_ready_state;
+
+// the callback queue setup of a device, @see scrcpy_set_delivery_policy
+typedef struct frame_delivery_policy {
+    int depth = DEFAULT_PENDING_FRAMES;
+    int policy = SCRCPY_DELIVERY_DROP_NEWEST;
+} frame_delivery_policy;
+
 // callback setup for a device
 typedef struct device_frame_img_callback {
     // the device id
@@ -48,18 +75,60 @@ typedef struct device_frame_img_callback {
     int handler_count = 0;
     // allocated handler array size
     int allocated_handler_space = 0;
-    // thread handle for the device
-    std::thread::native_handle_type thread_handle = NULL;
     // handlers
     frame_callback_handler* handlers = NULL;
-    // lock object
+    // raw frame handlers
+    std::vector<frame_raw_callback_handler> raw_handlers;
+    // pixel format for raw frame handlers
+    int raw_format = -1;
+    // lock object, not held by the dispatcher while invoking the handlers
     std::mutex lock;
-    // buffered frames
-    std::queue<frame_img_callback_params*> *frames = NULL;
-    // allocated frames for buffering
-    int allocated_frames = 0;
+    // delivers the frames of the device, scheduled when a frame is queued, the ready callback is requested or it should stop
+    dispatch_task task;
+    callback_dispatcher *dispatcher = NULL;
+    // handlers being invoked, copied while holding the lock
+    std::vector<frame_callback_handler> delivering_handlers;
+    std::vector<frame_raw_callback_handler> delivering_raw_handlers;
+    // single producer single consumer ring of depth preallocated frames
+    // written by invoke/invoke_raw without the lock, read by the delivering task
+    frame_img_callback_params* frames = NULL;
+    // slots of the ring, only changed by a writer holding both locks while the ring is empty
+    int depth = DEFAULT_PENDING_FRAMES;
+    // depth set by set_delivery_policy, applied by the next writer once the ring is empty
+    std::atomic<int> next_depth = DEFAULT_PENDING_FRAMES;
+    // @see SCRCPY_DELIVERY_DROP_NEWEST
+    std::atomic<int> policy = SCRCPY_DELIVERY_DROP_NEWEST;
+    // frames written since created, lowered by the writers holding the lock to drop or replace waiting frames
+    std::atomic<uint64_t> frames_head = 0;
+    // frames taken by the delivering task since created, only changed with the lock
+    std::atomic<uint64_t> frames_tail = 0;
+    // frames delivered since created, their slots are free for writing
+    std::atomic<uint64_t> frames_released = 0;
+    // held while writing a frame, since a ready callback could send frames besides the decoding thread
+    std::mutex write_lock;
+    // notified with the lock when a slot is released or stopping, for the writers waiting with SCRCPY_DELIVERY_BLOCK
+    std::condition_variable slot_released;
+    // thread running the delivering task, a ready callback sending a frame from it is never blocked
+    std::thread::id delivering_thread;
+    // raw frames sent by invoke_raw, counted before they could be dropped
+    std::atomic<uint64_t> raw_frames_sent = 0;
+    // raw_seq of the last raw frame delivered, only used by the delivering task
+    // the dirty rects of the next one are relative to a frame the handlers never got if it's not the next number
+    uint64_t raw_frames_delivered = 0;
+    // if there are png/raw frame handlers, so the writers could drop frames without the lock
+    std::atomic<bool> accepts_png = false;
+    std::atomic<bool> accepts_raw = false;
+    // its callback is invoked by the delivering task when there's no pending frame, after frames were delivered or it's requested
+    std::shared_ptr<frame_ready_state> ready_state;
+    // invoke the ready callback the next time there's no pending frame
+    bool ready_requested = true;
+    // the ready callback asked to be called again at ready_retry_at even without a new frame
+    bool ready_retry = false;
+    dispatch_time ready_retry_at;
     // stopping flag for this device
     int stop = 0;
+    // held by the delivering task and the writers found it in the registry, the last one releases the container
+    std::atomic<int> refs = 1;
 } device_frame_img_callback;
 /*
  * image process for device's frames
@@ -68,29 +137,85 @@ class frame_img_processor {
     private:
         // callback registry
         std::map<std::string, device_frame_img_callback*> *registry = NULL;
+        // frame ready callbacks, kept while the device has no frame callback
+        std::map<std::string, std::shared_ptr<frame_ready_state>> *ready_states = NULL;
+        // delivery policies, kept while the device has no frame callback
+        std::map<std::string, frame_delivery_policy> *delivery_policies = NULL;
         // locker for the handler
         std::mutex lock;
+        // runs the delivering tasks of the devices
+        callback_dispatcher *dispatcher = NULL;
 
         /*
-         * start callback thread for the device
-         * @param			device_id			the device's id
-         * @param			handler_container	handle's container object
-         * @return			0 if ok
-         */
-        int start_callback_thread(char* device_id, device_frame_img_callback* handler_container);
-        /*
-         * the thread body
+         * the delivering task of a device, invokes the handlers for the queued frames and the ready callback once they're drained
+         * it could still be running after the processor was freed, so it only touches the container
+         * @return			@see DISPATCH_TASK_IDLE
          */
-        int callback_thread(device_frame_img_callback* callback_item);
+        static int deliver_frames(device_frame_img_callback* callback_item);
 
         int calc_buffer_size(int frame_data_size, int current_buffer_size);
 
-        void release_device_img_callback(device_frame_img_callback* callback_item);
+        static void release_device_img_callback(device_frame_img_callback* callback_item);
+        /*
+         * find the container of a device for writing a frame and hold it with the global lock
+         * @return			NULL if the device has no container, or a container released by unref_device_img_callback
+         */
+        device_frame_img_callback* ref_device_img_callback(char *device_id);
+        /*
+         * drop a reference of the container, it's released by the last one after the delivering task stopped
+         */
+        static void unref_device_img_callback(device_frame_img_callback* callback_item);
 
         void clean_device_img_callback_state(std::string device_id, bool remove_from_registry);
+        /*
+         * create the callback container for a device, the global lock must be held
+         * @return			NULL if failed
+         */
+        device_frame_img_callback* create_device_img_callback(char *device_id, char *token);
+        /*
+         * remove png or raw frame handlers of a device, the device stops if there's no handler left
+         */
+        void clear_device_handlers(std::string device_id, bool raw);
+        /*
+         * update accepts_png and accepts_raw after the handlers changed and schedule the delivering task, the container lock must be held
+         */
+        void update_accepted_frames(device_frame_img_callback* handler_container);
+        /*
+         * get the next free slot of the frame ring for writing @frame_data_size bytes, the write_lock must be held
+         * a full ring is handled by the delivery policy of the device, only SCRCPY_DELIVERY_BLOCK waits for the delivering task
+         * @param			ring_lock			deferred lock of the container lock, locked here when the policy needs it and kept until
+         *									the frame is pushed, so the delivering task never sees a waiting frame being replaced
+         * @return			NULL if the frame is dropped or out of memory
+         */
+        frame_img_callback_params* acquire_callback_params(device_frame_img_callback* handler_container, uint32_t frame_data_size,
+                pipeline_stats *stats, std::unique_lock<std::mutex> *ring_lock);
+        /*
+         * publish the slot got from acquire_callback_params to the delivering task, the write_lock must be held
+         */
+        void push_callback_params(device_frame_img_callback* handler_container, frame_img_callback_params* params, pipeline_stats *stats);
+        /*
+         * free a slot of a full ring by the delivery policy of the device, the write_lock and @ring_lock must be held
+         * @return			false if the new frame should be dropped
+         */
+        bool make_room(device_frame_img_callback* handler_container, pipeline_stats *stats, std::unique_lock<std::mutex> &ring_lock);
+        /*
+         * replace the frame ring with one of @depth slots, both locks must be held and the ring must be empty
+         */
+        static void resize_frames(device_frame_img_callback* handler_container, int depth);
+        /*
+         * mark the container to stop and schedule its delivering task to release it, the container lock must be held
+         */
+        void stop_device_img_callback(device_frame_img_callback* handler_container);
+        /*
+         * get the ready callback state of a device, created on first use, the global lock must be held
+         */
+        std::shared_ptr<frame_ready_state> get_ready_state(std::string device_id);
 
     public:
-        frame_img_processor();
+        /*
+         * @param		dispatcher		runs the callbacks of the devices, NULL for the dispatcher shared by all receivers
+         */
+        frame_img_processor(callback_dispatcher *dispatcher = NULL);
         ~frame_img_processor();
         /*
          * add a callback for device
@@ -111,7 +236,8 @@ class frame_img_processor {
          */
         void del_all(char* device_id);
         /*
-         * invoke callback handler(s) for specified device
+         * invoke callback handler(s) for specified device, the image is copied
+         * a full queue of frames is handled by the delivery policy of the device, @see set_delivery_policy
          * @param		token				token of the server
          * @param		device_id			the device's id
          * @param		frame_data			the image data
@@ -120,7 +246,91 @@ class frame_img_processor {
          * @param		h					image height
          * @param		raw_w				original screen width
          * @param		raw_h				original screen height
+         * @param		stats				pipeline stats of the device for recording callback timing, could be NULL
+         */
+        void invoke(char * token, char* device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h,
+                pipeline_stats *stats = NULL);
+        /*
+         * invoke callback handler(s) for specified device without copying the image
+         * the image is taken by swapping the vector with the one of a free slot, so frame_data gets the buffer of an earlier frame
+         * back for reusing, its content is undefined. frame_data is kept as is if the frame is dropped
+         * @param		token				token of the server
+         * @param		device_id			the device's id
+         * @param		frame_data			the image data
+         * @param		w					image width
+         * @param		h					image height
+         * @param		raw_w				original screen width
+         * @param		raw_h				original screen height
+         * @param		stats				pipeline stats of the device for recording callback timing, could be NULL
+         */
+        void invoke(char * token, char* device_id, std::vector<uint8_t>* frame_data, int w, int h, int raw_w, int raw_h,
+                pipeline_stats *stats = NULL);
+        /*
+         * add a raw frame callback for device
+         * @param		device_id		the device's id
+         * @param		format			pixel format for all raw frame callbacks of the device, @see SCRCPY_PIXEL_FORMAT_BGRA
+         * @param		callback		the callback function
+         * @param		token			server's token
+         */
+        void add_raw(char* device_id, int format, frame_raw_callback_handler callback, char *token);
+        /*
+         * delete all raw frame callbacks for specified device id
+         * @param		device_id		the devices' id
+         */
+        void del_all_raw(char* device_id);
+        /*
+         * get the pixel format of a device's raw frame callbacks
+         * @param		device_id		the devices' id
+         * @return		-1 if the device has no raw frame callback
+         */
+        int get_raw_format(char* device_id);
+        /*
+         * check if a device has png frame image callbacks
+         * @param		device_id		the devices' id
+         */
+        bool has_handlers(char* device_id);
+        /*
+         * invoke raw frame callback handler(s) for specified device, the frame is copied
+         * a full queue of frames is handled by the delivery policy of the device, @see set_delivery_policy
+         * @param		token				token of the server
+         * @param		device_id			the device's id
+         * @param		frame				the scaled frame
+         * @param		raw_w				original screen width
+         * @param		raw_h				original screen height
+         * @param		stats				pipeline stats of the device for recording callback timing, could be NULL
+         */
+        void invoke_raw(char * token, char* device_id, scrcpy_frame *frame, int raw_w, int raw_h, pipeline_stats *stats = NULL);
+        /*
+         * set the method invoked from the delivering task once all frames of the device were delivered
+         * it's invoked without holding any lock, so it could send a new frame with invoke/invoke_raw
+         * removing it waits for the calls being made, so the objects it uses could be freed after it returned
+         * @param		device_id		the devices' id
+         * @param		callback		the callback method, NULL to remove it
+         */
+        void set_ready_callback(char* device_id, scrcpy_frame_ready_callback callback);
+        /*
+         * schedule the delivering task of a device to invoke its ready callback once there's no pending frame
+         * @param		device_id		the devices' id
+         */
+        void request_ready(char* device_id);
+        /*
+         * set the frames queued for the callbacks of a device and what happens to new frames once they're full
+         * kept while the device has no callback, a new depth applies once the queued frames were delivered
+         * @param		device_id		the devices' id
+         * @param		depth			frames queued including the one being delivered, 0 for DEFAULT_PENDING_FRAMES,
+         *								at least 2 for the policies replacing a waiting frame
+         * @param		policy			@see SCRCPY_DELIVERY_DROP_NEWEST
+         * @return		0 if ok, 1 if the depth or the policy is invalid
+         */
+        int set_delivery_policy(char* device_id, int depth, int policy);
+        /*
+         * wait until the frame ring of a device using SCRCPY_DELIVERY_BLOCK has a free slot, so a writer could wait
+         * before taking its own locks, a frame written right after that rarely waits in invoke
+         * @param		device_id		the devices' id
+         * @param		timeout_ms		max time to wait, 0 for not waiting, -1 for waiting until a slot is released
+         * @param		stats			for counting the frames waited, could be NULL
+         * @return		false if the ring is still full
          */
-        void invoke(char * token, char* device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h);
+        bool wait_for_slot(char* device_id, int timeout_ms, pipeline_stats *stats = NULL);
 };
 #endif // !FRAME_IMG_CALLBACK_DEF
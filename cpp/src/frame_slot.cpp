@@ -0,0 +1,74 @@
+#include "frame_slot.h"
+#include <string.h>
+#include <chrono>
+
+frame_slot::frame_slot(uint64_t seq) : seq(seq), last_wait_at(std::chrono::steady_clock::now()) {}
+frame_slot::~frame_slot() {
+    this->close();
+}
+void frame_slot::put(uint8_t *data, uint32_t size, int w, int h, int raw_w, int raw_h) {
+    {
+        std::lock_guard<std::mutex> guard{ this->lock };
+        if (this->closed) {
+            return;
+        }
+        // the capacity is kept, so it's reallocated only when a bigger frame arrives
+        this->data.assign(data, data + size);
+        this->img_size = scrcpy_rect{ w, h };
+        this->orig_size = scrcpy_rect{ raw_w, raw_h };
+        this->seq++;
+    }
+    this->frame_arrived.notify_all();
+}
+int frame_slot::wait_next(uint64_t last_seq, int timeout_ms, uint8_t *out_buffer, uint32_t cap, scrcpy_frame_info *info) {
+    std::unique_lock<std::mutex> guard{ this->lock };
+    auto is_ready = [this, last_seq]() { return this->closed || this->seq > last_seq; };
+    bool arrived = true;
+    this->waiters++;
+    if (timeout_ms < 0) {
+        this->frame_arrived.wait(guard, is_ready);
+    } else {
+        arrived = this->frame_arrived.wait_for(guard, std::chrono::milliseconds(timeout_ms), is_ready);
+    }
+    this->waiters--;
+    // a caller polling without waiting still wants the frames
+    this->last_wait_at = std::chrono::steady_clock::now();
+    if (this->closed) {
+        return SCRCPY_WAIT_FRAME_CLOSED;
+    }
+    if (!arrived) {
+        return SCRCPY_WAIT_FRAME_TIMEOUT;
+    }
+    uint32_t size = (uint32_t)this->data.size();
+    if (info) {
+        info->seq = this->seq;
+        info->size = size;
+        info->img_size = this->img_size;
+        info->orig_size = this->orig_size;
+    }
+    if (!out_buffer || cap < size) {
+        return SCRCPY_WAIT_FRAME_BUFFER_TOO_SMALL;
+    }
+    memcpy(out_buffer, this->data.data(), size);
+    return SCRCPY_WAIT_FRAME_OK;
+}
+bool frame_slot::is_idle() {
+    std::lock_guard<std::mutex> guard{ this->lock };
+    return this->waiters == 0 &&
+        std::chrono::steady_clock::now() - this->last_wait_at >= std::chrono::milliseconds(FRAME_SLOT_IDLE_MS);
+}
+void frame_slot::touch() {
+    std::lock_guard<std::mutex> guard{ this->lock };
+    this->last_wait_at = std::chrono::steady_clock::now();
+}
+uint64_t frame_slot::last_seq() {
+    std::lock_guard<std::mutex> guard{ this->lock };
+    return this->seq;
+}
+void frame_slot::close() {
+    {
+        std::lock_guard<std::mutex> guard{ this->lock };
+        this->closed = true;
+    }
+    this->frame_arrived.notify_all();
+}
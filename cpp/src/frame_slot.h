@@ -0,0 +1,74 @@
+#ifndef SCRCPY_FRAME_SLOT
+#define SCRCPY_FRAME_SLOT
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include "scrcpy_recv/scrcpy_recv.h"
+
+// a slot nobody waited in for this long is idle, frames are no longer encoded for it
+#define FRAME_SLOT_IDLE_MS 1000
+
+/*
+ * the latest frame image of a device for scrcpy_wait_next_frame
+ * every new frame replaces the previous one, so waiters skip the frames they were too slow for
+ */
+class frame_slot {
+    public:
+        /*
+         * @param       seq                 seq of the last frame, a slot replacing an idle one continues its seq
+         */
+        frame_slot(uint64_t seq = 0);
+        ~frame_slot();
+        /*
+         * copy a frame image into the slot and wake up the waiters
+         * @param       data                the image data
+         * @param       size                image data length
+         * @param       w                   image width
+         * @param       h                   image height
+         * @param       raw_w               original screen width
+         * @param       raw_h               original screen height
+         */
+        void put(uint8_t *data, uint32_t size, int w, int h, int raw_w, int raw_h);
+        /*
+         * wait for a frame newer than last_seq and copy it out
+         * @param       last_seq            seq of the last frame got, 0 for any frame
+         * @param       timeout_ms          max time to wait, 0 for not waiting, -1 for waiting until a frame arrives
+         * @param       out_buffer          for receiving the image data
+         * @param       cap                 size of out_buffer
+         * @param       info                for receiving seq, size of the frame, could be NULL
+         * @return      @see SCRCPY_WAIT_FRAME_OK
+         */
+        int wait_next(uint64_t last_seq, int timeout_ms, uint8_t *out_buffer, uint32_t cap, scrcpy_frame_info *info);
+        /*
+         * wake up the waiters and make them return SCRCPY_WAIT_FRAME_CLOSED, new frames are ignored
+         */
+        void close();
+        /*
+         * if nobody is waiting and wait_next was not called for FRAME_SLOT_IDLE_MS
+         */
+        bool is_idle();
+        /*
+         * keep the slot from being idle, for a caller going to wait in it
+         */
+        void touch();
+        /*
+         * @return      seq of the last frame put
+         */
+        uint64_t last_seq();
+    private:
+        std::mutex lock;
+        std::condition_variable frame_arrived;
+        std::vector<uint8_t> data;
+        // 0 before the first frame
+        uint64_t seq = 0;
+        scrcpy_rect img_size = { 0, 0 };
+        scrcpy_rect orig_size = { 0, 0 };
+        bool closed = false;
+        // threads inside wait_next
+        int waiters = 0;
+        // when wait_next returned or the slot was touched the last time
+        std::chrono::steady_clock::time_point last_wait_at;
+};
+#endif //!SCRCPY_FRAME_SLOT
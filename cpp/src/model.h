@@ -2,25 +2,73 @@
 #define SCRCPY_MODEL_DEFINE
 #include "stdint.h"
 #include "scrcpy_recv/scrcpy_recv.h"
+#include "pipeline_stats.h"
 #include <functional>
+#include <vector>
 /*
 * Netowork buffer config
 */
 typedef struct connection_buffer_config {
 	int network_buffer_size_kb;
 	int video_packet_buffer_size_kb;
+	// decoder profile of devices without their own one, @see SCRCPY_DECODER_PROFILE_DEFAULT
+	int decoder_profile;
 } connection_buffer_config;
 /*
 * image size
 */
 typedef scrcpy_rect image_size;
 
+/*
+* encoded format of frame images
+*/
+typedef struct image_output_format {
+	// @see SCRCPY_OUTPUT_FORMAT_PNG
+	int format;
+	// png compression level or jpeg/webp quality, @see scrcpy_set_output_format
+	int quality;
+} image_output_format;
+
+/*
+* how decoded frames of a device are delivered
+*/
+typedef struct device_delivery_cfg {
+	// only convert the newest decoded frame once the callbacks are ready for it
+	bool latest_frame_only;
+	// max frames converted per second, 0 for no limit
+	int max_fps;
+	// skip decoding while the device has no frame callback, only keeping packets from the latest IDR
+	bool drain_when_idle;
+	// only decode IDR packets, so one frame per GOP is delivered
+	bool keyframe_only;
+	// keep the deblocking filter and bicubic scaling even if frames are scaled down a lot
+	bool full_res_decoding;
+	// skip scaling, encoding and callbacks of frames identical to the last one sent
+	bool skip_identical_frames;
+	// still send an identical frame if the last one was sent this many ms ago, 0 for never
+	int heartbeat_ms;
+	// report the regions of raw frames changed since the last one sent
+	bool dirty_rects;
+	// only keep the latest decoded frame, scaled and encoded when a snapshot is captured
+	bool snapshot_mode;
+} device_delivery_cfg;
+
 // frame image callback handler
 typedef scrcpy_frame_img_callback frame_callback_handler;
 
+// raw frame callback handler
+typedef scrcpy_frame_raw_callback frame_raw_callback_handler;
+
 // frame image size configured callback method
 typedef std::function<void(char*, scrcpy_rect)> scrcpy_frame_img_size_cfg_callback;
 
+// called with the device id once the callbacks of the device are waiting for a new frame
+// returns the ms to wait before being called again without a new frame, or -1 to wait for the next frame or request
+typedef std::function<int(char*)> scrcpy_frame_ready_callback;
+
+// captures the latest decoded frame: (width, height, output format, buffer for the image, info), @see SCRCPY_SNAPSHOT_OK
+typedef std::function<int(int, int, image_output_format, std::vector<uint8_t>*, scrcpy_frame_info*)> scrcpy_snapshot_callback;
+
 
 /*
 * video decode callback handler class
@@ -30,14 +78,13 @@ public:
 	/*
 	* video image callback handler
 	* @param			device_id				the device's identifier
-	* @param			frame_data				frame image data
-	* @param			frame_data_size			frame image data length
+	* @param			frame_data				frame image data, could be swapped with a recycled buffer of an earlier frame
 	* @param			w						image width
 	* @param			h						image height
 	* @param			raw_w					original screen width
 	* @param			raw_h					original screen height
 	*/
-	virtual void on_video_callback(char* device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h) = 0;
+	virtual void on_video_callback(char* device_id, std::vector<uint8_t>* frame_data, int w, int h, int raw_w, int raw_h) = 0;
 	/*
 	* get configured image size of a device
 	* @param			device_id				the device's identifier
@@ -62,6 +109,73 @@ public:
      * @param       device_id               the device's identifier
     */
     virtual void remove_frame_img_size_cfg_callback(char *device_id) = 0;
+    /**
+     * get the pipeline stats of a device
+     * @param       device_id               the device's identifier
+     * @return      the stats for recording stage timing, or NULL if no need to record
+    */
+    virtual pipeline_stats* get_pipeline_stats(char *device_id) = 0;
+    /**
+     * raw frame callback handler
+     * @param       device_id               the device's identifier
+     * @param       frame                   the scaled frame, only valid within the call
+     * @param       raw_w                   original screen width
+     * @param       raw_h                   original screen height
+    */
+    virtual void on_raw_frame_callback(char *device_id, scrcpy_frame *frame, int raw_w, int raw_h) = 0;
+    /**
+     * get the pixel format of a device's raw frame callbacks
+     * @param       device_id               the device's identifier
+     * @return      @see SCRCPY_PIXEL_FORMAT_BGRA, -1 if there's no raw frame callback
+    */
+    virtual int get_raw_frame_format(char *device_id) = 0;
+    /**
+     * check if a device has png frame image callbacks
+     * @param       device_id               the device's identifier
+    */
+    virtual bool has_frame_img_callback(char *device_id) = 0;
+    /**
+     * get the encoded format of a device's frame images
+     * @param       device_id               the device's identifier
+     * @return      png with default compression level if not configured
+    */
+    virtual image_output_format get_output_format(char *device_id) = 0;
+    /**
+     * get how decoded frames of a device are delivered
+     * @param       device_id               the device's identifier
+    */
+    virtual device_delivery_cfg get_delivery_cfg(char *device_id) = 0;
+    /**
+     * set the callback method invoked when the frame callbacks of a device are ready for a new frame
+     * @param       device_id               the device's identifier
+     * @param       callback                the callback method, NULL to remove it
+    */
+    virtual void set_frame_ready_callback(char *device_id, scrcpy_frame_ready_callback callback) = 0;
+    /**
+     * invoke the frame ready callback of a device once its callbacks are waiting for a frame, e.g. a frame was kept for them
+     * @param       device_id               the device's identifier
+    */
+    virtual void request_frame_ready(char *device_id) = 0;
+    /**
+     * get the h264 decoder profile of a device
+     * @param       device_id               the device's identifier
+     * @return      @see SCRCPY_DECODER_PROFILE_DEFAULT, -1 if not configured for the device
+    */
+    virtual int get_decoder_profile(char *device_id) = 0;
+    /**
+     * set the callback method capturing a snapshot of a device's latest decoded frame
+     * @param       device_id               the device's identifier
+     * @param       callback                the callback method, NULL to remove it
+    */
+    virtual void set_snapshot_callback(char *device_id, scrcpy_snapshot_callback callback) = 0;
+    /**
+     * wait until the callback queue of a device has room for a frame, if it's full and the device uses SCRCPY_DELIVERY_BLOCK
+     * called before taking the locks of the decoder, so waiting for slow callbacks never holds them
+     * @param       device_id               the device's identifier
+     * @param       timeout_ms              max time to wait, 0 for not waiting, -1 for waiting until there's room
+     * @return      false if the queue is still full
+    */
+    virtual bool wait_for_frame_slot(char *device_id, int timeout_ms) = 0;
 };
 
 #endif // !SCRCPY_MODEL_DEFINE
@@ -0,0 +1,107 @@
+#include "packet_ring.h"
+#include <stdlib.h>
+#include <string.h>
+
+packet_ring::packet_ring(int size) {
+    this->size = size > 0 ? size : PACKET_RING_DEFAULT_SIZE;
+    this->slots = new packet_ring_slot[this->size];
+}
+packet_ring::~packet_ring() {
+    if (!this->slots) {
+        return;
+    }
+    for (int i = 0; i < this->size; i++) {
+        if (this->slots[i].buffer) {
+            av_buffer_unref(&this->slots[i].buffer);
+            this->slots[i].data = NULL;
+        }
+    }
+    delete[] this->slots;
+    this->slots = NULL;
+}
+packet_ring_slot* packet_ring::try_acquire_write() {
+    if (this->closed.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    uint64_t head = this->head.load(std::memory_order_relaxed);
+    if (head - this->tail.load(std::memory_order_acquire) >= (uint64_t)this->size) {
+        return NULL;
+    }
+    return &this->slots[head % this->size];
+}
+packet_ring_slot* packet_ring::acquire_write() {
+    while (true) {
+        uint32_t observed = this->signal.load(std::memory_order_acquire);
+        packet_ring_slot *slot = this->try_acquire_write();
+        if (slot || this->is_closed()) {
+            return slot;
+        }
+        this->signal.wait(observed, std::memory_order_acquire);
+    }
+}
+void packet_ring::commit_write() {
+    this->head.fetch_add(1, std::memory_order_release);
+    this->notify();
+}
+packet_ring_slot* packet_ring::try_acquire_read() {
+    uint64_t tail = this->tail.load(std::memory_order_relaxed);
+    if (tail == this->head.load(std::memory_order_acquire)) {
+        return NULL;
+    }
+    return &this->slots[tail % this->size];
+}
+packet_ring_slot* packet_ring::acquire_read() {
+    while (true) {
+        uint32_t observed = this->signal.load(std::memory_order_acquire);
+        packet_ring_slot *slot = this->try_acquire_read();
+        if (slot) {
+            return slot;
+        }
+        if (this->is_closed()) {
+            // packets committed right before closing
+            return this->try_acquire_read();
+        }
+        this->signal.wait(observed, std::memory_order_acquire);
+    }
+}
+void packet_ring::commit_read() {
+    this->tail.fetch_add(1, std::memory_order_release);
+    this->notify();
+}
+int packet_ring::reserve(packet_ring_slot *slot, int length, int keep_length) {
+    size_t required = (size_t)length + AV_INPUT_BUFFER_PADDING_SIZE;
+    if (!slot->buffer || slot->buffer->size < required || !av_buffer_is_writable(slot->buffer)) {
+        size_t size = (required / (PACKET_RING_SLOT_GROW_SIZE) + 1) * (PACKET_RING_SLOT_GROW_SIZE);
+        AVBufferRef *buffer = av_buffer_alloc(size);
+        if (!buffer) {
+            return 1;
+        }
+        if (slot->buffer) {
+            if (keep_length > 0) {
+                memcpy(buffer->data, slot->buffer->data, keep_length);
+            }
+            // the decoder keeps the old one alive until it is done
+            av_buffer_unref(&slot->buffer);
+        }
+        slot->buffer = buffer;
+        slot->data = (char *)buffer->data;
+    }
+    memset(slot->data + length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+void packet_ring::close() {
+    this->closed.store(true, std::memory_order_release);
+    this->notify();
+}
+bool packet_ring::is_closed() {
+    return this->closed.load(std::memory_order_acquire);
+}
+int packet_ring::depth() {
+    // tail first, so it won't be newer than head
+    uint64_t tail = this->tail.load(std::memory_order_acquire);
+    return (int)(this->head.load(std::memory_order_acquire) - tail);
+}
+void packet_ring::notify() {
+    this->signal.fetch_add(1, std::memory_order_release);
+    this->signal.notify_all();
+}
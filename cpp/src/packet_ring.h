@@ -0,0 +1,95 @@
+#ifndef SCRCPY_PACKET_RING
+#define SCRCPY_PACKET_RING
+#include <stdint.h>
+#include <atomic>
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavutil/buffer.h"
+}
+
+#define PACKET_RING_DEFAULT_SIZE 8
+// slot buffers grow by this step, so slightly bigger packets won't reallocate again
+#define PACKET_RING_SLOT_GROW_SIZE 64 * 1024
+
+/*
+ * a received video packet
+ */
+typedef struct packet_ring_slot {
+    uint64_t pts = 0;
+    int length = 0;
+    // refcounted payload buffer, the decoder may keep a reference after the slot is read
+    AVBufferRef *buffer = NULL;
+    // buffer->data, followed by AV_INPUT_BUFFER_PADDING_SIZE zero bytes after length
+    char *data = NULL;
+    // when the packet header was received, from pipeline_clock_ns
+    int64_t received_at = 0;
+} packet_ring_slot;
+
+/*
+ * bounded single producer single consumer ring of received video packets
+ * the receiving side fills the slots while the decoding side consumes them in order
+ */
+class packet_ring {
+    public:
+        /*
+         * @param       size                max packets waiting for decoding
+         */
+        packet_ring(int size = PACKET_RING_DEFAULT_SIZE);
+        ~packet_ring();
+        /*
+         * get the next slot for writing, blocks while the ring is full
+         * @return      NULL if the ring was closed
+         */
+        packet_ring_slot* acquire_write();
+        /*
+         * get the next slot for writing without blocking
+         * @return      NULL if the ring is full or closed
+         */
+        packet_ring_slot* try_acquire_write();
+        /*
+         * publish the slot got from acquire_write to the consumer
+         */
+        void commit_write();
+        /*
+         * get the oldest packet, blocks while the ring is empty
+         * @return      NULL if the ring was closed and all packets were consumed
+         */
+        packet_ring_slot* acquire_read();
+        /*
+         * get the oldest packet without blocking
+         * @return      NULL if the ring is empty
+         */
+        packet_ring_slot* try_acquire_read();
+        /*
+         * release the slot got from acquire_read for writing
+         */
+        void commit_read();
+        /*
+         * make sure a slot could hold @length bytes plus the padding required by the decoder
+         * the buffer is replaced if it is too small or still referenced by the decoder
+         * @param       keep_length         bytes at the beginning of the old buffer to keep
+         * @return      0 if ok
+         */
+        int reserve(packet_ring_slot *slot, int length, int keep_length = 0);
+        /*
+         * stop both sides, packets already written could still be read
+         */
+        void close();
+        bool is_closed();
+        /*
+         * packets waiting for decoding
+         */
+        int depth();
+    private:
+        packet_ring_slot *slots = NULL;
+        int size = 0;
+        // packets written/read since created
+        std::atomic<uint64_t> head = 0;
+        std::atomic<uint64_t> tail = 0;
+        std::atomic<bool> closed = false;
+        // changed on every commit and close for waking up the other side
+        std::atomic<uint32_t> signal = 0;
+
+        void notify();
+};
+#endif //!SCRCPY_PACKET_RING
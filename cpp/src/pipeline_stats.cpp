@@ -0,0 +1,107 @@
+#include "pipeline_stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+pipeline_stats::pipeline_stats(int window_size) {
+    this->window_size = window_size > 0 ? window_size : PIPELINE_STATS_DEFAULT_WINDOW;
+    for (int i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+        this->windows[i].samples = (int64_t*)malloc(sizeof(int64_t) * this->window_size);
+    }
+    for (int i = 0; i < PIPELINE_COUNTER_COUNT; i++) {
+        this->counters[i] = 0;
+    }
+}
+pipeline_stats::~pipeline_stats() {
+    for (int i = 0; i < PIPELINE_STAGE_COUNT; i++) {
+        std::lock_guard<std::mutex> lock(this->windows[i].lock);
+        if (this->windows[i].samples) {
+            free(this->windows[i].samples);
+            this->windows[i].samples = NULL;
+        }
+    }
+}
+void pipeline_stats::record(int stage, int64_t elapsed_ns) {
+    if (stage < 0 || stage >= PIPELINE_STAGE_COUNT) {
+        return;
+    }
+    pipeline_stage_window *window = &this->windows[stage];
+    std::lock_guard<std::mutex> lock(window->lock);
+    if (!window->samples) {
+        return;
+    }
+    window->samples[window->next] = elapsed_ns;
+    window->next = (window->next + 1) % this->window_size;
+    window->count++;
+    window->total_ns += elapsed_ns;
+}
+int64_t pipeline_stats::percentile(int stage, double pct) {
+    if (stage < 0 || stage >= PIPELINE_STAGE_COUNT) {
+        return 0;
+    }
+    pipeline_stage_window *window = &this->windows[stage];
+    int64_t *sorted = NULL;
+    int total = 0;
+    {
+        std::lock_guard<std::mutex> lock(window->lock);
+        total = (int)std::min<uint64_t>(window->count, (uint64_t)this->window_size);
+        if (total <= 0 || !window->samples) {
+            return 0;
+        }
+        // copy the samples so the recording side won't wait for sorting
+        sorted = (int64_t*)malloc(sizeof(int64_t) * total);
+        if (!sorted) {
+            return 0;
+        }
+        memcpy(sorted, window->samples, sizeof(int64_t) * total);
+    }
+    pct = std::clamp(pct, 0.0, 100.0);
+    int index = (int)((total - 1) * pct / 100.0 + 0.5);
+    std::nth_element(sorted, sorted + index, sorted + total);
+    int64_t result = sorted[index];
+    free(sorted);
+    return result;
+}
+uint64_t pipeline_stats::count(int stage) {
+    if (stage < 0 || stage >= PIPELINE_STAGE_COUNT) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(this->windows[stage].lock);
+    return this->windows[stage].count;
+}
+uint64_t pipeline_stats::total_ns(int stage) {
+    if (stage < 0 || stage >= PIPELINE_STAGE_COUNT) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(this->windows[stage].lock);
+    return this->windows[stage].total_ns;
+}
+void pipeline_stats::increase(int counter, uint64_t value) {
+    if (counter < 0 || counter >= PIPELINE_COUNTER_COUNT) {
+        return;
+    }
+    this->counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+uint64_t pipeline_stats::counter(int counter) {
+    if (counter < 0 || counter >= PIPELINE_COUNTER_COUNT) {
+        return 0;
+    }
+    return this->counters[counter].load(std::memory_order_relaxed);
+}
+void pipeline_stats::set_queue_depth(int depth) {
+    this->pending_frames.store(depth, std::memory_order_relaxed);
+}
+int pipeline_stats::queue_depth() {
+    return this->pending_frames.load(std::memory_order_relaxed);
+}
+void pipeline_stats::set_packet_queue_depth(int depth) {
+    this->pending_packets.store(depth, std::memory_order_relaxed);
+}
+int pipeline_stats::packet_queue_depth() {
+    return this->pending_packets.load(std::memory_order_relaxed);
+}
+int64_t pipeline_clock_ns() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
@@ -0,0 +1,113 @@
+#ifndef SCRCPY_PIPELINE_STATS
+#define SCRCPY_PIPELINE_STATS
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+// stages of the video pipeline, used as index of the timing windows
+#define PIPELINE_STAGE_RECV 0           // receiving a packet payload from network
+#define PIPELINE_STAGE_PREPARE 1        // prepare_packet
+#define PIPELINE_STAGE_DECODE 2         // avcodec_send_packet/avcodec_receive_frame
+#define PIPELINE_STAGE_SCALE 3          // sws_scale
+#define PIPELINE_STAGE_ENCODE 4         // cv::imencode
+#define PIPELINE_STAGE_FRAME 5          // a whole packet, from header read to frame callback
+#define PIPELINE_STAGE_CONVERT 6        // rgb_frame_and_callback, scaling and encoding a decoded frame
+#define PIPELINE_STAGE_CALLBACK 7       // invoking frame image callbacks in frame_img_processor
+#define PIPELINE_STAGE_COUNT 8
+// counters of the video pipeline
+#define PIPELINE_COUNTER_BYTES_RECEIVED 0
+#define PIPELINE_COUNTER_PACKETS 1
+#define PIPELINE_COUNTER_DECODED_FRAMES 2
+#define PIPELINE_COUNTER_ENCODED_FRAMES 3
+#define PIPELINE_COUNTER_DELIVERED_CALLBACKS 4
+#define PIPELINE_COUNTER_DROPPED_FRAMES 5
+// frames dropped by the delivery policies, also counted in PIPELINE_COUNTER_DROPPED_FRAMES
+#define PIPELINE_COUNTER_DROPPED_NEWEST 6
+#define PIPELINE_COUNTER_DROPPED_OLDEST 7
+#define PIPELINE_COUNTER_COALESCED_FRAMES 8
+// frames the sender waited for a free slot of the callback queue
+#define PIPELINE_COUNTER_BLOCKED_FRAMES 9
+#define PIPELINE_COUNTER_COUNT 10
+#define PIPELINE_STATS_DEFAULT_WINDOW 512
+
+/*
+ * timing samples of a single stage
+ */
+typedef struct pipeline_stage_window {
+    std::mutex lock;
+    // sample ring
+    int64_t *samples = NULL;
+    // next position for writing
+    int next = 0;
+    // samples recorded since created
+    uint64_t count = 0;
+    // total time recorded since created
+    uint64_t total_ns = 0;
+} pipeline_stage_window;
+
+/*
+ * rolling timing stats of the video pipeline for a device
+ */
+class pipeline_stats {
+    public:
+        /*
+         * @param       window_size         how many recent samples to keep for each stage
+         */
+        pipeline_stats(int window_size = PIPELINE_STATS_DEFAULT_WINDOW);
+        ~pipeline_stats();
+        /*
+         * record time spent in a stage
+         * @param       stage               the stage, @see PIPELINE_STAGE_RECV
+         * @param       elapsed_ns          time spent in nanoseconds
+         */
+        void record(int stage, int64_t elapsed_ns);
+        /*
+         * percentile of recent samples of a stage
+         * @param       stage               the stage
+         * @param       pct                 percentile from 0 to 100
+         * @return      the sample value in nanoseconds, 0 if there's no sample yet
+         */
+        int64_t percentile(int stage, double pct);
+        /*
+         * samples recorded for a stage since created
+         */
+        uint64_t count(int stage);
+        /*
+         * total time recorded for a stage since created
+         */
+        uint64_t total_ns(int stage);
+        /*
+         * increase a counter
+         * @param       counter             the counter, @see PIPELINE_COUNTER_BYTES_RECEIVED
+         * @param       value               value to add
+         */
+        void increase(int counter, uint64_t value = 1);
+        /*
+         * current value of a counter
+         */
+        uint64_t counter(int counter);
+        /*
+         * update frames waiting for callbacks
+         */
+        void set_queue_depth(int depth);
+        int queue_depth();
+        /*
+         * update packets received but not decoded yet
+         */
+        void set_packet_queue_depth(int depth);
+        int packet_queue_depth();
+    private:
+        int window_size = 0;
+        pipeline_stage_window windows[PIPELINE_STAGE_COUNT];
+        std::atomic<uint64_t> counters[PIPELINE_COUNTER_COUNT];
+        std::atomic<int> pending_frames = 0;
+        std::atomic<int> pending_packets = 0;
+};
+
+/*
+ * monotonic clock for stage timing
+ * @return      current time in nanoseconds
+ */
+int64_t pipeline_clock_ns();
+
+#endif //!SCRCPY_PIPELINE_STATS
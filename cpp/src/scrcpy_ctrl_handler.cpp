@@ -4,6 +4,7 @@
 #include <winbase.h>
 #include "utils.h"
 #include "logging.h"
+#include "boost/asio.hpp"
 
 scrcpy_ctrl_socket_handler::scrcpy_ctrl_socket_handler(std::string *dev_id, boost::shared_ptr<tcp::socket> socket): device_id(dev_id), 
     client_socket(socket), 
@@ -44,10 +45,28 @@ scrcpy_ctrl_socket_handler::~scrcpy_ctrl_socket_handler() {
         delete this->device_id;
         this->device_id = NULL;
     }
+    if (this->strand) {
+        delete this->strand;
+        this->strand = NULL;
+    }
 }
 void scrcpy_ctrl_socket_handler::stop() {
-    std::lock_guard<std::mutex> lock(this->stat_lock);
-    this->keep_running = false;
+    // no write could start or complete until it's decided who finishes the handler
+    std::lock_guard<std::mutex> queue_lock(this->outgoing_queue_lock);
+    {
+        std::lock_guard<std::mutex> lock(this->stat_lock);
+        if (!this->keep_running) {
+            return;
+        }
+        this->keep_running = false;
+    }
+    // the completion of the pending write finishes it otherwise
+    if (this->async_mode && !this->writing) {
+        // never finish within the caller, it may be holding locks the finished callback needs
+        boost::asio::post(*this->strand, [this]() {
+            this->finish();
+        });
+    }
 }
 void scrcpy_ctrl_socket_handler::send_msg(char *msg_id, uint8_t *data, int data_len) {
     SPDLOG_DEBUG("Acquiring a lock for sending message msg_id={} for device {}", msg_id, this->device_id->c_str());
@@ -70,6 +89,9 @@ void scrcpy_ctrl_socket_handler::send_msg(char *msg_id, uint8_t *data, int data_
     SPDLOG_DEBUG("Pusing new message to queue {} size is {}", (uintptr_t)this->outgoing_queue, this->outgoing_queue->size());
     log_flush();
     this->outgoing_queue->push(msg);
+    if (this->async_mode) {
+        this->write_next();
+    }
 }
 void scrcpy_ctrl_socket_handler::cleanup_trash() {
     int cleaned_size = 0;
@@ -152,3 +174,68 @@ int scrcpy_ctrl_socket_handler::run(std::function<void(std::string, std::string,
     delete this;
     return result;
 }
+void scrcpy_ctrl_socket_handler::run_async(std::function<void(std::string, std::string, int, int)> callback, 
+        std::function<void(int)> on_finished) {
+    this->sent_callback = callback;
+    this->finished_callback = on_finished;
+    this->strand = new boost::asio::strand<tcp::socket::executor_type>(this->client_socket->get_executor());
+    std::lock_guard<std::mutex> lock(this->outgoing_queue_lock);
+    this->async_mode = true;
+    this->write_next();
+}
+void scrcpy_ctrl_socket_handler::write_next() {
+    if (this->writing || this->finished || this->outgoing_queue->empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->stat_lock);
+        if (!this->keep_running) {
+            return;
+        }
+    }
+    auto msg = this->outgoing_queue->front();
+    this->outgoing_queue->pop();
+    this->writing = true;
+    boost::asio::async_write(*this->client_socket, boost::asio::buffer(msg->data, msg->length), boost::asio::bind_executor(*this->strand,
+            [this, msg](const boost::system::error_code &ec, std::size_t bytes_sent) {
+        int status = (int)bytes_sent;
+        if (ec) {
+            SPDLOG_ERROR("Failed to send msg id {}: {}", msg->msg_id, ec.message());
+            status = -1;
+        }
+        if (NULL != this->sent_callback) {
+            this->sent_callback(std::string(this->device_id->c_str()), std::string(msg->msg_id), status, msg->length);
+        }
+        free(msg->msg_id);
+        free(msg->data);
+        delete msg;
+        {
+            std::lock_guard<std::mutex> lock(this->outgoing_queue_lock);
+            this->writing = false;
+            this->write_next();
+        }
+        this->finish();
+    }));
+}
+void scrcpy_ctrl_socket_handler::finish() {
+    {
+        std::lock_guard<std::mutex> lock(this->stat_lock);
+        if (this->keep_running) {
+            return;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->outgoing_queue_lock);
+        // the pending write will finish it
+        if (this->writing || this->finished) {
+            return;
+        }
+        this->finished = true;
+    }
+    SPDLOG_INFO("Ctrl message async sender end for {}", this->device_id->c_str());
+    log_flush();
+    if (this->finished_callback) {
+        this->finished_callback(0);
+    }
+    delete this;
+}
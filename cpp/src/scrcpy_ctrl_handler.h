@@ -4,6 +4,7 @@
 #include <string>
 #include <mutex>
 #include "boost/asio/ip/tcp.hpp"
+#include "boost/asio/strand.hpp"
 #include <queue>
 #include <functional>
 
@@ -31,6 +32,13 @@ class scrcpy_ctrl_socket_handler
         ~scrcpy_ctrl_socket_handler();
         void stop();
         int run(std::function<void(std::string, std::string, int, int)> callback);
+        /**
+         * run the handler with async writes on the socket's io_context, it returns immediately
+         * the handler deletes itself after @on_finished invoked
+         * @param       callback        callback for the message sending status
+         * @param       on_finished     invoked after the handler stopped
+         */
+        void run_async(std::function<void(std::string, std::string, int, int)> callback, std::function<void(int)> on_finished);
         void send_msg(char* msg_id, uint8_t *data, int data_len);
     private:
         std::string *device_id = NULL;
@@ -40,7 +48,25 @@ class scrcpy_ctrl_socket_handler
         std::queue<scrcpy_ctrl_msg*> *outgoing_queue;
         std::queue<scrcpy_ctrl_msg_trashed*> *outgoing_trash;
         bool keep_running = true;
+        // async mode
+        bool async_mode = false;
+        bool writing = false;
+        bool finished = false;
+        // serializes write completions and finishing of the handler
+        boost::asio::strand<tcp::socket::executor_type> *strand = NULL;
+        std::function<void(std::string, std::string, int, int)> sent_callback = NULL;
+        std::function<void(int)> finished_callback = NULL;
 
         void cleanup_trash();
+        /**
+         * send the first queued message if no message is being sent
+         * caller must hold outgoing_queue_lock
+         */
+        void write_next();
+        /**
+         * release the handler in async mode if it was stopped and no message is being sent
+         * caller must not hold any lock of the handler
+         */
+        void finish();
 };
 #endif //!SCRCPY_CTRL_HANDLER
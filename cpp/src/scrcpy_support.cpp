@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include "model.h"
 #include "socket_lib.h"
+#include "callback_dispatcher.h"
 #include "logging.h"
 #include "scrcpy_recv/scrcpy_recv.h"
 
@@ -19,6 +20,18 @@ SCRCPY_API void scrcpy_start_receiver(scrcpy_listener_t handle, char* listen_add
     static_cast<socket_lib*>(handle)->startup(listen_address, net_buffer_size, video_buffer_size);
 }
 
+SCRCPY_API void scrcpy_enable_async_io(scrcpy_listener_t handle, int io_threads) {
+    static_cast<socket_lib*>(handle)->enable_async_io(io_threads);
+}
+
+SCRCPY_API int scrcpy_set_default_decoder_profile(scrcpy_listener_t handle, int profile) {
+    return static_cast<socket_lib*>(handle)->config_default_decoder_profile(profile);
+}
+
+SCRCPY_API int scrcpy_set_callback_workers(int workers) {
+    return callback_dispatcher::config_shared(workers);
+}
+
 SCRCPY_API void scrcpy_shutdown_receiver(scrcpy_listener_t handle) {
     static_cast<socket_lib*>(handle)->shutdown_svr();
 }
@@ -55,6 +68,72 @@ SCRCPY_API void scrcpy_frame_unregister_all_callbacks(scrcpy_listener_t handle,
     static_cast<socket_lib*>(handle)->remove_all_callbacks(device_id);
 }
 
+SCRCPY_API int scrcpy_set_output_format(scrcpy_listener_t handle, char *device_id, int format, int quality) {
+    return static_cast<socket_lib*>(handle)->config_output_format(device_id, format, quality);
+}
+
+SCRCPY_API int scrcpy_set_decoder_profile(scrcpy_listener_t handle, char *device_id, int profile) {
+    return static_cast<socket_lib*>(handle)->config_decoder_profile(device_id, profile);
+}
+
+SCRCPY_API int scrcpy_set_delivery_policy(scrcpy_listener_t handle, char *device_id, int depth, int policy) {
+    return static_cast<socket_lib*>(handle)->config_delivery_policy(device_id, depth, policy);
+}
+
+SCRCPY_API void scrcpy_set_latest_frame_only(scrcpy_listener_t handle, char *device_id, int enabled) {
+    static_cast<socket_lib*>(handle)->config_latest_frame_only(device_id, enabled != 0);
+}
+
+SCRCPY_API void scrcpy_set_max_fps(scrcpy_listener_t handle, char *device_id, int fps) {
+    static_cast<socket_lib*>(handle)->config_max_fps(device_id, fps);
+}
+
+SCRCPY_API void scrcpy_set_drain_when_idle(scrcpy_listener_t handle, char *device_id, int enabled) {
+    static_cast<socket_lib*>(handle)->config_drain_when_idle(device_id, enabled != 0);
+}
+
+SCRCPY_API void scrcpy_set_keyframe_only(scrcpy_listener_t handle, char *device_id, int enabled) {
+    static_cast<socket_lib*>(handle)->config_keyframe_only(device_id, enabled != 0);
+}
+
+SCRCPY_API void scrcpy_set_full_res_decoding(scrcpy_listener_t handle, char *device_id, int enabled) {
+    static_cast<socket_lib*>(handle)->config_full_res_decoding(device_id, enabled != 0);
+}
+
+SCRCPY_API void scrcpy_set_skip_identical_frames(scrcpy_listener_t handle, char *device_id, int enabled, int heartbeat_ms) {
+    static_cast<socket_lib*>(handle)->config_skip_identical_frames(device_id, enabled != 0, heartbeat_ms);
+}
+
+SCRCPY_API int scrcpy_wait_next_frame(scrcpy_listener_t handle, char *device_id, uint64_t last_seq, int timeout_ms,
+        uint8_t *out_buffer, uint32_t cap, scrcpy_frame_info *info) {
+    return static_cast<socket_lib*>(handle)->wait_next_frame(device_id, last_seq, timeout_ms, out_buffer, cap, info);
+}
+
+SCRCPY_API void scrcpy_set_dirty_rects(scrcpy_listener_t handle, char *device_id, int enabled) {
+    static_cast<socket_lib*>(handle)->config_dirty_rects(device_id, enabled != 0);
+}
+
+SCRCPY_API void scrcpy_set_snapshot_mode(scrcpy_listener_t handle, char *device_id, int enabled) {
+    static_cast<socket_lib*>(handle)->config_snapshot_mode(device_id, enabled != 0);
+}
+
+SCRCPY_API int scrcpy_capture_snapshot(scrcpy_listener_t handle, char *device_id, int width, int height, int format, int quality,
+        uint8_t *out_buffer, uint32_t cap, scrcpy_frame_info *info) {
+    return static_cast<socket_lib*>(handle)->capture_snapshot(device_id, width, height, format, quality, out_buffer, cap, info);
+}
+
+SCRCPY_API int scrcpy_export_shm_ring(scrcpy_listener_t handle, char *device_id, char *name, int slot_count, uint32_t slot_size) {
+    return static_cast<socket_lib*>(handle)->export_shm_ring(device_id, name, slot_count, slot_size);
+}
+
+SCRCPY_API void scrcpy_frame_register_raw_callback(scrcpy_listener_t handle, char *device_id, int pixel_format, scrcpy_frame_raw_callback handler) {
+    static_cast<socket_lib*>(handle)->register_raw_callback(device_id, pixel_format, handler);
+}
+
+SCRCPY_API void scrcpy_frame_unregister_all_raw_callbacks(scrcpy_listener_t handle, char *device_id) {
+    static_cast<socket_lib*>(handle)->remove_all_raw_callbacks(device_id);
+}
+
 SCRCPY_API void scrcpy_device_info_register_callback(scrcpy_listener_t handle, char *device_id, scrcpy_device_info_callback handler) {
     static_cast<socket_lib*>(handle)->register_device_info_callback(device_id, handler);
 }
@@ -75,3 +154,34 @@ SCRCPY_API void scrcpy_device_send_ctrl_msg(scrcpy_listener_t handle, char *devi
 SCRCPY_API void scrcpy_set_device_disconnected_callback(scrcpy_listener_t handle, scrcpy_device_disconnected_callback callback) {
     static_cast<socket_lib*>(handle)->set_device_disconnected_callback(callback);
 }
+
+SCRCPY_API int scrcpy_get_device_stats(scrcpy_listener_t handle, char *device_id, scrcpy_device_stats *stats) {
+    if (!stats) {
+        return 1;
+    }
+    pipeline_stats *device_stats = static_cast<socket_lib*>(handle)->find_pipeline_stats(device_id);
+    if (!device_stats) {
+        return 1;
+    }
+    stats->bytes_received = device_stats->counter(PIPELINE_COUNTER_BYTES_RECEIVED);
+    stats->packets = device_stats->counter(PIPELINE_COUNTER_PACKETS);
+    stats->decoded_frames = device_stats->counter(PIPELINE_COUNTER_DECODED_FRAMES);
+    stats->encoded_frames = device_stats->counter(PIPELINE_COUNTER_ENCODED_FRAMES);
+    stats->delivered_callbacks = device_stats->counter(PIPELINE_COUNTER_DELIVERED_CALLBACKS);
+    stats->dropped_frames = device_stats->counter(PIPELINE_COUNTER_DROPPED_FRAMES);
+    stats->dropped_newest = device_stats->counter(PIPELINE_COUNTER_DROPPED_NEWEST);
+    stats->dropped_oldest = device_stats->counter(PIPELINE_COUNTER_DROPPED_OLDEST);
+    stats->coalesced_frames = device_stats->counter(PIPELINE_COUNTER_COALESCED_FRAMES);
+    stats->blocked_frames = device_stats->counter(PIPELINE_COUNTER_BLOCKED_FRAMES);
+    stats->queue_depth = device_stats->queue_depth();
+    stats->packet_queue_depth = device_stats->packet_queue_depth();
+    stats->recv_p50_us = device_stats->percentile(PIPELINE_STAGE_RECV, 50) / 1000;
+    stats->recv_p99_us = device_stats->percentile(PIPELINE_STAGE_RECV, 99) / 1000;
+    stats->decode_p50_us = device_stats->percentile(PIPELINE_STAGE_DECODE, 50) / 1000;
+    stats->decode_p99_us = device_stats->percentile(PIPELINE_STAGE_DECODE, 99) / 1000;
+    stats->convert_p50_us = device_stats->percentile(PIPELINE_STAGE_CONVERT, 50) / 1000;
+    stats->convert_p99_us = device_stats->percentile(PIPELINE_STAGE_CONVERT, 99) / 1000;
+    stats->callback_p50_us = device_stats->percentile(PIPELINE_STAGE_CALLBACK, 50) / 1000;
+    stats->callback_p99_us = device_stats->percentile(PIPELINE_STAGE_CALLBACK, 99) / 1000;
+    return 0;
+}
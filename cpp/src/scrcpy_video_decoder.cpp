@@ -6,10 +6,20 @@
 #include <direct.h>
 #include <utils.h>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <algorithm>
 #include "logging.h"
+#include "pipeline_stats.h"
+#include "packet_ring.h"
+#include "socket_reader.h"
+#include <thread>
+#include "boost/asio.hpp"
 
 extern "C" {
 #include "libavutil/timestamp.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/pixdesc.h"
 #include "libavcodec/avcodec.h"
 #include "libavformat/avformat.h"
 #include "libswscale/swscale.h"
@@ -21,26 +31,158 @@ using namespace cv;
 #define SCRCPY_DEVICE_INFO_SIZE 68
 #define SCRCPY_DEIVCE_ID_LENGTH 64
 #define H264_HEAD_BUFFER_SIZE 12
-#define PACKET_CHUNK_BUFFER_SIZE 32*1024
 #define PNG_IMG_BUFFER 1024 * 1024 * 4
 #endif
+// scrcpy sends pts in microseconds
+#define VIDEO_PTS_PER_SECOND 1000000
+// packets kept after the latest IDR while draining, the later ones are dropped beyond it
+#define DRAIN_MAX_GOP_BYTES 16 * 1024 * 1024
+// scaling down by this factor or more on both sides takes the low resolution path
+#define LOW_RES_SCALE_FACTOR 3
+// tile size in screen pixels for finding the changed regions
+#define DIRTY_TILE_SIZE 32
 typedef struct VideoHeader {
     uint64_t pts;
     int length;
 } VideoHeader;
+/*
+ * a packet kept without decoding while draining
+ */
+typedef struct drained_packet {
+    uint64_t pts;
+    int length;
+    AVBufferRef *buffer;
+} drained_packet;
 
-typedef struct PacketStat {
-    int64_t pts;
-    int64_t dts;
-    int flags;
-}PacketStat;
+/*
+ * ffmpeg pixel format of a raw frame format
+ * @param format    @see SCRCPY_PIXEL_FORMAT_BGRA
+ */
+static enum AVPixelFormat raw_frame_pix_fmt(int format) {
+    switch (format) {
+        case SCRCPY_PIXEL_FORMAT_RGB24:
+            return AV_PIX_FMT_RGB24;
+        case SCRCPY_PIXEL_FORMAT_NV12:
+            return AV_PIX_FMT_NV12;
+        case SCRCPY_PIXEL_FORMAT_I420:
+            return AV_PIX_FMT_YUV420P;
+        default:
+            return AV_PIX_FMT_BGRA;
+    }
+}
+/*
+ * file extension and opencv encoding params of an output format
+ * @param output_format     the configured format, quality below 0 keeps the encoder's default
+ * @param params            encoding params will be appended into it
+ */
+static const char* image_encode_params(image_output_format output_format, std::vector<int> *params) {
+    int quality = output_format.quality;
+    switch (output_format.format) {
+        case SCRCPY_OUTPUT_FORMAT_JPEG:
+            if (quality >= 0) {
+                params->push_back(cv::IMWRITE_JPEG_QUALITY);
+                params->push_back(quality > 100 ? 100 : quality);
+            }
+            return ".jpg";
+        case SCRCPY_OUTPUT_FORMAT_WEBP:
+            // quality above 100 means lossless, which is also the default of opencv
+            if (quality >= 0) {
+                params->push_back(cv::IMWRITE_WEBP_QUALITY);
+                params->push_back(quality < 1 ? 1 : quality);
+            }
+            return ".webp";
+        default:
+            if (quality >= 0) {
+                params->push_back(cv::IMWRITE_PNG_COMPRESSION);
+                params->push_back(quality > 9 ? 9 : quality);
+            }
+            return ".png";
+    }
+}
+/*
+ * config packets(sps/pps) are sent with pts -1, and merged with the next packet
+ */
+static bool is_config_packet(const struct VideoHeader *header) {
+    return header->pts == (uint64_t)-1;
+}
+/*
+ * if a frame is scaled down enough for the low resolution path: the deblocking filter is skipped while decoding,
+ * and frames are scaled with an area(box) filter instead of bicubic, both are invisible after scaling
+ */
+static bool is_low_res_scale(int width, int height, int target_width, int target_height) {
+    if (width <= 0 || height <= 0 || target_width <= 0 || target_height <= 0) {
+        return false;
+    }
+    // compare the long and short sides, so a rotated screen is still matched
+    return std::max(width, height) >= std::max(target_width, target_height) * LOW_RES_SCALE_FACTOR &&
+        std::min(width, height) >= std::min(target_width, target_height) * LOW_RES_SCALE_FACTOR;
+}
+/*
+ * hash the planes of a decoded frame
+ * @param           frame                   the decoded frame
+ * @param           seed                    mixed into the hash
+ * @return          the hash, or the seed if the pixel format is unknown
+ */
+static uint64_t frame_hash(AVFrame *frame, uint64_t seed) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+    int row_bytes[4] = {0};
+    if (!desc || av_image_fill_linesizes(row_bytes, (enum AVPixelFormat)frame->format, frame->width) < 0) {
+        return seed;
+    }
+    uint64_t hash = seed;
+    for (int i = 0; i < 4 && frame->data[i] && row_bytes[i] > 0; i++) {
+        // planes 1 and 2 are the chroma ones
+        int rows = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+        hash = hash_plane(hash, frame->data[i], frame->linesize[i], row_bytes[i], rows);
+    }
+    return hash;
+}
+/*
+ * configure the codec context before opening it
+ * @param           codec_context           the codec context
+ * @param           profile                 @see SCRCPY_DECODER_PROFILE_DEFAULT
+ */
+static void apply_decoder_profile(AVCodecContext *codec_context, int profile) {
+    switch (profile) {
+        case SCRCPY_DECODER_PROFILE_LOW_LATENCY:
+            codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+            // frame threads hold back a frame per thread, slice threads don't
+            codec_context->thread_type = FF_THREAD_SLICE;
+            codec_context->thread_count = 0;
+            break;
+        case SCRCPY_DECODER_PROFILE_THROUGHPUT:
+            codec_context->thread_type = FF_THREAD_FRAME;
+            codec_context->thread_count = (int)std::thread::hardware_concurrency();
+            break;
+        case SCRCPY_DECODER_PROFILE_REDUCED_COST:
+            codec_context->skip_loop_filter = AVDISCARD_ALL;
+            codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * the setup of a device read once per packet, so its frames are converted without locking the receiver for each setting
+ */
+typedef struct packet_cfg {
+    device_delivery_cfg delivery = {};
+    // @see SCRCPY_PIXEL_FORMAT_BGRA, -1 if there's no raw frame callback
+    int raw_format = -1;
+    // frame images are needed by the callbacks, the waiters or the shared memory ring
+    bool encode_needed = false;
+    image_output_format output_format = { SCRCPY_OUTPUT_FORMAT_PNG, SCRCPY_OUTPUT_QUALITY_DEFAULT };
+} packet_cfg;
 
 class VideoDecoder {
     private:
-        char device_id[SCRCPY_DEIVCE_ID_LENGTH];
+        char device_id[SCRCPY_DEIVCE_ID_LENGTH] = {0};
         connection_buffer_config *buffer_cfg = NULL;
         image_size *img_size = NULL;
         boost::shared_ptr<tcp::socket> socket = NULL;
+        // buffered reading of the connection, only used by decode()
+        socket_reader *reader = NULL;
         video_decode_callback *callback = NULL;
         char header_buffer[H264_HEAD_BUFFER_SIZE];
         struct AVCodec *codec = NULL;
@@ -48,22 +190,71 @@ class VideoDecoder {
         AVCodecParserContext *codec_parser_context = NULL;
         AVPacket *active_packet = NULL;
         AVFrame *frame = NULL;
-        struct PacketStat packet_stat;
-        char *active_data = NULL;
-        char *packet_buffer = NULL;
-        char packet_chunk[PACKET_CHUNK_BUFFER_SIZE];
-        int pending_data_length = 0;
-        BOOL has_pending = FALSE;
+        // scaler and its output, rebuilt only when the frame or the configured image size changes
+        struct SwsContext *sws_ctx = NULL;
+        cv::Mat rgb_image;
+        // scaler and planes for raw frames other than BGRA, which shares rgb_image
+        struct SwsContext *raw_sws_ctx = NULL;
+        uint8_t *raw_data[4] = {NULL};
+        int raw_linesize[4] = {0};
+        int raw_width = 0;
+        int raw_height = 0;
+        int raw_format = -1;
+        // newest decoded frame waiting for the callbacks in latest frame only mode
+        AVFrame *latest_frame = NULL;
+        std::atomic<bool> has_latest_frame = false;
+        // max fps when the latest frame was kept
+        int latest_frame_max_fps = 0;
+        // pts and time(from pipeline_clock_ns) of the last converted frame for limiting the frame rate
+        int64_t last_converted_pts = AV_NOPTS_VALUE;
+        int64_t last_converted_at = 0;
+        // packets from the latest IDR, kept while draining
+        std::vector<drained_packet> drained_packets;
+        int drained_bytes = 0;
+        // packets after the IDR were dropped for exceeding DRAIN_MAX_GOP_BYTES
+        bool drained_gop_truncated = false;
+        // skip packets until an IDR, the references of the next frames were never decoded
+        bool wait_keyframe = false;
+        // frames are converted by the decoding thread, or by a callback worker in latest frame only mode
+        std::mutex convert_lock;
+        // skip_loop_filter set by the decoder profile, restored when leaving the low resolution path
+        enum AVDiscard profile_skip_loop_filter = AVDISCARD_DEFAULT;
+        bool low_res = false;
+        // hash and time(from pipeline_clock_ns) of the last frame sent to the callbacks, 0 if nothing was sent
+        uint64_t last_frame_hash = 0;
+        int64_t last_frame_sent_at = 0;
+        // luma plane of the last raw frame sent, for finding the changed tiles
+        uint8_t *last_luma = NULL;
+        int last_luma_width = 0;
+        int last_luma_height = 0;
+        // changed regions of the raw frame being sent, in pixels of the scaled frame, -1 if not tracked
+        int dirty_rect_count = -1;
+        scrcpy_area dirty_rects[SCRCPY_MAX_DIRTY_RECTS];
+        // reference of the latest decoded frame and how many frames were decoded, for capturing snapshots
+        AVFrame *snapshot_frame = NULL;
+        uint64_t snapshot_seq = 0;
+        std::mutex snapshot_lock;
+        // scaler of snapshots, shared by the capturing threads
+        struct SwsContext *snapshot_sws_ctx = NULL;
+        std::mutex snapshot_sws_lock;
         int width = 0;
         int height = 0;
         int *keep_running = NULL;
         int *disconnect_flag = NULL;
+        // encoding buffer, swapped with a recycled one by the frame image callbacks, so it doesn't keep the last image
         std::vector<uchar> *img_buffer = NULL;
         std::mutex img_buffer_lock;
+        pipeline_stats *stats = NULL;
         /*
          * ȡ豸Ϣ
          */
         int read_device_info();
+        /*
+         * parse device info and init the decoder
+         * @param device_info_data  SCRCPY_DEVICE_INFO_SIZE bytes device info
+         * @return 0 if ok
+         */
+        int setup_device(char *device_info_data);
         /*
          * ʼ
          */
@@ -76,36 +267,183 @@ class VideoDecoder {
         int read_video_header(struct VideoHeader *header);
         /*
          * Ƶ
-         * @param pts
-         * @param length
-         * @return ״̬
+         * decode packets from the ring until it was closed
+         * @param ring
          */
-        int decode_frames(uint64_t pts, int length);
+        void decode_packets(packet_ring *ring);
         /*
          * 
          * @param length
+         * @param buffer            where the payload is read into
          * @return ״̬
          */
-        int recv_network_buffer(int length, char* buffer, char* chunk);
+        int recv_network_buffer(int length, char* buffer);
         /*
          * ׼packetڽ
          * @param pts
          * @param length
+         * @param buffer            refcounted packet payload
          * @return ״̬
          */
-        int prepare_packet(uint64_t pts, int length);
+        int prepare_packet(uint64_t pts, int length, AVBufferRef *buffer);
 
-        int rgb_frame_and_callback(AVCodecContext* dec_ctx, AVFrame* frame);
+        int rgb_frame_and_callback(AVCodecContext* dec_ctx, AVFrame* frame, const packet_cfg &cfg);
+        /*
+         * scale the frame into a raw frame format and send it to raw frame callbacks
+         * @param format            @see SCRCPY_PIXEL_FORMAT_RGB24
+         * @param target_width
+         * @param target_height
+         * @param full_res          @see device_delivery_cfg
+         * @return 0 if ok
+         */
+        int raw_frame_and_callback(AVCodecContext* dec_ctx, AVFrame* frame, int format, int target_width, int target_height, bool full_res);
 
         image_size* get_image_size();
+        /*
+         * encode an image with the output format configured for the device
+         * @param image             the scaled image
+         * @param buffer            encoded image data
+         * @param output_format     @see packet_cfg
+         * @return true if ok
+         */
+        bool encode_image(const cv::Mat &image, std::vector<uchar> *buffer, image_output_format output_format);
+        /*
+         * read the setup of the device for the frames of a packet
+         */
+        void read_packet_cfg(packet_cfg *cfg);
+        /*
+         * keep a reference of a decoded frame until the callbacks are ready, replacing the one not converted yet
+         * the delivering task of the device is scheduled to call on_frame_ready once it's idle
+         */
+        void keep_latest_frame(AVFrame *frame, int max_fps);
+        /*
+         * @see keep_latest_frame, the convert_lock must be held
+         * @return true if the frame is kept
+         */
+        bool replace_latest_frame(AVFrame *frame, int max_fps);
+        /*
+         * check if converting a frame now would go over the max fps, the convert_lock must be held
+         * it's over only if both the pts and the clock say the interval has not passed since the last converted frame,
+         * so a kept latest frame is still converted once the device stops sending frames
+         * @param max_fps           0 for no limit
+         */
+        bool is_over_max_fps(AVFrame *frame, int max_fps);
+        /*
+         * convert a frame and send it to the callbacks, the convert_lock must be held
+         */
+        void convert_frame(AVFrame *frame, const packet_cfg &cfg);
+        /*
+         * skip the deblocking filter while frames are scaled down by LOW_RES_SCALE_FACTOR or more
+         * @param full_res          true to always decode with the deblocking filter
+         */
+        void update_low_res(bool full_res);
+        /*
+         * the sws flags for scaling a frame to the target size
+         * @param full_res          always bicubic, @see device_delivery_cfg
+         */
+        int scale_flags(AVFrame *frame, int target_width, int target_height, bool full_res);
+        /*
+         * if the frame is the same as the last one sent at the same size, and no heartbeat is due
+         * always false unless identical frames are skipped for the device
+         */
+        bool is_identical_frame(AVFrame *frame, int target_width, int target_height, const device_delivery_cfg &delivery_cfg);
+        /*
+         * compare the luma plane with the last raw frame sent if dirty rects are enabled for the device
+         * @param enabled           @see device_delivery_cfg
+         */
+        void update_dirty_rects(AVFrame *frame, int target_width, int target_height, bool enabled);
+        /*
+         * release the luma plane kept, the next raw frame is reported as changed entirely
+         */
+        void release_last_luma();
+        /*
+         * copy the changed regions into a raw frame
+         */
+        void fill_dirty_rects(scrcpy_frame *raw_frame);
+        /*
+         * keep a reference of the latest decoded frame for snapshots, replacing the previous one
+         */
+        void keep_snapshot_frame(AVFrame *frame);
+        /*
+         * send a packet to the decoder and convert the frames received
+         * @param convert           false to decode only
+         * @param cfg               the setup of the device read for the packet
+         * @return ״̬, -1 means the decoder could not continue
+         */
+        int send_packet(uint64_t pts, int length, AVBufferRef *buffer, int64_t packet_started_at, bool convert, const packet_cfg &cfg);
+        /*
+         * keep a packet from the latest IDR without decoding it
+         * @return 0 if ok
+         */
+        int drain_packet(uint64_t pts, int length, AVBufferRef *buffer);
+        /*
+         * decode the packets kept while draining, only the last one is converted
+         * @return ״̬, -1 means the decoder could not continue
+         */
+        int replay_drained_packets(const packet_cfg &cfg);
+        void release_drained_packets();
 
     public:
         VideoDecoder(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, connection_buffer_config* buffer_cfg,
                 int *keep_running, std::vector<uchar>* img_buffer, int *disconnect_flag);
         ~VideoDecoder(void);
         int decode();
+        /*
+         * setup the decoder with device info received by the caller
+         * @param device_info_data  SCRCPY_DEVICE_INFO_SIZE bytes device info
+         * @return 0 if ok
+         */
+        int start(char *device_info_data);
+        /*
+         * decode a packet received by the caller
+         * @param pts
+         * @param length
+         * @param buffer            refcounted packet payload padded with AV_INPUT_BUFFER_PADDING_SIZE zero bytes
+         * @param packet_started_at when the packet header was received, from pipeline_clock_ns
+         * @return ״̬, -1 means the decoder could not continue
+         */
+        int decode_packet(uint64_t pts, int length, AVBufferRef *buffer, int64_t packet_started_at);
+        /*
+         * stop receiving image size config of the device
+         */
+        void finish();
+        /*
+         * record time spent in a stage if stats is enabled
+         * @param stage         the stage, @see PIPELINE_STAGE_RECV
+         * @param started_at    when the stage started, from pipeline_clock_ns
+         */
+        void record_stage(int stage, int64_t started_at);
+        /*
+         * increase a counter if stats is enabled
+         * @param counter       the counter, @see PIPELINE_COUNTER_BYTES_RECEIVED
+         * @param value         value to add
+         */
+        void record_counter(int counter, uint64_t value);
+        /*
+         * update packets waiting for decoding if stats is enabled
+         * @param ring          the packet ring of the device
+         */
+        void record_packet_queue(packet_ring *ring);
         void free_resources();
         void on_img_size_configured(char *device_id, scrcpy_rect img_size);
+        /*
+         * convert the frame kept in latest frame only mode, called from the delivering task of the device
+         * @return ms until the kept frame could be converted without going over the max fps, -1 if none is kept
+         */
+        int on_frame_ready(char *device_id);
+        /*
+         * scale and encode the latest decoded frame, called from the capturing thread
+         * @param width             image width, 0 for the configured image size or the screen size
+         * @param height            image height, 0 for the configured image size or the screen size
+         * @param output_format     encoded format of the snapshot
+         * @param buffer            encoded image data
+         * @param info              for receiving the frame number and image size
+         * @param fit_frame         scale a size bigger than the decoded frame down to fit it, for the snapshots of the users
+         *                          the resent frame keeps the configured size like the frames delivered after it
+         * @return @see SCRCPY_SNAPSHOT_OK
+         */
+        int capture_snapshot(int width, int height, image_output_format output_format, std::vector<uint8_t> *buffer,
+                scrcpy_frame_info *info, bool fit_frame);
 };
 VideoDecoder::VideoDecoder(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, connection_buffer_config* buffer_cfg,
         int* keep_running, std::vector<uchar>* img_buffer, int *disconnect_flag) {
@@ -123,16 +461,13 @@ int VideoDecoder::read_device_info() {
     char device_info_data[SCRCPY_DEVICE_INFO_SIZE];
     memset(device_info_data, 0, buf_size);
     SPDLOG_TRACE("Trying to read device info from socket {} ", con_addr(this->socket));
-    try {
-        auto bytes_read = this->socket->receive((boost::asio::buffer(device_info_data, buf_size)));
-        SPDLOG_TRACE("{} bytes received from socket {} ", bytes_read, con_addr(this->socket));
-        if (bytes_read < SCRCPY_DEVICE_INFO_SIZE) {
-            return 1;
-        }
-    } catch(boost::system::system_error &e) {
-        SPDLOG_ERROR("Failed to read device info from {}: {}", con_addr(this->socket), e.what());
+    if (this->reader->read(device_info_data, buf_size) != 0) {
+        SPDLOG_ERROR("Failed to read device info from {}", con_addr(this->socket));
         return 1;
     }
+    return this->setup_device(device_info_data);
+}
+int VideoDecoder::setup_device(char *device_info_data) {
     // device id is 64 bytes in total
     int device_size_bytes = 2;
     device_info_data[SCRCPY_DEIVCE_ID_LENGTH - 1] = '\0';
@@ -149,60 +484,99 @@ int VideoDecoder::read_device_info() {
                 std::placeholders::_1, std::placeholders::_2);
         SPDLOG_INFO("Add image size configured callback for device {}", device_id);
         this->callback->add_frame_img_size_cfg_callback(device_id, image_size_config_callback);
+        this->callback->set_frame_ready_callback(device_id, std::bind(&VideoDecoder::on_frame_ready, this, std::placeholders::_1));
+        this->callback->set_snapshot_callback(device_id, std::bind(&VideoDecoder::capture_snapshot, this, std::placeholders::_1,
+                    std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, true));
+        this->stats = this->callback->get_pipeline_stats(device_id);
     }
     return 0;
 }
+void VideoDecoder::record_stage(int stage, int64_t started_at) {
+    if (NULL == this->stats) {
+        return;
+    }
+    this->stats->record(stage, pipeline_clock_ns() - started_at);
+}
+void VideoDecoder::record_counter(int counter, uint64_t value) {
+    if (NULL == this->stats) {
+        return;
+    }
+    this->stats->increase(counter, value);
+}
+void VideoDecoder::record_packet_queue(packet_ring *ring) {
+    if (NULL == this->stats) {
+        return;
+    }
+    this->stats->set_packet_queue_depth(ring->depth());
+}
 void VideoDecoder::on_img_size_configured(char *device_id, scrcpy_rect img_size) {
-    std::lock_guard<std::mutex> locker(this->img_buffer_lock);
-    auto codec_ctx = this->codec_ctx;
-    auto frame = this->frame;
-    bool has_frame = codec_ctx && frame && this->img_buffer;
-    SPDLOG_DEBUG("Frame image size configured to {} x {} for device {}, has_frame ? {}", img_size.width, img_size.height, 
-            device_id, has_frame ? "yes":"no");
-    // resend last frame
-    if(!has_frame) {
-        SPDLOG_WARN("Could not call rgb_frame_and_callback while codec_ctx/frame is null");
+    SPDLOG_DEBUG("Frame image size configured to {} x {} for device {}", img_size.width, img_size.height, device_id);
+    if (!this->callback->has_frame_img_callback(this->device_id)) {
         return;
     }
-    SPDLOG_DEBUG("Trying to invoke rgb_frame_and_callback for device {} when frame image size reconfigured", this->device_id);
-    log_flush();
-
-    cv::Mat target(img_size.width, img_size.height, CV_8UC4);
-    // just resend last frame data
-    cv::Size target_size = cv::Size(img_size.width, img_size.height);
-    
-    auto src_img = cv::imdecode(*this->img_buffer, cv::IMREAD_COLOR);
-    cv::resize(src_img, target, target_size, 0, 0);
-    std::vector<uchar> *target_buffer = new std::vector<uchar>(img_size.width * img_size.height * 4);
-    if (cv::imencode(".png", target, *target_buffer)) {
-        SPDLOG_DEBUG("Called resize with target size {} x {} for device {}. src image size {} x {} ({} bytes), result image size {} x {} ({} bytes).", 
-                target_size.width, target_size.height,
-                this->device_id, src_img.cols, src_img.rows, this->img_buffer->size(),
-                target.cols, target.rows, target_buffer->size());
-        log_flush();
-
-        target.release();
-        int bytes_size = (int)target_buffer->size();
-        SPDLOG_DEBUG("Done resizing. Now sending {} bytes to callback", bytes_size);
-        log_flush();
-
-        uint8_t* img_data = (uint8_t*)target_buffer->data();
-        this->callback->on_video_callback(device_id, img_data, bytes_size, img_size.width, img_size.height, 
-                this->width, this->height);
-    } else {
-        SPDLOG_ERROR("Failed to encode scaled image to png");
+    // called with the lock of the size callbacks, the next decoded frame has the new size anyway
+    if (!this->callback->wait_for_frame_slot(this->device_id, 0)) {
+        SPDLOG_DEBUG("Callbacks of device {} are busy, not resending the last frame", this->device_id);
+        return;
     }
-    delete target_buffer;
-
+    // resend the last decoded frame at the new size, the last image was handed over to the callbacks
+    image_output_format output_format = this->callback->get_output_format(this->device_id);
+    std::vector<uint8_t> target_buffer;
+    scrcpy_frame_info info = {};
+    int status = this->capture_snapshot(img_size.width, img_size.height, output_format, &target_buffer, &info, false);
+    if (status == SCRCPY_SNAPSHOT_NO_FRAME) {
+        SPDLOG_DEBUG("No frame to resend for device {}", this->device_id);
+        return;
+    }
+    if (status != SCRCPY_SNAPSHOT_OK) {
+        SPDLOG_ERROR("Failed to encode scaled image for device {}", this->device_id);
+        return;
+    }
+    SPDLOG_DEBUG("Resending {} bytes of {} x {} image to callback for device {}", target_buffer.size(),
+            info.img_size.width, info.img_size.height, this->device_id);
+    this->callback->on_video_callback(device_id, &target_buffer, info.img_size.width, info.img_size.height,
+            this->width, this->height);
 }
 VideoDecoder::~VideoDecoder() {
     SPDLOG_INFO("Cleaning video decoder");
+    std::lock_guard<std::mutex> convert_guard{ this->convert_lock };
     std::lock_guard<std::mutex> lock_guard{ this->img_buffer_lock };
+    if (this->latest_frame) {
+        av_frame_free(&this->latest_frame);
+    }
+    {
+        std::lock_guard<std::mutex> snapshot_guard{ this->snapshot_lock };
+        if (this->snapshot_frame) {
+            av_frame_free(&this->snapshot_frame);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> sws_guard{ this->snapshot_sws_lock };
+        if (this->snapshot_sws_ctx) {
+            sws_freeContext(this->snapshot_sws_ctx);
+            this->snapshot_sws_ctx = NULL;
+        }
+    }
+    this->release_drained_packets();
     if (this->frame) {
         SPDLOG_DEBUG("Removing frame");
         av_frame_free(&this->frame);
         this->frame = NULL;
     }
+    if (this->sws_ctx) {
+        SPDLOG_DEBUG("Removing sws_ctx");
+        sws_freeContext(this->sws_ctx);
+        this->sws_ctx = NULL;
+    }
+    if (this->raw_sws_ctx) {
+        SPDLOG_DEBUG("Removing raw_sws_ctx");
+        sws_freeContext(this->raw_sws_ctx);
+        this->raw_sws_ctx = NULL;
+    }
+    if (this->raw_data[0]) {
+        av_freep(&this->raw_data[0]);
+    }
+    this->release_last_luma();
     if (this->codec_ctx) {
         SPDLOG_DEBUG("Removing codec_ctx");
         avcodec_free_context(&this->codec_ctx);
@@ -218,32 +592,14 @@ VideoDecoder::~VideoDecoder() {
         av_packet_free(&this->active_packet);
         this->active_packet = NULL;
     }
-    if (this->packet_buffer) {
-        SPDLOG_DEBUG("Removing packet_buffer");
-        free(this->packet_buffer);
-        this->packet_buffer = NULL;
-    }
-    if (this->active_data) {
-        SPDLOG_DEBUG("Removing active_data");
-        free(this->active_data);
-        this->active_data = NULL;
+    if (this->reader) {
+        delete this->reader;
+        this->reader = NULL;
     }
     log_flush();
 }
 int VideoDecoder::init_decoder() {
     int result = 0;
-    connection_buffer_config* cfg = this->buffer_cfg;
-    //ڴ
-    this->packet_buffer = (char *)malloc(cfg->video_packet_buffer_size_kb * 1024);
-    if (!this->packet_buffer) {
-        SPDLOG_ERROR("No enough memory for packet buffer");
-        return -1;
-    }
-    this->active_data = (char*)malloc(cfg->video_packet_buffer_size_kb * 1024);
-    if (!this->active_data) {
-        SPDLOG_ERROR("No enough memory for active_data");
-        return -1;
-    }
     enum AVCodecID h264 = AV_CODEC_ID_H264;
     const AVCodec *codec = (AVCodec *)avcodec_find_decoder(h264);
     if (!codec) {
@@ -255,6 +611,12 @@ int VideoDecoder::init_decoder() {
         SPDLOG_ERROR("No enough memory for codec_context");
         return -1;
     }
+    int profile = this->callback ? this->callback->get_decoder_profile(this->device_id) : -1;
+    if (profile < 0) {
+        profile = this->buffer_cfg->decoder_profile;
+    }
+    SPDLOG_INFO("Opening h264 decoder with profile {} for device {}", profile, this->device_id);
+    apply_decoder_profile(codec_context, profile);
     if (avcodec_open2(codec_context, codec, NULL) != 0) {
         SPDLOG_ERROR("Failed to open codec");
         avcodec_free_context(&codec_context);
@@ -276,6 +638,7 @@ int VideoDecoder::init_decoder() {
     }
     this->codec = const_cast<AVCodec*>(codec);
     this->codec_ctx = codec_context;
+    this->profile_skip_loop_filter = codec_context->skip_loop_filter;
     this->codec_parser_context = codec_parser_context;
     this->active_packet = packet;
     return result;
@@ -283,15 +646,10 @@ int VideoDecoder::init_decoder() {
 int VideoDecoder::read_video_header(struct VideoHeader* header) {
     char* header_buffer = this->header_buffer;
     SPDLOG_DEBUG("Trying to read video header({} bytes) from {} into {} ", H264_HEAD_BUFFER_SIZE, con_addr(this->socket), (uintptr_t)header_buffer);
-    int bytes_received = 0;
-    try {
-        bytes_received = (int)this->socket->receive(boost::asio::buffer(header_buffer, H264_HEAD_BUFFER_SIZE));
-        if (bytes_received != H264_HEAD_BUFFER_SIZE) {
-            SPDLOG_ERROR("Error, Read {}/{} for video header", bytes_received, H264_HEAD_BUFFER_SIZE);
-            return 1;
-        }
-    }catch(boost::system::system_error& e) {
-        SPDLOG_ERROR("Could not read video header {}", e.what());
+    int bytes_received = H264_HEAD_BUFFER_SIZE;
+    // mostly served from bytes read together with the previous packet
+    if (this->reader->read(header_buffer, H264_HEAD_BUFFER_SIZE) != 0) {
+        SPDLOG_ERROR("Could not read video header from {}", con_addr(this->socket));
         return 1;
     }
     uint64_t pts = to_long(header_buffer, bytes_received, 0, 8);
@@ -301,95 +659,33 @@ int VideoDecoder::read_video_header(struct VideoHeader* header) {
     SPDLOG_DEBUG("header.length={} header.pts={}", length, pts);
     return bytes_received;
 }
-int VideoDecoder::recv_network_buffer(int length, char* buffer, char* chunk) {
-    int result = 0;
-    int read_total = 0;
-    int max_chunk = PACKET_CHUNK_BUFFER_SIZE;
-    while (read_total < length) {
-        int chunk_read_plan = min(max_chunk, length - read_total);
-        int read_length = 0;
-        try {
-            read_length = (int)this->socket->receive(boost::asio::buffer(chunk, chunk_read_plan));
-        } catch(boost::system::system_error& e) {
-            SPDLOG_ERROR("Failed to recv_network_buffer {}", e.what());
-            return 1;
-        }
-        if (read_length != chunk_read_plan) {
-            SPDLOG_DEBUG("Planned to read {} bytes, got {} bytes instead from socket={}", chunk_read_plan, read_length, con_addr(this->socket));
-        }
-        else if (read_length <= 0) {
-            SPDLOG_ERROR("Connection may be closed for device {}", this->device_id);
-            result = -1;
-            break;
-        }
-        int fill_start_index = read_total;
-        read_total += read_length;
-        SPDLOG_TRACE("Receiving {}/{} from network for socket {}", read_total, length, con_addr(this->socket));
-        array_copy_to(chunk, buffer, fill_start_index, read_length);
+int VideoDecoder::recv_network_buffer(int length, char* buffer) {
+    // the payload is read into its final place, bytes after it are kept for the next header
+    if (this->reader->read(buffer, length) != 0) {
+        SPDLOG_ERROR("Failed to recv_network_buffer for device {}", this->device_id);
+        return 1;
     }
-    return result;
+    SPDLOG_TRACE("Received {} bytes from network for socket {}", length, con_addr(this->socket));
+    return 0;
 }
-int VideoDecoder::prepare_packet(uint64_t pts, int length) {
-    int result = 0;
+int VideoDecoder::prepare_packet(uint64_t pts, int length, AVBufferRef *buffer) {
     AVPacket* active_packet = this->active_packet;
-    BOOL has_pending = this->has_pending;
-
-    active_packet->size = length;
+    av_packet_unref(active_packet);
     active_packet->pts = (pts == -1 ? AV_NOPTS_VALUE : pts);
-
-    BOOL is_config = active_packet->pts == AV_NOPTS_VALUE;
-
-    this->packet_stat.pts = active_packet->pts;
-    this->packet_stat.dts = active_packet->dts;
-    this->packet_stat.flags = active_packet->flags;
-
-    SPDLOG_TRACE("is_config = {}, has_pending = {} for socket {}", is_config ? "yes" : "no", has_pending ? "yes" : "no", con_addr(this->socket));
-    if (is_config || has_pending) {
-        int offset = 0;
-        if (has_pending) {
-            SPDLOG_TRACE("Detected pending, offset will be {} ", this->pending_data_length);
-            offset = this->pending_data_length;
-        }
-        else {
-            SPDLOG_TRACE("no pending data, saving received data to pending buffer for socket {}", con_addr(this->socket));
-            array_copy_to(this->packet_buffer, this->active_data, 0, length);
-            this->pending_data_length = length;
-            this->has_pending = TRUE;
-        }
-        if (offset > 0) {
-            int new_size = this->pending_data_length + length;
-            SPDLOG_TRACE("Existed pending data size = {}, current pending size = {}, final size={}, socket={}", this->pending_data_length, length, 
-                    new_size, con_addr(this->socket));
-            array_copy_to(this->packet_buffer, this->active_data, this->pending_data_length, length);
-            this->pending_data_length = 0;
-            active_packet->data = (uint8_t *)this->active_data;
-            active_packet->size = new_size;
-            this->has_pending = FALSE;
-        }
-        if (!is_config) {
-            SPDLOG_TRACE("Preparing active packet");
-            active_packet->data = NULL;
-            int old_size = active_packet->size;
-
-            av_packet_unref(active_packet);
-
-            active_packet->data = (uint8_t*)this->active_data;
-            active_packet->dts = this->packet_stat.dts;
-            active_packet->flags = this->packet_stat.flags;
-            active_packet->pts = this->packet_stat.pts;
-            active_packet->size = old_size;
-        }
-    } else {
-        this->pending_data_length = 0;
-        active_packet->data = (uint8_t*)this->packet_buffer;
-    }
-    if (is_config) {
+    if (active_packet->pts == AV_NOPTS_VALUE) {
+        // config packets are merged into the next packet while receiving, a standalone one has nothing to decode
         SPDLOG_TRACE("In configuring, will not call decoder for socket {}", con_addr(this->socket));
-        active_packet->data = NULL;
-        av_packet_unref(active_packet);
-        result = 1;
+        return 1;
     }
-    return result;
+    // a refcounted packet is referenced by avcodec_send_packet instead of being copied
+    active_packet->buf = av_buffer_ref(buffer);
+    if (!active_packet->buf) {
+        SPDLOG_ERROR("No enough memory for referencing packet of device {}", this->device_id);
+        return -1;
+    }
+    active_packet->data = buffer->data;
+    active_packet->size = length;
+    return 0;
 }
 image_size* VideoDecoder::get_image_size() {
     if (NULL == this->callback) {
@@ -402,9 +698,24 @@ image_size* VideoDecoder::get_image_size() {
     }
     return this->callback->get_configured_img_size(this->device_id);
 }
+bool VideoDecoder::encode_image(const cv::Mat &image, std::vector<uchar> *buffer, image_output_format output_format) {
+    std::vector<int> params;
+    const char *ext = image_encode_params(output_format, &params);
+    return cv::imencode(ext, image, *buffer, params);
+}
 int frame_count = 1;
-int VideoDecoder::rgb_frame_and_callback(AVCodecContext* dec_ctx, AVFrame* frame) {
-    struct SwsContext *sws_ctx = NULL;
+void VideoDecoder::read_packet_cfg(packet_cfg *cfg) {
+    if (!this->callback) {
+        return;
+    }
+    cfg->delivery = this->callback->get_delivery_cfg(this->device_id);
+    cfg->raw_format = this->callback->get_raw_frame_format(this->device_id);
+    cfg->encode_needed = this->callback->has_frame_img_callback(this->device_id);
+    if (cfg->encode_needed) {
+        cfg->output_format = this->callback->get_output_format(this->device_id);
+    }
+}
+int VideoDecoder::rgb_frame_and_callback(AVCodecContext* dec_ctx, AVFrame* frame, const packet_cfg &cfg) {
     int width = frame->width;
     int height = frame->height;
 
@@ -418,53 +729,496 @@ int VideoDecoder::rgb_frame_and_callback(AVCodecContext* dec_ctx, AVFrame* frame
         target_height = configrued_size->height;
         SPDLOG_TRACE("Resizing image from {}x{} to {}x{}", width, height, target_width, target_height);
     }
+    int raw_format = cfg.raw_format;
+    // image encoding is skipped if only raw frame callbacks are registered
+    bool encode_needed = cfg.encode_needed;
+    if (raw_format < 0 && !encode_needed) {
+        // nobody is waiting for the frame, skip scaling and encoding
+        this->record_counter(PIPELINE_COUNTER_DROPPED_FRAMES, 1);
+        // new subscribers get the next frame even if it's unchanged
+        this->last_frame_hash = 0;
+        return 0;
+    }
+    if (this->is_identical_frame(frame, target_width, target_height, cfg.delivery)) {
+        this->record_counter(PIPELINE_COUNTER_DROPPED_FRAMES, 1);
+        return 0;
+    }
+    if (raw_format >= 0) {
+        this->update_dirty_rects(frame, target_width, target_height, cfg.delivery.dirty_rects);
+    } else {
+        this->release_last_luma();
+    }
+    if (raw_format >= 0 && raw_format != SCRCPY_PIXEL_FORMAT_BGRA) {
+        this->raw_frame_and_callback(dec_ctx, frame, raw_format, target_width, target_height, cfg.delivery.full_res_decoding);
+    }
+    if (!encode_needed && raw_format != SCRCPY_PIXEL_FORMAT_BGRA) {
+        return 0;
+    }
 
-    cv::Mat image(target_height, target_width, CV_8UC4);
+    // both are reallocated only if the size changed, e.g. rotated or resized by on_img_size_configured
+    cv::Mat &image = this->rgb_image;
+    image.create(target_height, target_width, CV_8UC4);
     cv_line_size[0] = (int)image.step1();
 
-    sws_ctx = sws_getContext(dec_ctx->width,
-            dec_ctx->height,
-            dec_ctx->pix_fmt,
+    // the frame's own size, the codec context could have been changed by the decoding thread in latest frame only mode
+    struct SwsContext *sws_ctx = sws_getCachedContext(this->sws_ctx,
+            width,
+            height,
+            (enum AVPixelFormat)frame->format,
             target_width,
             target_height,
             AV_PIX_FMT_RGB32,
-            SWS_BICUBIC,
+            this->scale_flags(frame, target_width, target_height, cfg.delivery.full_res_decoding),
             NULL,
             NULL,
             NULL);
+    this->sws_ctx = sws_ctx;
     if (NULL == sws_ctx) {
         return 1;
     }
+    int64_t stage_started_at = pipeline_clock_ns();
     sws_scale(sws_ctx, frame->data, frame->linesize, 0, height, &image.data, cv_line_size);
-    sws_freeContext(sws_ctx);
+    this->record_stage(PIPELINE_STAGE_SCALE, stage_started_at);
+    if (raw_format == SCRCPY_PIXEL_FORMAT_BGRA) {
+        // AV_PIX_FMT_RGB32 is BGRA in memory, same as what opencv uses
+        scrcpy_frame raw_frame = {};
+        raw_frame.format = SCRCPY_PIXEL_FORMAT_BGRA;
+        raw_frame.width = target_width;
+        raw_frame.height = target_height;
+        raw_frame.planes = 1;
+        raw_frame.data[0] = image.data;
+        raw_frame.linesize[0] = cv_line_size[0];
+        this->fill_dirty_rects(&raw_frame);
+        this->callback->on_raw_frame_callback(this->device_id, &raw_frame, this->width, this->height);
+    }
+    if (!encode_needed) {
+        return 0;
+    }
     std::lock_guard<std::mutex> lock_guard{ this->img_buffer_lock };
-    SPDLOG_TRACE("Encoding image to png format");
-    if (cv::imencode(".png", image, *this->img_buffer)) {
-        image.release();
-        int img_size = (int)this->img_buffer->size();
-        SPDLOG_TRACE("sending {} bytes to callback", img_size);
-        uint8_t* img_data = (uint8_t*)this->img_buffer->data();
-        this->callback->on_video_callback(device_id, img_data, (int)this->img_buffer->size(), target_width, target_height, 
-                this->width, this->height);
+    SPDLOG_TRACE("Encoding frame image");
+    stage_started_at = pipeline_clock_ns();
+    bool encoded = this->encode_image(image, this->img_buffer, cfg.output_format);
+    this->record_stage(PIPELINE_STAGE_ENCODE, stage_started_at);
+    if (encoded) {
+        this->record_counter(PIPELINE_COUNTER_ENCODED_FRAMES, 1);
+        SPDLOG_TRACE("sending {} bytes to callback", this->img_buffer->size());
+        // handed over without copying, the next frame is encoded into the buffer got back
+        this->callback->on_video_callback(device_id, this->img_buffer, target_width, target_height, this->width, this->height);
     } else {
-        SPDLOG_ERROR("Failed to encode a png file");
+        SPDLOG_ERROR("Failed to encode frame image for device {}", this->device_id);
     }
     return 0;
 }
-int VideoDecoder::decode_frames(uint64_t pts, int length) {
+int VideoDecoder::raw_frame_and_callback(AVCodecContext* dec_ctx, AVFrame* frame, int format, int target_width, int target_height,
+        bool full_res) {
+    enum AVPixelFormat pix_fmt = raw_frame_pix_fmt(format);
+    if (!this->raw_data[0] || this->raw_width != target_width || this->raw_height != target_height || this->raw_format != format) {
+        if (this->raw_data[0]) {
+            av_freep(&this->raw_data[0]);
+        }
+        if (av_image_alloc(this->raw_data, this->raw_linesize, target_width, target_height, pix_fmt, 32) < 0) {
+            SPDLOG_ERROR("No enough memory for raw frame {}x{} of device {}", target_width, target_height, this->device_id);
+            this->raw_data[0] = NULL;
+            return 1;
+        }
+        this->raw_width = target_width;
+        this->raw_height = target_height;
+        this->raw_format = format;
+    }
+    this->raw_sws_ctx = sws_getCachedContext(this->raw_sws_ctx,
+            frame->width,
+            frame->height,
+            (enum AVPixelFormat)frame->format,
+            target_width,
+            target_height,
+            pix_fmt,
+            this->scale_flags(frame, target_width, target_height, full_res),
+            NULL,
+            NULL,
+            NULL);
+    if (NULL == this->raw_sws_ctx) {
+        return 1;
+    }
+    int64_t stage_started_at = pipeline_clock_ns();
+    sws_scale(this->raw_sws_ctx, frame->data, frame->linesize, 0, frame->height, this->raw_data, this->raw_linesize);
+    this->record_stage(PIPELINE_STAGE_SCALE, stage_started_at);
+    int planes = format == SCRCPY_PIXEL_FORMAT_I420 ? 3 : (format == SCRCPY_PIXEL_FORMAT_NV12 ? 2 : 1);
+    scrcpy_frame raw_frame = {};
+    raw_frame.format = format;
+    raw_frame.width = target_width;
+    raw_frame.height = target_height;
+    raw_frame.planes = planes;
+    for (int i = 0; i < planes; i++) {
+        raw_frame.data[i] = this->raw_data[i];
+        raw_frame.linesize[i] = this->raw_linesize[i];
+    }
+    this->fill_dirty_rects(&raw_frame);
+    this->callback->on_raw_frame_callback(this->device_id, &raw_frame, this->width, this->height);
+    return 0;
+}
+bool VideoDecoder::is_over_max_fps(AVFrame *frame, int max_fps) {
+    if (max_fps <= 0 || frame->pts == AV_NOPTS_VALUE || this->last_converted_pts == AV_NOPTS_VALUE) {
+        return false;
+    }
+    int64_t elapsed = frame->pts - this->last_converted_pts;
+    // pts went backwards, e.g. the encoder of the device was restarted
+    if (elapsed < 0) {
+        return false;
+    }
+    int64_t interval = VIDEO_PTS_PER_SECOND / max_fps;
+    int64_t elapsed_ns = pipeline_clock_ns() - this->last_converted_at;
+    return elapsed < interval && elapsed_ns < interval * (1000000000LL / VIDEO_PTS_PER_SECOND);
+}
+void VideoDecoder::convert_frame(AVFrame *frame, const packet_cfg &cfg) {
+    int64_t stage_started_at = pipeline_clock_ns();
+    this->rgb_frame_and_callback(this->codec_ctx, frame, cfg);
+    this->record_stage(PIPELINE_STAGE_CONVERT, stage_started_at);
+    this->last_converted_pts = frame->pts;
+    this->last_converted_at = pipeline_clock_ns();
+}
+void VideoDecoder::keep_latest_frame(AVFrame *frame, int max_fps) {
+    bool kept = false;
+    {
+        std::lock_guard<std::mutex> convert_guard{ this->convert_lock };
+        kept = this->replace_latest_frame(frame, max_fps);
+    }
+    if (kept) {
+        this->callback->request_frame_ready(this->device_id);
+    }
+}
+bool VideoDecoder::replace_latest_frame(AVFrame *frame, int max_fps) {
+    this->latest_frame_max_fps = max_fps;
+    if (NULL == this->latest_frame) {
+        this->latest_frame = av_frame_alloc();
+        if (!this->latest_frame) {
+            SPDLOG_ERROR("No enough memory for keeping latest frame of device {}", this->device_id);
+            return false;
+        }
+    }
+    if (this->has_latest_frame) {
+        // superseded before the callbacks were ready
+        this->record_counter(PIPELINE_COUNTER_DROPPED_FRAMES, 1);
+    }
+    av_frame_unref(this->latest_frame);
+    if (av_frame_ref(this->latest_frame, frame) != 0) {
+        SPDLOG_ERROR("Failed to reference latest frame of device {}", this->device_id);
+        this->has_latest_frame = false;
+        return false;
+    }
+    this->has_latest_frame = true;
+    return true;
+}
+void VideoDecoder::keep_snapshot_frame(AVFrame *frame) {
+    std::lock_guard<std::mutex> snapshot_guard{ this->snapshot_lock };
+    if (NULL == this->snapshot_frame) {
+        this->snapshot_frame = av_frame_alloc();
+        if (!this->snapshot_frame) {
+            SPDLOG_ERROR("No enough memory for keeping snapshot frame of device {}", this->device_id);
+            return;
+        }
+    }
+    av_frame_unref(this->snapshot_frame);
+    if (av_frame_ref(this->snapshot_frame, frame) != 0) {
+        SPDLOG_ERROR("Failed to reference snapshot frame of device {}", this->device_id);
+        this->snapshot_seq = 0;
+        return;
+    }
+    this->snapshot_seq++;
+}
+int VideoDecoder::capture_snapshot(int width, int height, image_output_format output_format, std::vector<uint8_t> *buffer,
+        scrcpy_frame_info *info, bool fit_frame) {
+    AVFrame *frame = NULL;
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> snapshot_guard{ this->snapshot_lock };
+        if (NULL == this->snapshot_frame || 0 == this->snapshot_seq) {
+            return SCRCPY_SNAPSHOT_NO_FRAME;
+        }
+        // our own reference, so the decoding thread could replace the kept frame while scaling
+        frame = av_frame_clone(this->snapshot_frame);
+        seq = this->snapshot_seq;
+    }
+    if (NULL == frame) {
+        SPDLOG_ERROR("Failed to reference snapshot frame of device {}", this->device_id);
+        return SCRCPY_SNAPSHOT_FAILED;
+    }
+    if (width <= 0 || height <= 0) {
+        width = frame->width;
+        height = frame->height;
+        image_size *configured_size = this->get_image_size();
+        if (NULL != configured_size && configured_size->width > 0 && configured_size->height > 0) {
+            width = configured_size->width;
+            height = configured_size->height;
+        }
+    }
+    if (fit_frame && (width > frame->width || height > frame->height)) {
+        // a bigger image has no more details, it's scaled down to fit the frame with the same aspect ratio
+        double ratio = std::min((double)frame->width / width, (double)frame->height / height);
+        width = std::max(1, (int)(width * ratio));
+        height = std::max(1, (int)(height * ratio));
+    }
+    cv::Mat image;
+    try {
+        image.create(height, width, CV_8UC4);
+    } catch (cv::Exception &e) {
+        SPDLOG_ERROR("Could not allocate {}x{} snapshot of device {}: {}", width, height, this->device_id, e.what());
+        av_frame_free(&frame);
+        return SCRCPY_SNAPSHOT_FAILED;
+    }
+    int cv_line_size[1] = { (int)image.step1() };
+    bool full_res = this->callback && this->callback->get_delivery_cfg(this->device_id).full_res_decoding;
+    bool scaled = false;
+    {
+        std::lock_guard<std::mutex> sws_guard{ this->snapshot_sws_lock };
+        this->snapshot_sws_ctx = sws_getCachedContext(this->snapshot_sws_ctx,
+                frame->width,
+                frame->height,
+                (enum AVPixelFormat)frame->format,
+                width,
+                height,
+                AV_PIX_FMT_RGB32,
+                this->scale_flags(frame, width, height, full_res),
+                NULL,
+                NULL,
+                NULL);
+        if (NULL != this->snapshot_sws_ctx) {
+            int64_t stage_started_at = pipeline_clock_ns();
+            sws_scale(this->snapshot_sws_ctx, frame->data, frame->linesize, 0, frame->height, &image.data, cv_line_size);
+            this->record_stage(PIPELINE_STAGE_SCALE, stage_started_at);
+            scaled = true;
+        }
+    }
+    av_frame_free(&frame);
+    if (!scaled) {
+        SPDLOG_ERROR("Could not scale snapshot of device {} to {}x{}", this->device_id, width, height);
+        return SCRCPY_SNAPSHOT_FAILED;
+    }
+    std::vector<int> params;
+    const char *ext = image_encode_params(output_format, &params);
+    int64_t stage_started_at = pipeline_clock_ns();
+    try {
+        if (!cv::imencode(ext, image, *buffer, params)) {
+            SPDLOG_ERROR("Failed to encode snapshot of device {}", this->device_id);
+            return SCRCPY_SNAPSHOT_FAILED;
+        }
+    } catch (cv::Exception &e) {
+        SPDLOG_ERROR("Failed to encode snapshot of device {}: {}", this->device_id, e.what());
+        return SCRCPY_SNAPSHOT_FAILED;
+    }
+    this->record_stage(PIPELINE_STAGE_ENCODE, stage_started_at);
+    this->record_counter(PIPELINE_COUNTER_ENCODED_FRAMES, 1);
+    info->seq = seq;
+    info->size = (uint32_t)buffer->size();
+    info->img_size = scrcpy_rect{ width, height };
+    info->orig_size = scrcpy_rect{ this->width, this->height };
+    return SCRCPY_SNAPSHOT_OK;
+}
+int VideoDecoder::on_frame_ready(char *device_id) {
+    // called once the callbacks are idle, so check without locking first
+    if (!this->has_latest_frame) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> convert_guard{ this->convert_lock };
+    if (!this->has_latest_frame) {
+        return -1;
+    }
+    // kept until the interval passed, unless a newer frame replaces it
+    if (this->is_over_max_fps(this->latest_frame, this->latest_frame_max_fps)) {
+        int64_t remaining_ns = this->last_converted_at + 1000000000LL / this->latest_frame_max_fps - pipeline_clock_ns();
+        return remaining_ns > 1000000 ? (int)((remaining_ns + 999999) / 1000000) : 1;
+    }
+    this->has_latest_frame = false;
+    packet_cfg cfg;
+    this->read_packet_cfg(&cfg);
+    this->convert_frame(this->latest_frame, cfg);
+    av_frame_unref(this->latest_frame);
+    return -1;
+}
+void VideoDecoder::decode_packets(packet_ring *ring) {
+    packet_ring_slot *slot = NULL;
+    while ((slot = ring->acquire_read()) != NULL) {
+        int decode_status = this->decode_packet(slot->pts, slot->length, slot->buffer, slot->received_at);
+        ring->commit_read();
+        this->record_packet_queue(ring);
+        if (decode_status == -1) {
+            SPDLOG_ERROR("Bad status for decoding video from device {}, will not continue", this->device_id);
+            // stop the receiving side too
+            ring->close();
+            break;
+        }
+    }
+    SPDLOG_DEBUG("Decoding thread stopped for device {}", this->device_id);
+}
+int VideoDecoder::decode_packet(uint64_t pts, int length, AVBufferRef *buffer, int64_t packet_started_at) {
+    // the frames of the packet are converted with this setup
+    packet_cfg cfg;
+    this->read_packet_cfg(&cfg);
+    const device_delivery_cfg &delivery_cfg = cfg.delivery;
+    // snapshots could be captured at any size
+    this->update_low_res(delivery_cfg.full_res_decoding || delivery_cfg.snapshot_mode);
+    // nobody subscribed to the frames
+    if (delivery_cfg.drain_when_idle && !delivery_cfg.snapshot_mode && cfg.raw_format < 0 && !cfg.encode_needed) {
+        return this->drain_packet(pts, length, buffer);
+    }
+    if (!this->drained_packets.empty() && this->replay_drained_packets(cfg) == -1) {
+        return -1;
+    }
+    if (this->wait_keyframe) {
+        if (!h264_has_idr((char *)buffer->data, length)) {
+            this->record_counter(PIPELINE_COUNTER_DROPPED_FRAMES, 1);
+            return 0;
+        }
+        this->wait_keyframe = false;
+    }
+    // the packets after an IDR are skipped in keyframe only mode, so the next ones could only be decoded from an IDR
+    this->wait_keyframe = delivery_cfg.keyframe_only;
+    return this->send_packet(pts, length, buffer, packet_started_at, true, cfg);
+}
+void VideoDecoder::update_low_res(bool full_res) {
+    image_size *size = this->get_image_size();
+    bool low_res = !full_res && NULL != size && is_low_res_scale(this->width, this->height, size->width, size->height);
+    if (low_res == this->low_res) {
+        return;
+    }
+    SPDLOG_INFO("Device {} {} the low resolution path", this->device_id, low_res ? "enters" : "leaves");
+    this->low_res = low_res;
+    // takes effect from the next slice, the error drifting with skipped deblocking is reset by the next IDR
+    this->codec_ctx->skip_loop_filter = low_res ? AVDISCARD_ALL : this->profile_skip_loop_filter;
+}
+int VideoDecoder::scale_flags(AVFrame *frame, int target_width, int target_height, bool full_res) {
+    if (full_res) {
+        return SWS_BICUBIC;
+    }
+    return is_low_res_scale(frame->width, frame->height, target_width, target_height) ? SWS_AREA : SWS_BICUBIC;
+}
+bool VideoDecoder::is_identical_frame(AVFrame *frame, int target_width, int target_height, const device_delivery_cfg &delivery_cfg) {
+    if (!delivery_cfg.skip_identical_frames) {
+        this->last_frame_hash = 0;
+        return false;
+    }
+    // a resized image is sent again
+    uint64_t hash = frame_hash(frame, ((uint64_t)target_width << 32) | (uint32_t)target_height);
+    int64_t now = pipeline_clock_ns();
+    if (hash == this->last_frame_hash &&
+            (delivery_cfg.heartbeat_ms <= 0 || now - this->last_frame_sent_at < delivery_cfg.heartbeat_ms * 1000000LL)) {
+        return true;
+    }
+    this->last_frame_hash = hash;
+    this->last_frame_sent_at = now;
+    return false;
+}
+void VideoDecoder::update_dirty_rects(AVFrame *frame, int target_width, int target_height, bool enabled) {
+    if (!enabled) {
+        this->release_last_luma();
+        this->dirty_rect_count = -1;
+        return;
+    }
+    int width = frame->width;
+    int height = frame->height;
+    if (this->last_luma && this->last_luma_width == width && this->last_luma_height == height) {
+        int count = diff_tiles(this->last_luma, width, frame->data[0], frame->linesize[0], width, height, DIRTY_TILE_SIZE,
+                this->dirty_rects, SCRCPY_MAX_DIRTY_RECTS);
+        // from screen pixels to the scaled frame's, rounded outwards
+        for (int i = 0; i < count; i++) {
+            scrcpy_area *rect = &this->dirty_rects[i];
+            int left = (int)((int64_t)rect->x * target_width / width);
+            int top = (int)((int64_t)rect->y * target_height / height);
+            int right = (int)(((int64_t)(rect->x + rect->width) * target_width + width - 1) / width);
+            int bottom = (int)(((int64_t)(rect->y + rect->height) * target_height + height - 1) / height);
+            *rect = scrcpy_area{ left, top, right - left, bottom - top };
+        }
+        this->dirty_rect_count = count;
+    } else {
+        // the first frame, or the screen was rotated
+        this->release_last_luma();
+        this->last_luma = (uint8_t *)malloc((size_t)width * height);
+        if (!this->last_luma) {
+            SPDLOG_ERROR("No enough memory for keeping the luma plane of device {}", this->device_id);
+            this->dirty_rect_count = -1;
+            return;
+        }
+        this->last_luma_width = width;
+        this->last_luma_height = height;
+        this->dirty_rects[0] = scrcpy_area{ 0, 0, target_width, target_height };
+        this->dirty_rect_count = 1;
+    }
+    for (int y = 0; y < height; y++) {
+        memcpy(this->last_luma + (size_t)y * width, frame->data[0] + (size_t)y * frame->linesize[0], width);
+    }
+}
+void VideoDecoder::release_last_luma() {
+    if (this->last_luma) {
+        free(this->last_luma);
+        this->last_luma = NULL;
+    }
+    this->last_luma_width = 0;
+    this->last_luma_height = 0;
+}
+void VideoDecoder::fill_dirty_rects(scrcpy_frame *raw_frame) {
+    raw_frame->dirty_rect_count = this->dirty_rect_count;
+    for (int i = 0; i < this->dirty_rect_count; i++) {
+        raw_frame->dirty_rects[i] = this->dirty_rects[i];
+    }
+}
+int VideoDecoder::drain_packet(uint64_t pts, int length, AVBufferRef *buffer) {
+    // the decoder misses these packets, so decoding could only restart from an IDR
+    this->wait_keyframe = true;
+    if (h264_has_idr((char *)buffer->data, length)) {
+        this->release_drained_packets();
+    } else if (this->drained_packets.empty() || this->drained_gop_truncated) {
+        return 0;
+    } else if (this->drained_bytes + length > DRAIN_MAX_GOP_BYTES) {
+        SPDLOG_DEBUG("Too many packets after the IDR of device {}, only the IDR is kept", this->device_id);
+        while (this->drained_packets.size() > 1) {
+            av_buffer_unref(&this->drained_packets.back().buffer);
+            this->drained_packets.pop_back();
+        }
+        this->drained_bytes = this->drained_packets.front().length;
+        this->drained_gop_truncated = true;
+        return 0;
+    }
+    // the slot buffer is replaced by the ring while referenced here
+    AVBufferRef *ref = av_buffer_ref(buffer);
+    if (!ref) {
+        SPDLOG_ERROR("No enough memory for keeping a drained packet of device {}", this->device_id);
+        return -1;
+    }
+    this->drained_packets.push_back(drained_packet{ pts, length, ref });
+    this->drained_bytes += length;
+    return 0;
+}
+int VideoDecoder::replay_drained_packets(const packet_cfg &cfg) {
+    SPDLOG_DEBUG("Decoding {} drained packets of device {}", this->drained_packets.size(), this->device_id);
+    int result = 0;
+    int count = (int)this->drained_packets.size();
+    for (int i = 0; i < count && result != -1; i++) {
+        drained_packet *packet = &this->drained_packets[i];
+        result = this->send_packet(packet->pts, packet->length, packet->buffer, pipeline_clock_ns(), i == count - 1, cfg);
+    }
+    // without the packets after the IDR, the next ones could not be decoded correctly
+    this->wait_keyframe = this->drained_gop_truncated;
+    this->release_drained_packets();
+    return result;
+}
+void VideoDecoder::release_drained_packets() {
+    for (drained_packet &packet : this->drained_packets) {
+        av_buffer_unref(&packet.buffer);
+    }
+    this->drained_packets.clear();
+    this->drained_bytes = 0;
+    this->drained_gop_truncated = false;
+}
+int VideoDecoder::send_packet(uint64_t pts, int length, AVBufferRef *buffer, int64_t packet_started_at, bool convert,
+        const packet_cfg &cfg) {
     int result = 0;
-    BOOL reset_has_pending = FALSE;
     int status = 0;
     AVFrame* frame = NULL;
-    SPDLOG_DEBUG("decode_frames pts={} length={} socket={}", pts, length, con_addr(this->socket));
-    result = this->recv_network_buffer(length, this->packet_buffer, this->packet_chunk);
-    // failed to receiving data
-    if (result != 0) {
-        return -1;
-    }
-    result = this->prepare_packet(pts, length);
+    int64_t stage_started_at = pipeline_clock_ns();
+    int64_t decode_ns = 0;
+    result = this->prepare_packet(pts, length, buffer);
+    this->record_stage(PIPELINE_STAGE_PREPARE, stage_started_at);
     // no need to do decoding
-    if (result == 1) {
+    if (result != 0) {
         return result;
     }
     SPDLOG_DEBUG("Fetching codec parser context for socekt {}", con_addr(this->socket));
@@ -477,12 +1231,11 @@ int VideoDecoder::decode_frames(uint64_t pts, int length) {
     AVCodecContext* codec_context = this->codec_ctx;
     SPDLOG_DEBUG("Sending packet for decoding, data pointer address is {} size={} socket={}", (uintptr_t)active_packet->data,
             active_packet->size, con_addr(this->socket));
+    stage_started_at = pipeline_clock_ns();
     result = avcodec_send_packet(codec_context, active_packet);
+    decode_ns += pipeline_clock_ns() - stage_started_at;
     if (result != 0) {
-        reset_has_pending = TRUE;
         SPDLOG_ERROR("Could not invoke avcodec_send_packet: {} socket={}", result, con_addr(this->socket));
-        active_packet->data = NULL;
-        av_packet_unref(active_packet);
         goto end;
     }
     if (NULL == this->frame) {
@@ -494,30 +1247,54 @@ int VideoDecoder::decode_frames(uint64_t pts, int length) {
     }
     frame = this->frame;
     while (status >= 0) {
+        stage_started_at = pipeline_clock_ns();
         status = avcodec_receive_frame(codec_context, frame);
+        decode_ns += pipeline_clock_ns() - stage_started_at;
         if (status == 0) {
             SPDLOG_DEBUG("Got frame with width={} height={} socket={} ", frame->width, frame->height, con_addr(this->socket));
-            this->rgb_frame_and_callback(codec_context, frame);
+            this->record_counter(PIPELINE_COUNTER_DECODED_FRAMES, 1);
+            this->keep_snapshot_frame(frame);
+            if (!convert) {
+                continue;
+            }
+            const device_delivery_cfg &delivery_cfg = cfg.delivery;
+            if (delivery_cfg.snapshot_mode) {
+                // scaled and encoded only when a snapshot is captured
+                continue;
+            }
+            if (delivery_cfg.latest_frame_only) {
+                // converted by on_frame_ready once the callbacks are waiting for a frame
+                this->keep_latest_frame(frame, delivery_cfg.max_fps);
+                continue;
+            }
+            // slow callbacks with SCRCPY_DELIVERY_BLOCK are waited for here, not while holding the locks
+            this->callback->wait_for_frame_slot(this->device_id, -1);
+            std::lock_guard<std::mutex> convert_guard{ this->convert_lock };
+            if (this->is_over_max_fps(frame, delivery_cfg.max_fps)) {
+                // decoded only, so the following frames could still reference it
+                this->record_counter(PIPELINE_COUNTER_DROPPED_FRAMES, 1);
+                continue;
+            }
+            this->convert_frame(frame, cfg);
         }
         else if (status == AVERROR(EAGAIN)) {
-            active_packet->data = NULL;
-            av_packet_unref(active_packet);
-            reset_has_pending = TRUE;
             goto end;
         }
         else if (status == AVERROR_EOF) {
-            reset_has_pending = TRUE;
             break;
         }
     }
 end:
-    if (has_pending && reset_has_pending) {
-        SPDLOG_DEBUG("Reset has_pending=false for socket {}", con_addr(this->socket));
-        this->has_pending = FALSE;
+    // release our reference, so the slot buffer could be reused once the decoder is done with it
+    av_packet_unref(active_packet);
+    if (NULL != this->stats) {
+        this->stats->record(PIPELINE_STAGE_DECODE, decode_ns);
+        this->stats->record(PIPELINE_STAGE_FRAME, pipeline_clock_ns() - packet_started_at);
     }
     return result;
 }
 int VideoDecoder::decode() {
+    this->reader = new socket_reader(this->socket, this->buffer_cfg->network_buffer_size_kb * 1024);
     if (this->read_device_info()) {
         SPDLOG_ERROR("Failed to read device info for socket {} ", con_addr(this->socket));
         log_flush();
@@ -531,10 +1308,16 @@ int VideoDecoder::decode() {
     struct VideoHeader header;
     int keep_connection = 1;
     int status = 0;
+    int max_packet_size = this->buffer_cfg->video_packet_buffer_size_kb * 1024;
+    // bytes of config packets kept at the beginning of the slot being written
+    int pending_config = 0;
+    // received packets are decoded in another thread, so converting a frame won't stall the socket
+    packet_ring *ring = new packet_ring(PACKET_RING_DEFAULT_SIZE);
+    std::thread decode_thread(&VideoDecoder::decode_packets, this, ring);
     SPDLOG_DEBUG("Trying to run a loop for receiving video data from {} keep_running = {} keep_connection = {}", 
             con_addr(this->socket), *this->keep_running, keep_connection);
     log_flush();
-    while (*this->keep_running == 1 && keep_connection == 1 && !*disconnect_flag) {
+    while (*this->keep_running == 1 && keep_connection == 1 && !*disconnect_flag && !ring->is_closed()) {
         int header_size = this->read_video_header(&header);
         if (header_size <= 0) {
             keep_connection = 0;
@@ -547,20 +1330,72 @@ int VideoDecoder::decode() {
             SPDLOG_ERROR("Failed to read header info from {}", con_addr(this->socket));
             break;
         }
-        int decode_status = this->decode_frames(header.pts, header.length);
-        if (decode_status == -1) {
-            SPDLOG_ERROR("Bad status for decoding video from {}, will not continue", con_addr(this->socket));
+        if (header.length <= 0 || header.length > max_packet_size) {
+            status = 1;
+            SPDLOG_ERROR("Bad packet length {} from {}, buffer size is {}", header.length, con_addr(this->socket), max_packet_size);
             break;
         }
+        int64_t packet_started_at = pipeline_clock_ns();
+        packet_ring_slot *slot = ring->acquire_write();
+        if (!slot) {
+            // closed by the decoding thread
+            break;
+        }
+        if (ring->reserve(slot, pending_config + header.length, pending_config) != 0) {
+            status = 1;
+            SPDLOG_ERROR("No enough memory for a packet of {} bytes", pending_config + header.length);
+            break;
+        }
+        int64_t stage_started_at = pipeline_clock_ns();
+        SPDLOG_DEBUG("receiving packet pts={} length={} socket={}", header.pts, header.length, con_addr(this->socket));
+        if (this->recv_network_buffer(header.length, slot->data + pending_config) != 0) {
+            SPDLOG_ERROR("Failed to receive packet from {}, will not continue", con_addr(this->socket));
+            break;
+        }
+        this->record_stage(PIPELINE_STAGE_RECV, stage_started_at);
+        this->record_counter(PIPELINE_COUNTER_BYTES_RECEIVED, H264_HEAD_BUFFER_SIZE + header.length);
+        this->record_counter(PIPELINE_COUNTER_PACKETS, 1);
+        if (is_config_packet(&header)) {
+            // keep it in the slot, the next packet is received right after it
+            pending_config += header.length;
+            continue;
+        }
+        slot->pts = header.pts;
+        slot->length = pending_config + header.length;
+        pending_config = 0;
+        slot->received_at = packet_started_at;
+        ring->commit_write();
+        this->record_packet_queue(ring);
     }
-    SPDLOG_DEBUG("Decoder loop was stopped for {} ", con_addr(this->socket));
+    ring->close();
+    decode_thread.join();
+    delete ring;
+    SPDLOG_DEBUG("Decoder loop was stopped for {}, {} socket reads", con_addr(this->socket), this->reader->read_calls());
     log_flush();
-    if (strlen(this->device_id) > 0) {
+    return status;
+}
+int VideoDecoder::start(char *device_info_data) {
+    if (this->setup_device(device_info_data)) {
+        SPDLOG_ERROR("Failed to read device info for socket {} ", con_addr(this->socket));
+        log_flush();
+        return 1;
+    }
+    if (this->init_decoder() != 0) {
+        SPDLOG_ERROR("Failed to init decoder for socket {} ", con_addr(this->socket));
+        log_flush();
+        return 1;
+    }
+    return 0;
+}
+void VideoDecoder::finish() {
+    if (strlen(this->device_id) > 0 && this->callback) {
         SPDLOG_DEBUG("Removing all frame image size callback for device {}", this->device_id);
         log_flush();
         this->callback->remove_frame_img_size_cfg_callback(this->device_id);
+        this->callback->set_frame_ready_callback(this->device_id, NULL);
+        // waits for the snapshots being captured
+        this->callback->set_snapshot_callback(this->device_id, NULL);
     }
-    return status;
 }
 int socket_decode(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, connection_buffer_config* buffer_cfg,
         int *keep_running, int *disconnect_flag) {
@@ -575,11 +1410,216 @@ int socket_decode(boost::shared_ptr<tcp::socket> socket, video_decode_callback *
     int result = decoder->decode();
     SPDLOG_INFO("Video decoder is shutting down");
     log_flush();
-    delete image_buffer;
-    SPDLOG_INFO("Video decoder img_buffer cleared");
-    log_flush();
+    // waits for the ready callback and snapshots using the decoder and its buffer, decode could return before setting them up
+    decoder->finish();
     delete decoder;
     SPDLOG_INFO("Video decoder deleted");
     log_flush();
+    delete image_buffer;
+    SPDLOG_INFO("Video decoder img_buffer cleared");
+    log_flush();
     return result;
 }
+/*
+ * reading video data with async reads, the packets are decoded in order on a strand of the decode pool
+ */
+class AsyncVideoReader : public std::enable_shared_from_this<AsyncVideoReader> {
+    private:
+        boost::shared_ptr<tcp::socket> socket = NULL;
+        std::string address;
+        VideoDecoder *decoder = NULL;
+        std::vector<uchar> *img_buffer = NULL;
+        int *keep_running = NULL;
+        int *disconnect_flag = NULL;
+        boost::asio::strand<boost::asio::thread_pool::executor_type> decode_strand;
+        std::function<void(int)> on_finished;
+        char device_info_data[SCRCPY_DEVICE_INFO_SIZE];
+        char header_buffer[H264_HEAD_BUFFER_SIZE];
+        packet_ring *ring = NULL;
+        int max_packet_size = 0;
+        // bytes of config packets kept at the beginning of the slot being written
+        int pending_config = 0;
+        // the reader stopped after reading a header since the ring is full
+        bool read_paused = false;
+        struct VideoHeader paused_header;
+        int64_t paused_started_at = 0;
+        std::mutex ring_lock;
+        std::atomic<int> status = 0;
+
+        bool is_running();
+        void read_device_info();
+        void read_header();
+        void read_payload(struct VideoHeader header, packet_ring_slot *slot, int64_t packet_started_at);
+        void decode_next();
+
+    public:
+        AsyncVideoReader(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, connection_buffer_config* buffer_cfg,
+                int *keep_running, int *disconnect_flag, boost::asio::thread_pool *decode_pool, std::function<void(int)> on_finished);
+        ~AsyncVideoReader();
+        void start();
+};
+AsyncVideoReader::AsyncVideoReader(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, connection_buffer_config* buffer_cfg,
+        int *keep_running, int *disconnect_flag, boost::asio::thread_pool *decode_pool, std::function<void(int)> on_finished):
+    socket(socket), keep_running(keep_running), disconnect_flag(disconnect_flag), 
+    decode_strand(boost::asio::make_strand(*decode_pool)), on_finished(on_finished) {
+    this->address = con_addr(socket);
+    this->img_buffer = new std::vector<uchar>(buffer_cfg->video_packet_buffer_size_kb * 1024 * 2);
+    this->decoder = new VideoDecoder(socket, callback, buffer_cfg, keep_running, this->img_buffer, disconnect_flag);
+    this->max_packet_size = buffer_cfg->video_packet_buffer_size_kb * 1024;
+    this->ring = new packet_ring(PACKET_RING_DEFAULT_SIZE);
+}
+AsyncVideoReader::~AsyncVideoReader() {
+    SPDLOG_INFO("Async video reader is shutting down for {}", this->address);
+    log_flush();
+    this->decoder->finish();
+    delete this->decoder;
+    this->decoder = NULL;
+    delete this->img_buffer;
+    this->img_buffer = NULL;
+    delete this->ring;
+    this->ring = NULL;
+    if (this->on_finished) {
+        this->on_finished(this->status);
+    }
+}
+bool AsyncVideoReader::is_running() {
+    return *this->keep_running == 1 && !*this->disconnect_flag && this->status == 0;
+}
+void AsyncVideoReader::start() {
+    if (this->status != 0) {
+        return;
+    }
+    this->read_device_info();
+}
+void AsyncVideoReader::read_device_info() {
+    auto self = shared_from_this();
+    boost::asio::async_read(*this->socket, boost::asio::buffer(this->device_info_data, SCRCPY_DEVICE_INFO_SIZE),
+            [self](const boost::system::error_code &ec, std::size_t bytes_read) {
+        if (ec) {
+            SPDLOG_ERROR("Failed to read device info from {}: {}", self->address, ec.message());
+            self->status = 1;
+            return;
+        }
+        if (self->decoder->start(self->device_info_data) != 0) {
+            self->status = 1;
+            return;
+        }
+        self->read_header();
+    });
+}
+void AsyncVideoReader::read_header() {
+    if (!this->is_running()) {
+        SPDLOG_DEBUG("Async video reader was stopped for {}", this->address);
+        return;
+    }
+    auto self = shared_from_this();
+    boost::asio::async_read(*this->socket, boost::asio::buffer(this->header_buffer, H264_HEAD_BUFFER_SIZE),
+            [self](const boost::system::error_code &ec, std::size_t bytes_read) {
+        if (ec) {
+            SPDLOG_ERROR("Failed to read header info from {}: {}", self->address, ec.message());
+            self->status = 1;
+            return;
+        }
+        struct VideoHeader header;
+        header.pts = to_long(self->header_buffer, H264_HEAD_BUFFER_SIZE, 0, 8);
+        header.length = to_int(self->header_buffer, H264_HEAD_BUFFER_SIZE, 8, 4);
+        SPDLOG_DEBUG("header.length={} header.pts={}", header.length, header.pts);
+        if (header.length <= 0 || header.length > self->max_packet_size) {
+            SPDLOG_ERROR("Bad packet length {} from {}, buffer size is {}", header.length, self->address, self->max_packet_size);
+            self->status = 1;
+            return;
+        }
+        int64_t packet_started_at = pipeline_clock_ns();
+        packet_ring_slot *slot = NULL;
+        {
+            std::lock_guard<std::mutex> lock(self->ring_lock);
+            slot = self->ring->try_acquire_write();
+            if (!slot) {
+                // continue after a packet is decoded
+                self->paused_header = header;
+                self->paused_started_at = packet_started_at;
+                self->read_paused = true;
+                return;
+            }
+        }
+        self->read_payload(header, slot, packet_started_at);
+    });
+}
+void AsyncVideoReader::read_payload(struct VideoHeader header, packet_ring_slot *slot, int64_t packet_started_at) {
+    if (this->ring->reserve(slot, this->pending_config + header.length, this->pending_config) != 0) {
+        SPDLOG_ERROR("No enough memory for a packet of {} bytes from {}", this->pending_config + header.length, this->address);
+        this->status = 1;
+        return;
+    }
+    auto self = shared_from_this();
+    int64_t started_at = pipeline_clock_ns();
+    boost::asio::async_read(*this->socket, boost::asio::buffer(slot->data + this->pending_config, header.length),
+            [self, header, slot, packet_started_at, started_at](const boost::system::error_code &ec, std::size_t bytes_read) {
+        if (ec) {
+            SPDLOG_ERROR("Failed to read {} bytes video data from {}: {}", header.length, self->address, ec.message());
+            self->status = 1;
+            return;
+        }
+        self->decoder->record_stage(PIPELINE_STAGE_RECV, started_at);
+        self->decoder->record_counter(PIPELINE_COUNTER_BYTES_RECEIVED, H264_HEAD_BUFFER_SIZE + header.length);
+        self->decoder->record_counter(PIPELINE_COUNTER_PACKETS, 1);
+        if (is_config_packet(&header)) {
+            // the slot is not committed, the next packet goes right after the config
+            self->pending_config += header.length;
+            self->read_header();
+            return;
+        }
+        slot->pts = header.pts;
+        slot->length = self->pending_config + header.length;
+        slot->received_at = packet_started_at;
+        self->pending_config = 0;
+        self->ring->commit_write();
+        self->decoder->record_packet_queue(self->ring);
+        boost::asio::post(self->decode_strand, [self]() {
+            self->decode_next();
+        });
+        self->read_header();
+    });
+}
+void AsyncVideoReader::decode_next() {
+    // every committed packet posts one decode_next, and the strand runs them in order
+    packet_ring_slot *slot = this->ring->try_acquire_read();
+    if (!slot) {
+        return;
+    }
+    if (this->status == 0) {
+        int decode_status = this->decoder->decode_packet(slot->pts, slot->length, slot->buffer, slot->received_at);
+        if (decode_status == -1) {
+            SPDLOG_ERROR("Bad status for decoding video from {}, will not continue", this->address);
+            this->status = 1;
+        }
+    }
+    struct VideoHeader header;
+    int64_t packet_started_at = 0;
+    {
+        std::lock_guard<std::mutex> lock(this->ring_lock);
+        this->ring->commit_read();
+        this->decoder->record_packet_queue(this->ring);
+        if (!this->read_paused) {
+            return;
+        }
+        this->read_paused = false;
+        header = this->paused_header;
+        packet_started_at = this->paused_started_at;
+        slot = this->ring->try_acquire_write();
+    }
+    if (!this->is_running() || !slot) {
+        return;
+    }
+    auto self = shared_from_this();
+    boost::asio::post(this->socket->get_executor(), [self, header, slot, packet_started_at]() {
+        self->read_payload(header, slot, packet_started_at);
+    });
+}
+void socket_decode_async(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, connection_buffer_config* buffer_cfg,
+        int *keep_running, int *disconnect_flag, boost::asio::thread_pool *decode_pool, std::function<void(int)> on_finished) {
+    SPDLOG_INFO("socket_decode_async {}", con_addr(socket));
+    log_flush();
+    auto reader = std::make_shared<AsyncVideoReader>(socket, callback, buffer_cfg, keep_running, disconnect_flag, decode_pool, on_finished);
+    reader->start();
+}
@@ -1,5 +1,7 @@
 #include "model.h"
+#include <functional>
 #include "boost/asio/ip/tcp.hpp"
+#include "boost/asio/thread_pool.hpp"
 
 using boost::asio::ip::tcp;
 /*
@@ -13,3 +15,17 @@ using boost::asio::ip::tcp;
  */
 int socket_decode(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, 
         connection_buffer_config *buffer_cfg, int *keep_running, int *disconnect_flag);
+/*
+ * decoding data from the socket with async reads, it returns immediately
+ * the socket is read by the threads running its io_context, and the packets are decoded in order within @decode_pool
+ * @param			socket				socket connection for video data
+ * @param			callback			callback instance for video	frame and meta data
+ * @param			buffer_cfg			socket/decoder buffer config
+ * @param			keep_running		a pointer of keep running flag. The decoder will stop receiving data if the flag become 0
+ * @param			disconnect_flag     a pointer of disconnect flag. The decoder will stop receiving data if the flag become 1
+ * @param			decode_pool         thread pool for decoding
+ * @param			on_finished         invoked with the decoder status after the decoder is released
+ */
+void socket_decode_async(boost::shared_ptr<tcp::socket> socket, video_decode_callback *callback, 
+        connection_buffer_config *buffer_cfg, int *keep_running, int *disconnect_flag, 
+        boost::asio::thread_pool *decode_pool, std::function<void(int)> on_finished);
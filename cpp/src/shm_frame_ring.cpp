@@ -0,0 +1,134 @@
+#include "shm_frame_ring.h"
+#include <string.h>
+#include <atomic>
+#include "utils.h"
+#include "logging.h"
+
+// slots start at a cache line, so the lock of a slot doesn't share it with the data of the previous one
+#define SHM_SLOT_ALIGNMENT 64
+
+static_assert(sizeof(scrcpy_shm_ring_header) <= SCRCPY_SHM_RING_HEADER_SIZE, "ring header does not fit");
+static_assert(sizeof(scrcpy_shm_slot_header) <= SCRCPY_SHM_SLOT_HEADER_SIZE, "slot header does not fit");
+
+shm_frame_ring::shm_frame_ring() {}
+shm_frame_ring::~shm_frame_ring() {
+    this->close();
+}
+void shm_frame_ring::close() {
+    if (this->base) {
+        UnmapViewOfFile(this->base);
+        this->base = NULL;
+        this->header = NULL;
+    }
+    if (this->mapping) {
+        CloseHandle(this->mapping);
+        this->mapping = NULL;
+    }
+}
+int shm_frame_ring::open(const char *name, int slot_count, uint32_t slot_size) {
+    if (!name || slot_count <= 0 || slot_size == 0) {
+        SPDLOG_ERROR("Invalid arguments for a shared memory ring");
+        return 1;
+    }
+    uint64_t slot_stride = (uint64_t)SCRCPY_SHM_SLOT_HEADER_SIZE + slot_size;
+    slot_stride = (slot_stride + SHM_SLOT_ALIGNMENT - 1) / SHM_SLOT_ALIGNMENT * SHM_SLOT_ALIGNMENT;
+    if (slot_stride > UINT32_MAX) {
+        SPDLOG_ERROR("Slot size {} of shared memory ring {} is too big", slot_size, name);
+        return 1;
+    }
+    uint64_t total_size = SCRCPY_SHM_RING_HEADER_SIZE + slot_stride * slot_count;
+    this->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(total_size >> 32),
+            (DWORD)(total_size & 0xFFFFFFFF), name);
+    if (NULL == this->mapping) {
+        SPDLOG_ERROR("Could not create file mapping {} of {} bytes: {}", name, total_size, GetLastError());
+        return 1;
+    }
+    this->base = (uint8_t*)MapViewOfFile(this->mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)total_size);
+    if (NULL == this->base) {
+        SPDLOG_ERROR("Could not map file mapping {}: {}", name, GetLastError());
+        this->close();
+        return 1;
+    }
+    // an existing mapping of the same name is reinitialized, readers of it see the seq start over
+    memset(this->base, 0, SCRCPY_SHM_RING_HEADER_SIZE + SCRCPY_SHM_SLOT_HEADER_SIZE);
+    for (int i = 1; i < slot_count; i++) {
+        memset(this->base + SCRCPY_SHM_RING_HEADER_SIZE + slot_stride * i, 0, SCRCPY_SHM_SLOT_HEADER_SIZE);
+    }
+    this->header = (scrcpy_shm_ring_header*)this->base;
+    this->header->version = SCRCPY_SHM_RING_VERSION;
+    this->header->slot_count = (uint32_t)slot_count;
+    this->header->slot_stride = (uint32_t)slot_stride;
+    this->header->slot_size = slot_size;
+    // readers check the magic first
+    std::atomic_ref<uint32_t>(this->header->magic).store(SCRCPY_SHM_RING_MAGIC, std::memory_order_release);
+    SPDLOG_INFO("Created shared memory ring {} with {} slots of {} bytes", name, slot_count, slot_size);
+    return 0;
+}
+scrcpy_shm_slot_header* shm_frame_ring::begin_write() {
+    uint64_t next_seq = this->seq + 1;
+    uint8_t *slot_base = this->base + SCRCPY_SHM_RING_HEADER_SIZE +
+        (uint64_t)this->header->slot_stride * ((next_seq - 1) % this->header->slot_count);
+    scrcpy_shm_slot_header *slot = (scrcpy_shm_slot_header*)slot_base;
+    // odd while writing, readers of the previous frame in it see the lock changed
+    std::atomic_ref<uint64_t>(slot->lock).store(next_seq * 2 - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return slot;
+}
+void shm_frame_ring::end_write(scrcpy_shm_slot_header *slot) {
+    this->seq++;
+    std::atomic_ref<uint64_t>(slot->lock).store(this->seq * 2, std::memory_order_release);
+    std::atomic_ref<uint64_t>(this->header->last_seq).store(this->seq, std::memory_order_release);
+}
+int shm_frame_ring::publish_image(int format, uint8_t *data, uint32_t size, int w, int h, int raw_w, int raw_h) {
+    std::lock_guard<std::mutex> guard{ this->write_lock };
+    if (!this->header || size > this->header->slot_size) {
+        return 1;
+    }
+    scrcpy_shm_slot_header *slot = this->begin_write();
+    slot->kind = SCRCPY_SHM_FRAME_IMAGE;
+    slot->format = format;
+    slot->size = size;
+    slot->width = w;
+    slot->height = h;
+    slot->screen_width = raw_w;
+    slot->screen_height = raw_h;
+    slot->planes = 0;
+    memcpy((uint8_t*)slot + SCRCPY_SHM_SLOT_HEADER_SIZE, data, size);
+    this->end_write(slot);
+    return 0;
+}
+int shm_frame_ring::publish_raw(scrcpy_frame *frame, int raw_w, int raw_h) {
+    std::lock_guard<std::mutex> guard{ this->write_lock };
+    uint64_t size = 0;
+    int plane_size[SCRCPY_MAX_FRAME_PLANES] = {0};
+    for (int i = 0; i < frame->planes; i++) {
+        plane_size[i] = frame->linesize[i] * frame_plane_height(frame->format, i, frame->height);
+        size += plane_size[i];
+    }
+    if (!this->header || size > this->header->slot_size) {
+        return 1;
+    }
+    scrcpy_shm_slot_header *slot = this->begin_write();
+    uint8_t *slot_data = (uint8_t*)slot + SCRCPY_SHM_SLOT_HEADER_SIZE;
+    slot->kind = SCRCPY_SHM_FRAME_RAW;
+    slot->format = frame->format;
+    slot->size = (uint32_t)size;
+    slot->width = frame->width;
+    slot->height = frame->height;
+    slot->screen_width = raw_w;
+    slot->screen_height = raw_h;
+    slot->planes = frame->planes;
+    int offset = 0;
+    for (int i = 0; i < frame->planes; i++) {
+        memcpy(slot_data + offset, frame->data[i], plane_size[i]);
+        slot->plane_offset[i] = offset;
+        slot->linesize[i] = frame->linesize[i];
+        offset += plane_size[i];
+    }
+    this->end_write(slot);
+    return 0;
+}
+uint64_t shm_frame_ring::last_seq() {
+    std::lock_guard<std::mutex> guard{ this->write_lock };
+    return this->seq;
+}
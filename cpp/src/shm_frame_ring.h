@@ -0,0 +1,66 @@
+#ifndef SCRCPY_SHM_FRAME_RING
+#define SCRCPY_SHM_FRAME_RING
+#include <stdint.h>
+#include <mutex>
+#include "Windows.h"
+#include "scrcpy_recv/scrcpy_recv.h"
+
+/*
+ * frames of a device published into a named file mapping for other local processes, @see scrcpy_shm_ring_header
+ * slots are reused round robin, readers detect a slot being rewritten under them with the seqlock of the slot
+ */
+class shm_frame_ring {
+    public:
+        shm_frame_ring();
+        ~shm_frame_ring();
+        /*
+         * create the file mapping and initialize the ring header
+         * @param       name                name of the file mapping
+         * @param       slot_count          frames kept in the ring
+         * @param       slot_size           max bytes of a frame
+         * @return      0 if ok
+         */
+        int open(const char *name, int slot_count, uint32_t slot_size);
+        /*
+         * copy an encoded frame image into the next slot
+         * @param       format              @see SCRCPY_OUTPUT_FORMAT_PNG
+         * @param       data                the image data
+         * @param       size                image data length
+         * @param       w                   image width
+         * @param       h                   image height
+         * @param       raw_w               original screen width
+         * @param       raw_h               original screen height
+         * @return      0 if ok, 1 if the frame is bigger than a slot
+         */
+        int publish_image(int format, uint8_t *data, uint32_t size, int w, int h, int raw_w, int raw_h);
+        /*
+         * copy the planes of a raw frame one after another into the next slot
+         * @param       frame               the scaled frame
+         * @param       raw_w               original screen width
+         * @param       raw_h               original screen height
+         * @return      0 if ok, 1 if the frame is bigger than a slot
+         */
+        int publish_raw(scrcpy_frame *frame, int raw_w, int raw_h);
+        /*
+         * seq of the newest frame published, 0 for none
+         */
+        uint64_t last_seq();
+    private:
+        /*
+         * mark the next slot as being written, the write_lock must be held
+         * @return      the slot
+         */
+        scrcpy_shm_slot_header* begin_write();
+        /*
+         * mark the slot as written and publish its seq, the write_lock must be held
+         */
+        void end_write(scrcpy_shm_slot_header *slot);
+        void close();
+        HANDLE mapping = NULL;
+        uint8_t *base = NULL;
+        scrcpy_shm_ring_header *header = NULL;
+        // frames could be published by the decoding and the callback threads
+        std::mutex write_lock;
+        uint64_t seq = 0;
+};
+#endif //!SCRCPY_SHM_FRAME_RING
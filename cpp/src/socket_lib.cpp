@@ -5,6 +5,7 @@
 #include <thread>
 #include <mutex>
 #include <map>
+#include <algorithm>
 #include "model.h"
 #include "utils.h"
 #include "frame_img_callback.h"
@@ -18,15 +19,24 @@ using boost::asio::ip::tcp;
 socket_lib::socket_lib(std::string token) : 
     image_size_dict(new std::map<std::string, image_size*>()), 
     original_image_size_dict(new std::map<std::string, image_size*>()),
+    output_format_dict(new std::map<std::string, image_output_format>()),
+    delivery_cfg_dict(new std::map<std::string, device_delivery_cfg>()),
+    decoder_profile_dict(new std::map<std::string, int>()),
+    frame_slot_map(new std::map<std::string, std::shared_ptr<frame_slot>>()),
+    frame_slot_seq_map(new std::map<std::string, uint64_t>()),
+    shm_ring_map(new std::map<std::string, std::shared_ptr<shm_frame_ring>>()),
     device_info_callback_dict(new std::map<std::string, std::vector<scrcpy_device_info_callback>*>()),
     m_token(token), 
     ctrl_socket_handler_map(new std::map<std::string, scrcpy_ctrl_socket_handler*>()),
     ctrl_sending_callback_map(new std::map<std::string, scrcpy_device_ctrl_msg_send_callback>()),
     video_socket_disconnect_flag_map(new std::map<std::string, int*>()),
-    frame_img_size_cfg_callback_map(new std::map<std::string, std::vector<scrcpy_frame_img_size_cfg_callback>*>()){}
+    frame_img_size_cfg_callback_map(new std::map<std::string, std::vector<scrcpy_frame_img_size_cfg_callback>*>()),
+    pipeline_stats_map(new std::map<std::string, pipeline_stats*>()),
+    snapshot_callback_map(new std::map<std::string, std::shared_ptr<snapshot_source>>()),
+    async_socket_list(new std::vector<boost::weak_ptr<tcp::socket>>()){}
 
-    void socket_lib::on_video_callback(char* device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h) {
-        this->internal_video_frame_callback(device_id, frame_data, frame_data_size, w, h, raw_w, raw_h);
+    void socket_lib::on_video_callback(char* device_id, std::vector<uint8_t>* frame_data, int w, int h, int raw_w, int raw_h) {
+        this->internal_video_frame_callback(device_id, frame_data, w, h, raw_w, raw_h);
     }
 
 image_size* socket_lib::get_configured_img_size(char* device_id) {
@@ -54,6 +64,34 @@ void socket_lib::unregister_callback(char* device_id, frame_callback_handler cal
     callback_handler->del(device_id, callback);
 }
 
+void socket_lib::register_raw_callback(char* device_id, int pixel_format, frame_raw_callback_handler callback) {
+    SPDLOG_INFO("Trying to register raw frame callback for device {} with pixel format {}", device_id, pixel_format);
+    this->callback_handler->add_raw(device_id, pixel_format, callback, (char *)this->m_token.c_str());
+}
+
+void socket_lib::remove_all_raw_callbacks(char* device_id) {
+    SPDLOG_INFO("remove_all_raw_callbacks for {}", device_id);
+    callback_handler->del_all_raw(device_id);
+}
+
+void socket_lib::on_raw_frame_callback(char *device_id, scrcpy_frame *frame, int raw_w, int raw_h) {
+    SPDLOG_TRACE("Got raw frame for device = {} size = {}x{}", device_id, frame->width, frame->height);
+    auto ring = this->get_shm_ring(device_id);
+    if (ring && ring->publish_raw(frame, raw_w, raw_h) != 0) {
+        SPDLOG_DEBUG("Raw frame of device {} does not fit into a slot of its shared memory ring", device_id);
+    }
+    callback_handler->invoke_raw((char *)this->m_token.c_str(), device_id, frame, raw_w, raw_h, this->get_pipeline_stats(device_id));
+}
+
+int socket_lib::get_raw_frame_format(char *device_id) {
+    return callback_handler->get_raw_format(device_id);
+}
+
+bool socket_lib::has_frame_img_callback(char *device_id) {
+    return callback_handler->has_handlers(device_id) || this->get_frame_slot(device_id, false) != NULL ||
+        this->get_shm_ring(device_id) != NULL;
+}
+
 void socket_lib::config_image_size(char* device_id, int width, int height) {
     {
         std::lock_guard<std::mutex> guard{ image_size_lock };
@@ -89,11 +127,157 @@ void socket_lib::config_image_size(char* device_id, int width, int height) {
     }
 }
 
+int socket_lib::config_output_format(char* device_id, int format, int quality) {
+    if (format != SCRCPY_OUTPUT_FORMAT_PNG && format != SCRCPY_OUTPUT_FORMAT_JPEG && format != SCRCPY_OUTPUT_FORMAT_WEBP) {
+        SPDLOG_ERROR("Unknown output format {} for device {}", format, device_id);
+        return 1;
+    }
+    SPDLOG_INFO("Trying to set output format={} quality={} for device {}", format, quality, device_id);
+    std::lock_guard<std::mutex> guard{ output_format_lock };
+    (*this->output_format_dict)[std::string(device_id)] = image_output_format{ format, quality };
+    return 0;
+}
+
+image_output_format socket_lib::get_output_format(char *device_id) {
+    std::lock_guard<std::mutex> guard{ output_format_lock };
+    auto item = this->output_format_dict->find(std::string(device_id));
+    if (item == this->output_format_dict->end()) {
+        return image_output_format{ SCRCPY_OUTPUT_FORMAT_PNG, SCRCPY_OUTPUT_QUALITY_DEFAULT };
+    }
+    return item->second;
+}
+
+static bool is_decoder_profile(int profile) {
+    return profile >= SCRCPY_DECODER_PROFILE_DEFAULT && profile <= SCRCPY_DECODER_PROFILE_REDUCED_COST;
+}
+
+int socket_lib::config_decoder_profile(char* device_id, int profile) {
+    SPDLOG_INFO("Trying to set decoder profile={} for device {}", profile, device_id);
+    if (!is_decoder_profile(profile)) {
+        SPDLOG_ERROR("Unknown decoder profile {} for device {}", profile, device_id);
+        return 1;
+    }
+    std::lock_guard<std::mutex> guard{ decoder_profile_lock };
+    (*this->decoder_profile_dict)[std::string(device_id)] = profile;
+    return 0;
+}
+
+int socket_lib::config_default_decoder_profile(int profile) {
+    SPDLOG_INFO("Trying to set default decoder profile={}", profile);
+    if (!is_decoder_profile(profile)) {
+        SPDLOG_ERROR("Unknown decoder profile {}", profile);
+        return 1;
+    }
+    this->default_decoder_profile = profile;
+    return 0;
+}
+
+int socket_lib::get_decoder_profile(char *device_id) {
+    std::lock_guard<std::mutex> guard{ decoder_profile_lock };
+    auto item = this->decoder_profile_dict->find(std::string(device_id));
+    if (item == this->decoder_profile_dict->end()) {
+        return -1;
+    }
+    return item->second;
+}
+
+int socket_lib::config_delivery_policy(char* device_id, int depth, int policy) {
+    SPDLOG_INFO("Trying to set delivery depth={} policy={} for device {}", depth, policy, device_id);
+    return this->callback_handler->set_delivery_policy(device_id, depth, policy);
+}
+
+void socket_lib::config_latest_frame_only(char* device_id, bool enabled) {
+    SPDLOG_INFO("Trying to set latest_frame_only={} for device {}", enabled, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    (*this->delivery_cfg_dict)[std::string(device_id)].latest_frame_only = enabled;
+}
+
+void socket_lib::config_max_fps(char* device_id, int fps) {
+    SPDLOG_INFO("Trying to set max_fps={} for device {}", fps, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    (*this->delivery_cfg_dict)[std::string(device_id)].max_fps = fps > 0 ? fps : 0;
+}
+
+void socket_lib::config_drain_when_idle(char* device_id, bool enabled) {
+    SPDLOG_INFO("Trying to set drain_when_idle={} for device {}", enabled, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    (*this->delivery_cfg_dict)[std::string(device_id)].drain_when_idle = enabled;
+}
+
+void socket_lib::config_keyframe_only(char* device_id, bool enabled) {
+    SPDLOG_INFO("Trying to set keyframe_only={} for device {}", enabled, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    (*this->delivery_cfg_dict)[std::string(device_id)].keyframe_only = enabled;
+}
+
+void socket_lib::config_full_res_decoding(char* device_id, bool enabled) {
+    SPDLOG_INFO("Trying to set full_res_decoding={} for device {}", enabled, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    (*this->delivery_cfg_dict)[std::string(device_id)].full_res_decoding = enabled;
+}
+
+void socket_lib::config_skip_identical_frames(char* device_id, bool enabled, int heartbeat_ms) {
+    SPDLOG_INFO("Trying to set skip_identical_frames={} heartbeat_ms={} for device {}", enabled, heartbeat_ms, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    device_delivery_cfg &cfg = (*this->delivery_cfg_dict)[std::string(device_id)];
+    cfg.skip_identical_frames = enabled;
+    cfg.heartbeat_ms = heartbeat_ms > 0 ? heartbeat_ms : 0;
+}
+
+void socket_lib::config_dirty_rects(char* device_id, bool enabled) {
+    SPDLOG_INFO("Trying to set dirty_rects={} for device {}", enabled, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    (*this->delivery_cfg_dict)[std::string(device_id)].dirty_rects = enabled;
+}
+
+void socket_lib::config_snapshot_mode(char* device_id, bool enabled) {
+    SPDLOG_INFO("Trying to set snapshot_mode={} for device {}", enabled, device_id);
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    (*this->delivery_cfg_dict)[std::string(device_id)].snapshot_mode = enabled;
+}
+
+device_delivery_cfg socket_lib::get_delivery_cfg(char *device_id) {
+    std::lock_guard<std::mutex> guard{ delivery_cfg_lock };
+    auto item = this->delivery_cfg_dict->find(std::string(device_id));
+    if (item == this->delivery_cfg_dict->end()) {
+        return device_delivery_cfg{};
+    }
+    return item->second;
+}
+
+void socket_lib::set_frame_ready_callback(char *device_id, scrcpy_frame_ready_callback callback) {
+    this->callback_handler->set_ready_callback(device_id, callback);
+}
+
+void socket_lib::request_frame_ready(char *device_id) {
+    this->callback_handler->request_ready(device_id);
+}
+
+bool socket_lib::wait_for_frame_slot(char *device_id, int timeout_ms) {
+    return this->callback_handler->wait_for_slot(device_id, timeout_ms, this->get_pipeline_stats(device_id));
+}
+
+void socket_lib::set_snapshot_callback(char *device_id, scrcpy_snapshot_callback callback) {
+    std::shared_ptr<snapshot_source> source;
+    {
+        std::unique_lock lock(this->snapshot_callback_map_lock);
+        if (!this->snapshot_callback_map) {
+            return;
+        }
+        auto &entry = (*this->snapshot_callback_map)[std::string(device_id)];
+        if (!entry) {
+            entry = std::make_shared<snapshot_source>();
+        }
+        source = entry;
+    }
+    // only waits for the captures of the device
+    std::unique_lock source_lock(source->lock);
+    source->capture = callback;
+}
+
 std::string* socket_lib::read_socket_type(ClientConnection* connection) {
     int buf_size = SCRCPY_SOCKET_HEADER_SIZE;
     char data[SCRCPY_SOCKET_HEADER_SIZE];
-    char *device_id = (char*) malloc(SCRCPY_HEADER_DEVICE_ID_LEN * sizeof(char));
-    char *socket_type = (char*) malloc(SCRCPY_HEADER_TYPE_LEN * sizeof(char));
     try {
         int received = (int)connection->client_socket->receive(boost::asio::buffer(data, buf_size));
         SPDLOG_DEBUG("received {}/{} bytes header", received, SCRCPY_SOCKET_HEADER_SIZE);
@@ -104,7 +288,12 @@ std::string* socket_lib::read_socket_type(ClientConnection* connection) {
         SPDLOG_ERROR("Could not recev data from client: {}", e.what());
         return NULL;
     }
+    return this->parse_socket_type(connection, data);
+}
 
+std::string* socket_lib::parse_socket_type(ClientConnection* connection, char *data) {
+    char *device_id = (char*) malloc(SCRCPY_HEADER_DEVICE_ID_LEN * sizeof(char));
+    char *socket_type = (char*) malloc(SCRCPY_HEADER_TYPE_LEN * sizeof(char));
     array_copy_to2(data, device_id, 0, 0, SCRCPY_HEADER_DEVICE_ID_LEN);
     array_copy_to2(data, socket_type, SCRCPY_HEADER_DEVICE_ID_LEN, 0, SCRCPY_HEADER_TYPE_LEN);
 
@@ -131,14 +320,7 @@ int socket_lib::handle_connetion(ClientConnection* connection) {
     if (!is_ctrl_socket) {
         SPDLOG_INFO("{} is a video socket for device {} ", con_addr(connection->client_socket), connection->device_id->c_str());
         log_flush();
-        int *disconnect_flag = new int(0);
-        {
-            std::lock_guard<std::mutex> lock(this->video_socket_disconnect_flag_map_lock);
-            auto flag_add_result = this->video_socket_disconnect_flag_map->emplace(std::string(connection->device_id->c_str()), disconnect_flag);
-            if(!flag_add_result.second) {
-                SPDLOG_ERROR("Failed to add disconnect flag for device {}'s video socket", connection->device_id->c_str());
-            }
-        }
+        int *disconnect_flag = this->add_video_disconnect_flag(connection);
         result = socket_decode(client_socket, this, connection->buffer_cfg, &(this->keep_accept_connection), disconnect_flag);
         SPDLOG_INFO("Decoder just ended for device {}", connection->device_id->c_str());
         log_flush();
@@ -146,21 +328,40 @@ int socket_lib::handle_connetion(ClientConnection* connection) {
         SPDLOG_INFO("{} is a ctrl socket for device {} ", con_addr(connection->client_socket), connection->device_id->c_str());
         log_flush();
         auto handler = new scrcpy_ctrl_socket_handler(connection->device_id, connection->client_socket);
-        {
-            std::unique_lock lock(this->ctrl_socket_handler_map_lock);
-            auto result = this->ctrl_socket_handler_map->emplace(std::string(*connection->device_id), handler);
-            SPDLOG_DEBUG("Adding {} to ctrl_socket_handler_map({}), succeed? {} ctrl channel count {}", connection->device_id->c_str(), 
-                    (uintptr_t)this->ctrl_socket_handler_map, result.second ? "YES":"NO", ctrl_socket_handler_map->size());
-        }
-        std::function<void(std::string, std::string, int, int)> callback = [this](std::string device_id, std::string msg_id, int status, int data_len) {
-            this->internal_on_ctrl_msg_sent_callback(device_id, msg_id, status, data_len);
-        };
-        result = handler->run(callback);
+        this->add_ctrl_socket_handler(connection, handler);
+        result = handler->run(this->ctrl_msg_sent_callback());
         SPDLOG_INFO("Deleting handler  of device {}'s ctrl socket", connection->device_id->c_str());
         log_flush();
     }
-    goto end;
-end:
+    this->cleanup_connection(connection, is_ctrl_socket);
+    return result;
+}
+
+int* socket_lib::add_video_disconnect_flag(ClientConnection* connection) {
+    int *disconnect_flag = new int(0);
+    std::lock_guard<std::mutex> lock(this->video_socket_disconnect_flag_map_lock);
+    auto flag_add_result = this->video_socket_disconnect_flag_map->emplace(std::string(connection->device_id->c_str()), disconnect_flag);
+    if(!flag_add_result.second) {
+        SPDLOG_ERROR("Failed to add disconnect flag for device {}'s video socket", connection->device_id->c_str());
+    }
+    return disconnect_flag;
+}
+
+void socket_lib::add_ctrl_socket_handler(ClientConnection* connection, scrcpy_ctrl_socket_handler* handler) {
+    std::unique_lock lock(this->ctrl_socket_handler_map_lock);
+    auto result = this->ctrl_socket_handler_map->emplace(std::string(*connection->device_id), handler);
+    SPDLOG_DEBUG("Adding {} to ctrl_socket_handler_map({}), succeed? {} ctrl channel count {}", connection->device_id->c_str(), 
+            (uintptr_t)this->ctrl_socket_handler_map, result.second ? "YES":"NO", ctrl_socket_handler_map->size());
+}
+
+std::function<void(std::string, std::string, int, int)> socket_lib::ctrl_msg_sent_callback() {
+    return [this](std::string device_id, std::string msg_id, int status, int data_len) {
+        this->internal_on_ctrl_msg_sent_callback(device_id, msg_id, status, data_len);
+    };
+}
+
+void socket_lib::cleanup_connection(ClientConnection* connection, bool is_ctrl_socket) {
+    auto client_socket = connection->client_socket;
     auto connection_type = is_ctrl_socket ? "ctrl" : "video";
     SPDLOG_INFO("Doing connection cleanup for device {} connection type {}", connection->device_id->c_str(), connection_type);
     try {
@@ -224,7 +425,6 @@ end:
     delete connection;
     SPDLOG_DEBUG("Connection removed");
     log_flush();
-    return result;
 }
 
 int socket_lib::accept_new_connection(connection_buffer_config* cfg) {
@@ -262,16 +462,22 @@ int socket_lib::startup(char* address, int network_buffer_size_kb, int video_pac
     int port_no = std::atoi(address);
     struct connection_buffer_config cfg = connection_buffer_config{
         network_buffer_size_kb,
-            video_packet_buffer_size_kb
+            video_packet_buffer_size_kb,
+            this->default_decoder_profile
     };
     boost::shared_ptr<tcp::acceptor> acceptor_ptr = NULL;
     try {
         this->io_context = boost::shared_ptr<boost::asio::io_context>(new boost::asio::io_context());
         this->listen_socket = boost::shared_ptr<tcp::acceptor>(new tcp::acceptor(*io_context, tcp::endpoint(tcp::v4(), port_no)));
 
-        std::thread server_thread(&socket_lib::accept_new_connection, this, &cfg);
-        SPDLOG_INFO("Started new thread accepting new connection for listener at port {}", port_no);
-        server_thread.join();
+        if (this->async_io) {
+            SPDLOG_INFO("Accepting new connection with async io for listener at port {}", port_no);
+            this->run_async_io(&cfg);
+        } else {
+            std::thread server_thread(&socket_lib::accept_new_connection, this, &cfg);
+            SPDLOG_INFO("Started new thread accepting new connection for listener at port {}", port_no);
+            server_thread.join();
+        }
         {
             std::lock_guard<std::mutex> lock(this->keep_accept_connection_lock);
             this->shutting_down = true;
@@ -303,10 +509,143 @@ void socket_lib::shutdown_svr() {
     if (keep_accept_connection == 0) {
         return;
     }
-    if(this->listen_socket) {
+    // cleared first, so no accept is started again after the acceptor is cancelled
+    keep_accept_connection = 0;
+    // the acceptor is used by the io threads in async io mode, run_async_io closes it after they stopped
+    if(this->listen_socket && !this->async_io) {
         this->listen_socket->cancel();
     }
-    keep_accept_connection = 0;
+    {
+        // wake up the threads waiting for frames
+        std::lock_guard<std::mutex> lock(this->frame_slot_map_lock);
+        for (auto &entry : *this->frame_slot_map) {
+            entry.second->close();
+        }
+    }
+    if (this->async_io && this->io_context) {
+        // connections are closed by run_async_io after the io threads stopped
+        this->io_context->stop();
+    }
+}
+
+void socket_lib::enable_async_io(int io_threads) {
+    std::lock_guard<std::mutex> guard{ keep_accept_connection_lock };
+    this->async_io = true;
+    this->async_io_threads = io_threads > 0 ? io_threads : (int)std::thread::hardware_concurrency();
+    if (this->async_io_threads <= 0) {
+        this->async_io_threads = 1;
+    }
+    SPDLOG_INFO("Async io enabled with {} io thread(s)", this->async_io_threads);
+}
+
+int socket_lib::run_async_io(connection_buffer_config* cfg) {
+    int decode_threads = (int)std::thread::hardware_concurrency();
+    this->decode_pool = new boost::asio::thread_pool(decode_threads > 0 ? decode_threads : 1);
+    this->async_accept_connection(cfg);
+    std::vector<std::thread> io_threads;
+    for (int i = 0; i < this->async_io_threads; i++) {
+        io_threads.emplace_back([this]() {
+            this->io_context->run();
+        });
+    }
+    for (auto &t : io_threads) {
+        t.join();
+    }
+    SPDLOG_INFO("Async io threads stopped, closing connections");
+    log_flush();
+    // nothing is running the io_context now, so the sockets could be closed here
+    {
+        // aborts the pending accept, otherwise the last run below never returns
+        boost::system::error_code ec;
+        this->listen_socket->close(ec);
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->async_socket_list_lock);
+        for (auto &item : *this->async_socket_list) {
+            auto socket = item.lock();
+            if (socket && socket->is_open()) {
+                boost::system::error_code ec;
+                socket->close(ec);
+            }
+        }
+        this->async_socket_list->clear();
+    }
+    {
+        std::shared_lock lock(this->ctrl_socket_handler_map_lock);
+        for (auto &item : *this->ctrl_socket_handler_map) {
+            item.second->stop();
+        }
+    }
+    this->decode_pool->join();
+    // let the aborted handlers run so every connection is cleaned up
+    this->io_context->restart();
+    this->io_context->run();
+    delete this->decode_pool;
+    this->decode_pool = NULL;
+    return 0;
+}
+
+void socket_lib::async_accept_connection(connection_buffer_config* cfg) {
+    auto client_socket = boost::shared_ptr<tcp::socket>(new tcp::socket(*this->io_context));
+    this->listen_socket->async_accept(*client_socket, [this, client_socket, cfg](const boost::system::error_code &ec) {
+        if (ec) {
+            SPDLOG_ERROR("Could not accept net connection: {}", ec.message());
+            log_flush();
+            return;
+        }
+        SPDLOG_DEBUG("New connection accpeted: {}", con_addr(client_socket));
+        {
+            std::lock_guard<std::mutex> lock(this->async_socket_list_lock);
+            auto list = this->async_socket_list;
+            list->erase(std::remove_if(list->begin(), list->end(), [](boost::weak_ptr<tcp::socket> &item) {
+                return item.expired();
+            }), list->end());
+            list->push_back(client_socket);
+        }
+        ClientConnection* connection = new ClientConnection();
+        connection->client_socket = client_socket;
+        connection->buffer_cfg = cfg;
+        this->async_handle_connection(connection);
+        std::lock_guard<std::mutex> guard{ this->keep_accept_connection_lock };
+        if (this->keep_accept_connection > 0) {
+            this->async_accept_connection(cfg);
+        }
+    });
+}
+
+void socket_lib::async_handle_connection(ClientConnection* connection) {
+    char *header = (char *)malloc(SCRCPY_SOCKET_HEADER_SIZE * sizeof(char));
+    boost::asio::async_read(*connection->client_socket, boost::asio::buffer(header, SCRCPY_SOCKET_HEADER_SIZE),
+            [this, connection, header](const boost::system::error_code &ec, std::size_t bytes_read) {
+        if (ec) {
+            SPDLOG_ERROR("Could not recev data from client: {}", ec.message());
+            free(header);
+            delete connection;
+            return;
+        }
+        this->parse_socket_type(connection, header);
+        free(header);
+        bool is_ctrl_socket = strcmp(connection->connection_type->c_str(), SCRCPY_CTRL_SOCKET_NAME) == 0;
+        if (!is_ctrl_socket) {
+            SPDLOG_INFO("{} is a video socket for device {} ", con_addr(connection->client_socket), connection->device_id->c_str());
+            log_flush();
+            int *disconnect_flag = this->add_video_disconnect_flag(connection);
+            socket_decode_async(connection->client_socket, this, connection->buffer_cfg, &(this->keep_accept_connection), disconnect_flag,
+                    this->decode_pool, [this, connection](int status) {
+                SPDLOG_INFO("Decoder just ended for device {} status {}", connection->device_id->c_str(), status);
+                log_flush();
+                this->cleanup_connection(connection, false);
+            });
+        } else {
+            SPDLOG_INFO("{} is a ctrl socket for device {} ", con_addr(connection->client_socket), connection->device_id->c_str());
+            log_flush();
+            auto handler = new scrcpy_ctrl_socket_handler(connection->device_id, connection->client_socket);
+            handler->run_async(this->ctrl_msg_sent_callback(), [this, connection](int status) {
+                this->cleanup_connection(connection, true);
+            });
+            this->add_ctrl_socket_handler(connection, handler);
+        }
+    });
 }
 
 void socket_lib::remove_all_callbacks(char* device_id) {
@@ -325,6 +664,39 @@ socket_lib::~socket_lib() {
     this->image_size_dict = NULL;
     free_image_size_dict(this->original_image_size_dict);
     this->original_image_size_dict = NULL;
+    if (this->output_format_dict) {
+        std::lock_guard<std::mutex> lock(this->output_format_lock);
+        delete this->output_format_dict;
+        this->output_format_dict = NULL;
+    }
+    if (this->delivery_cfg_dict) {
+        std::lock_guard<std::mutex> lock(this->delivery_cfg_lock);
+        delete this->delivery_cfg_dict;
+        this->delivery_cfg_dict = NULL;
+    }
+    if (this->decoder_profile_dict) {
+        std::lock_guard<std::mutex> lock(this->decoder_profile_lock);
+        delete this->decoder_profile_dict;
+        this->decoder_profile_dict = NULL;
+    }
+    if (this->frame_slot_map) {
+        std::lock_guard<std::mutex> lock(this->frame_slot_map_lock);
+        // a slot still being waited in is freed by its waiter
+        delete this->frame_slot_map;
+        this->frame_slot_map = NULL;
+        delete this->frame_slot_seq_map;
+        this->frame_slot_seq_map = NULL;
+    }
+    if (this->shm_ring_map) {
+        std::lock_guard<std::mutex> lock(this->shm_ring_map_lock);
+        delete this->shm_ring_map;
+        this->shm_ring_map = NULL;
+    }
+    if (this->snapshot_callback_map) {
+        std::unique_lock lock(this->snapshot_callback_map_lock);
+        delete this->snapshot_callback_map;
+        this->snapshot_callback_map = NULL;
+    }
     SPDLOG_DEBUG("Cleaning up device_info_callback_dict");
     if (this->device_info_callback_dict) {
         std::lock_guard<std::mutex> lock(this->device_info_callback_dict_lock);
@@ -377,6 +749,24 @@ socket_lib::~socket_lib() {
         delete this->frame_img_size_cfg_callback_map;
         this->frame_img_size_cfg_callback_map = NULL;
     }
+    if (this->async_socket_list) {
+        std::lock_guard<std::mutex> lock(this->async_socket_list_lock);
+        delete this->async_socket_list;
+        this->async_socket_list = NULL;
+    }
+    SPDLOG_DEBUG("Cleaning up pipeline_stats_map");
+    if(this->pipeline_stats_map) {
+        std::lock_guard<std::mutex> lock(this->pipeline_stats_map_lock);
+        auto map = this->pipeline_stats_map;
+        auto first = map->begin();
+        while(first != map->end()) {
+            delete first->second;
+            first ++;
+        }
+        map->clear();
+        delete this->pipeline_stats_map;
+        this->pipeline_stats_map = NULL;
+    }
     SPDLOG_DEBUG("Finished cleaning socket_lib");
     log_flush();
 }
@@ -400,9 +790,27 @@ void socket_lib::free_image_size_dict(std::map<std::string, image_size*>* dict)
     }
     delete dict;
 }
-void socket_lib::internal_video_frame_callback(std::string device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h) {
+void socket_lib::internal_video_frame_callback(std::string device_id, std::vector<uint8_t>* image, int w, int h, int raw_w, int raw_h) {
+    uint8_t *frame_data = image->data();
+    uint32_t frame_data_size = (uint32_t)image->size();
     SPDLOG_TRACE("Got video frame for device = {} data size = {}", device_id.c_str(), frame_data_size);
-    callback_handler->invoke((char *)this->m_token.c_str(), const_cast<char*>(device_id.c_str()), frame_data, frame_data_size, w, h, raw_w, raw_h);
+    char *device_id_str = const_cast<char*>(device_id.c_str());
+    auto slot = this->get_frame_slot(device_id_str, false);
+    if (slot) {
+        slot->put(frame_data, frame_data_size, w, h, raw_w, raw_h);
+    }
+    auto ring = this->get_shm_ring(device_id_str);
+    if (ring && ring->publish_image(this->get_output_format(device_id_str).format, frame_data, frame_data_size,
+                w, h, raw_w, raw_h) != 0) {
+        SPDLOG_DEBUG("Frame image of device {} does not fit into a slot of its shared memory ring", device_id);
+    }
+    // the frame was only encoded for the waiters or the ring
+    if ((slot || ring) && !callback_handler->has_handlers(device_id_str)) {
+        return;
+    }
+    // the waiters and the ring copied it already, so the callbacks could take the buffer
+    callback_handler->invoke((char *)this->m_token.c_str(), device_id_str, image, w, h, raw_w, raw_h,
+            this->get_pipeline_stats(device_id_str));
 }
 
 void socket_lib::register_device_info_callback(char* device_id, scrcpy_device_info_callback callback) {
@@ -537,3 +945,147 @@ void socket_lib::remove_frame_img_size_cfg_callback(char *device_id) {
         map->erase(entry);
     }
 }
+
+pipeline_stats* socket_lib::get_pipeline_stats(char *device_id) {
+    if (!device_id || !this->pipeline_stats_map) {
+        return NULL;
+    }
+    std::lock_guard<std::mutex> locker(this->pipeline_stats_map_lock);
+    auto map = this->pipeline_stats_map;
+    auto entry = map->find(std::string(device_id));
+    if (entry != map->end()) {
+        return entry->second;
+    }
+    // created on first use, kept until the listener is released so the numbers survive reconnecting
+    pipeline_stats *stats = new pipeline_stats();
+    map->emplace(std::string(device_id), stats);
+    return stats;
+}
+std::shared_ptr<frame_slot> socket_lib::get_frame_slot(char *device_id, bool create) {
+    std::lock_guard<std::mutex> locker(this->frame_slot_map_lock);
+    if (!device_id || !this->frame_slot_map) {
+        return NULL;
+    }
+    std::string key(device_id);
+    auto entry = this->frame_slot_map->find(key);
+    if (entry != this->frame_slot_map->end()) {
+        if (create) {
+            entry->second->touch();
+            return entry->second;
+        }
+        if (!entry->second->is_idle()) {
+            return entry->second;
+        }
+        // nobody pulls the frames anymore, so they're not encoded for it
+        SPDLOG_DEBUG("Removing the idle frame slot of device {}", device_id);
+        (*this->frame_slot_seq_map)[key] = entry->second->last_seq();
+        this->frame_slot_map->erase(entry);
+        return NULL;
+    }
+    if (!create || this->keep_accept_connection == 0) {
+        return NULL;
+    }
+    auto last_seq = this->frame_slot_seq_map->find(key);
+    auto slot = std::make_shared<frame_slot>(last_seq != this->frame_slot_seq_map->end() ? last_seq->second : 0);
+    this->frame_slot_map->emplace(key, slot);
+    return slot;
+}
+std::shared_ptr<shm_frame_ring> socket_lib::get_shm_ring(char *device_id) {
+    std::lock_guard<std::mutex> locker(this->shm_ring_map_lock);
+    if (!device_id || !this->shm_ring_map) {
+        return NULL;
+    }
+    auto entry = this->shm_ring_map->find(std::string(device_id));
+    if (entry == this->shm_ring_map->end()) {
+        return NULL;
+    }
+    return entry->second;
+}
+int socket_lib::export_shm_ring(char* device_id, char* name, int slot_count, uint32_t slot_size) {
+    SPDLOG_INFO("Trying to export frames of device {} into shared memory ring {} with {} slots", device_id,
+            name ? name : "", slot_count);
+    std::lock_guard<std::mutex> locker(this->shm_ring_map_lock);
+    if (!this->shm_ring_map) {
+        return 1;
+    }
+    // closed before creating the new one, so a mapping of the same name is not reused with the old size
+    this->shm_ring_map->erase(std::string(device_id));
+    if (slot_count <= 0) {
+        return 0;
+    }
+    auto ring = std::make_shared<shm_frame_ring>();
+    if (ring->open(name, slot_count, slot_size) != 0) {
+        return 1;
+    }
+    (*this->shm_ring_map)[std::string(device_id)] = ring;
+    return 0;
+}
+int socket_lib::wait_next_frame(char* device_id, uint64_t last_seq, int timeout_ms, uint8_t *out_buffer, uint32_t cap,
+        scrcpy_frame_info *info) {
+    auto slot = this->get_frame_slot(device_id, true);
+    if (!slot) {
+        return SCRCPY_WAIT_FRAME_CLOSED;
+    }
+    return slot->wait_next(last_seq, timeout_ms, out_buffer, cap, info);
+}
+int socket_lib::capture_snapshot(char* device_id, int width, int height, int format, int quality, uint8_t *out_buffer,
+        uint32_t cap, scrcpy_frame_info *info) {
+    image_output_format output_format = { format, quality };
+    if (format < 0) {
+        output_format = this->get_output_format(device_id);
+    } else if (format != SCRCPY_OUTPUT_FORMAT_PNG && format != SCRCPY_OUTPUT_FORMAT_JPEG && format != SCRCPY_OUTPUT_FORMAT_WEBP) {
+        SPDLOG_ERROR("Unknown output format {} for snapshot of device {}", format, device_id);
+        return SCRCPY_SNAPSHOT_FAILED;
+    }
+    if (width <= 0 || height <= 0) {
+        width = 0;
+        height = 0;
+    }
+    std::vector<uint8_t> buffer;
+    scrcpy_frame_info frame_info = {};
+    int result = SCRCPY_SNAPSHOT_NO_FRAME;
+    std::shared_ptr<snapshot_source> source;
+    {
+        std::shared_lock lock(this->snapshot_callback_map_lock);
+        if (!this->snapshot_callback_map) {
+            return SCRCPY_SNAPSHOT_NO_FRAME;
+        }
+        auto entry = this->snapshot_callback_map->find(std::string(device_id));
+        if (entry != this->snapshot_callback_map->end()) {
+            source = entry->second;
+        }
+    }
+    if (source) {
+        // the other devices are captured and connected meanwhile, the decoder is kept until the capture is done
+        std::shared_lock source_lock(source->lock);
+        if (source->capture) {
+            result = source->capture(width, height, output_format, &buffer, &frame_info);
+        }
+    }
+    if (!source || result == SCRCPY_SNAPSHOT_NO_FRAME) {
+        SPDLOG_DEBUG("No decoded frame for snapshot of device {}", device_id);
+    }
+    if (result != SCRCPY_SNAPSHOT_OK) {
+        return result;
+    }
+    frame_info.size = (uint32_t)buffer.size();
+    if (info) {
+        *info = frame_info;
+    }
+    if (!out_buffer || buffer.size() > cap) {
+        return SCRCPY_SNAPSHOT_BUFFER_TOO_SMALL;
+    }
+    memcpy(out_buffer, buffer.data(), buffer.size());
+    return SCRCPY_SNAPSHOT_OK;
+}
+pipeline_stats* socket_lib::find_pipeline_stats(char *device_id) {
+    if (!device_id || !this->pipeline_stats_map) {
+        return NULL;
+    }
+    std::lock_guard<std::mutex> locker(this->pipeline_stats_map_lock);
+    auto entry = this->pipeline_stats_map->find(std::string(device_id));
+    if (entry == this->pipeline_stats_map->end()) {
+        return NULL;
+    }
+    return entry->second;
+}
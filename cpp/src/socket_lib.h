@@ -2,12 +2,17 @@
 #define SCRCPY_SOCKET_LIB
 
 #include <map>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
 #include <vector>
 #include "boost/asio/ip/tcp.hpp"
+#include "boost/asio/thread_pool.hpp"
+#include "boost/weak_ptr.hpp"
 #include "model.h"
 #include "frame_img_callback.h"
+#include "frame_slot.h"
+#include "shm_frame_ring.h"
 #include "scrcpy_ctrl_handler.h"
 using boost::asio::ip::tcp;
 
@@ -30,6 +35,15 @@ typedef struct ClientConnection {
     std::string *device_id = NULL;
 } ClientConnection;
 
+/*
+ * snapshot capturing of a device, kept for the device once set
+ */
+typedef struct snapshot_source {
+    // held shared while capturing, so replacing or removing the callback waits for the captures of the device
+    std::shared_mutex lock;
+    scrcpy_snapshot_callback capture;
+} snapshot_source;
+
 // socket lib for handling server socket and clietn connection
 class socket_lib : video_decode_callback {
     public:
@@ -53,6 +67,18 @@ class socket_lib : video_decode_callback {
          * @param		device_id		the device's identifier
          */
         void remove_all_callbacks(char* device_id);
+        /*
+         * register a raw frame callback handler
+         * @param		device_id			the device
+         * @param		pixel_format		pixel format for all raw frame callbacks of the device
+         * @param		callback			callback handler(function pointer)
+         */
+        void register_raw_callback(char* device_id, int pixel_format, frame_raw_callback_handler callback);
+        /*
+         * remove all raw frame callbacks for a device
+         * @param		device_id		the device's identifier
+         */
+        void remove_all_raw_callbacks(char* device_id);
         /*
          * config the image size from the video image of a device
          * so this lib will resize image to width and height.
@@ -61,6 +87,119 @@ class socket_lib : video_decode_callback {
          * @param		height				image height
          */
         void config_image_size(char* device_id, int width, int height);
+        /*
+         * config the encoded format of frame images for a device
+         * @param		device_id			the devices' identifier
+         * @param		format				@see SCRCPY_OUTPUT_FORMAT_PNG
+         * @param		quality				png compression level or jpeg/webp quality
+         * @return		0 if ok, 1 if the format is unknown
+         */
+        int config_output_format(char* device_id, int format, int quality);
+        /*
+         * config the h264 decoder profile of a device, used when its video socket connects
+         * @param		device_id			the devices' identifier
+         * @param		profile				@see SCRCPY_DECODER_PROFILE_DEFAULT
+         * @return		0 if ok, 1 if the profile is unknown
+         */
+        int config_decoder_profile(char* device_id, int profile);
+        /*
+         * config the h264 decoder profile of devices without their own profile, must be called before startup
+         * @param		profile				@see SCRCPY_DECODER_PROFILE_DEFAULT
+         * @return		0 if ok, 1 if the profile is unknown
+         */
+        int config_default_decoder_profile(int profile);
+        /*
+         * config the callback queue of a device
+         * @param		device_id			the devices' identifier
+         * @param		depth				frames queued including the one being delivered, 0 for the default
+         * @param		policy				@see SCRCPY_DELIVERY_DROP_NEWEST
+         * @return		0 if ok, 1 if the depth or the policy is invalid
+         */
+        int config_delivery_policy(char* device_id, int depth, int policy);
+        /*
+         * only convert the newest decoded frame of a device once its callbacks are ready for it
+         * @param		device_id			the devices' identifier
+         * @param		enabled				false to convert every decoded frame
+         */
+        void config_latest_frame_only(char* device_id, bool enabled);
+        /*
+         * limit frames converted per second for a device, frames over the limit are decoded only
+         * @param		device_id			the devices' identifier
+         * @param		fps					max frames per second, 0 for no limit
+         */
+        void config_max_fps(char* device_id, int fps);
+        /*
+         * skip decoding while a device has no frame callback
+         * @param		device_id			the devices' identifier
+         * @param		enabled				false to decode all frames anyway
+         */
+        void config_drain_when_idle(char* device_id, bool enabled);
+        /*
+         * only decode the keyframes of a device
+         * @param		device_id			the devices' identifier
+         * @param		enabled				false to decode all frames
+         */
+        void config_keyframe_only(char* device_id, bool enabled);
+        /*
+         * keep decoding and scaling at full quality even if frames of a device are scaled down a lot
+         * @param		device_id			the devices' identifier
+         * @param		enabled				false to take the low resolution path automatically
+         */
+        void config_full_res_decoding(char* device_id, bool enabled);
+        /*
+         * skip the frames of a device identical to the last one sent
+         * @param		device_id			the devices' identifier
+         * @param		enabled				false to send all frames
+         * @param		heartbeat_ms		send an identical frame anyway after this many ms, 0 for never
+         */
+        void config_skip_identical_frames(char* device_id, bool enabled, int heartbeat_ms);
+        /*
+         * report the changed regions with the raw frames of a device
+         * @param		device_id			the devices' identifier
+         * @param		enabled				false to skip comparing the frames
+         */
+        void config_dirty_rects(char* device_id, bool enabled);
+        /*
+         * only keep the latest decoded frame of a device, converted when a snapshot is captured
+         * @param		device_id			the devices' identifier
+         * @param		enabled				false to convert every frame
+         */
+        void config_snapshot_mode(char* device_id, bool enabled);
+        /*
+         * wait for the newest frame image of a device newer than last_seq
+         * @param		device_id			the devices' identifier
+         * @param		last_seq			seq of the last frame got
+         * @param		timeout_ms			max time to wait, -1 for no limit
+         * @param		out_buffer			for receiving the image data
+         * @param		cap					size of out_buffer
+         * @param		info				for receiving seq, size of the frame
+         * @return		@see SCRCPY_WAIT_FRAME_OK
+         */
+        int wait_next_frame(char* device_id, uint64_t last_seq, int timeout_ms, uint8_t *out_buffer, uint32_t cap,
+                scrcpy_frame_info *info);
+        /*
+         * scale and encode the latest decoded frame of a device
+         * @param		device_id			the devices' identifier
+         * @param		width				image width, 0 for the configured image size
+         * @param		height				image height, 0 for the configured image size
+         * @param		format				@see SCRCPY_OUTPUT_FORMAT_PNG, -1 for the configured output format
+         * @param		quality				png compression level or jpeg/webp quality
+         * @param		out_buffer			for receiving the image data
+         * @param		cap					size of out_buffer
+         * @param		info				for receiving seq, size of the snapshot
+         * @return		@see SCRCPY_SNAPSHOT_OK
+         */
+        int capture_snapshot(char* device_id, int width, int height, int format, int quality, uint8_t *out_buffer, uint32_t cap,
+                scrcpy_frame_info *info);
+        /*
+         * publish frames of a device into a shared memory ring, replacing the ring exported before
+         * @param		device_id			the devices' identifier
+         * @param		name				name of the file mapping
+         * @param		slot_count			frames kept in the ring, 0 to stop exporting
+         * @param		slot_size			max bytes of a frame
+         * @return		0 if ok
+         */
+        int export_shm_ring(char* device_id, char* name, int slot_count, uint32_t slot_size);
         /*
          * startup a listener at the address, you can just pass a port no.
          * CAUTION: this is a blocking method, the thread will be blocked until the listener stopped working.
@@ -74,17 +213,21 @@ class socket_lib : video_decode_callback {
          * stop accepting new connections and shutdown the socket
          */
         void shutdown_svr();
+        /*
+         * read the connections with async io instead of a thread per connection, must be called before startup
+         * @param		io_threads			threads running the io_context, 0 means using the core count
+         */
+        void enable_async_io(int io_threads);
         /*
          * global callback entry handler for video image
          * @param		device_id			the device's identifier
-         * @param		frame_data			the image data in png format
-         * @param		frame_data_size		the image data's length
+         * @param		frame_data			the image data, handed over to the frame image callbacks by swapping
          * @param		w					the image's width
          * @param		h					the image's height
          * @param		raw_w				the original screen width
          * @param		raw_h				the original scrren height
          */
-        void on_video_callback(char* device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h);
+        void on_video_callback(char* device_id, std::vector<uint8_t>* frame_data, int w, int h, int raw_w, int raw_h);
         /*
          * get the configured image size for any device
          * @param		device_id			the device's identifier
@@ -138,6 +281,45 @@ class socket_lib : video_decode_callback {
 
         void add_frame_img_size_cfg_callback(char *device_id, scrcpy_frame_img_size_cfg_callback callback);
         void remove_frame_img_size_cfg_callback(char *device_id);
+        /**
+         * get pipeline stats of a device, created if not exists
+         */
+        pipeline_stats* get_pipeline_stats(char *device_id);
+        /**
+         * find pipeline stats of a device
+         * @return NULL if the device never sent any video
+         */
+        pipeline_stats* find_pipeline_stats(char *device_id);
+        /*
+         * get the frame slot of a device, an idle one is removed
+         * @param		device_id			the device's identifier
+         * @param		create				create it if not found, and keep it from being idle for the caller going to wait
+         * @return		NULL if not found or idle, or shutting down
+         */
+        std::shared_ptr<frame_slot> get_frame_slot(char *device_id, bool create);
+        /*
+         * get the shared memory ring of a device
+         * @param		device_id			the device's identifier
+         * @return		NULL if frames of the device are not exported
+         */
+        std::shared_ptr<shm_frame_ring> get_shm_ring(char *device_id);
+        /*
+         * global callback entry handler for raw frames
+         * @param		device_id			the device's identifier
+         * @param		frame				the scaled frame
+         * @param		raw_w				the original screen width
+         * @param		raw_h				the original scrren height
+         */
+        void on_raw_frame_callback(char *device_id, scrcpy_frame *frame, int raw_w, int raw_h);
+        int get_raw_frame_format(char *device_id);
+        bool has_frame_img_callback(char *device_id);
+        image_output_format get_output_format(char *device_id);
+        device_delivery_cfg get_delivery_cfg(char *device_id);
+        void set_frame_ready_callback(char *device_id, scrcpy_frame_ready_callback callback);
+        void request_frame_ready(char *device_id);
+        int get_decoder_profile(char *device_id);
+        void set_snapshot_callback(char *device_id, scrcpy_snapshot_callback callback);
+        bool wait_for_frame_slot(char *device_id, int timeout_ms);
 
     private:
         boost::shared_ptr<tcp::acceptor> listen_socket = NULL;
@@ -147,26 +329,53 @@ class socket_lib : video_decode_callback {
         bool shutting_down = 0;
         std::map<std::string, image_size*> *image_size_dict = NULL;
         std::map<std::string, image_size*> *original_image_size_dict = NULL;
+        std::map<std::string, image_output_format> *output_format_dict = NULL;
+        std::map<std::string, device_delivery_cfg> *delivery_cfg_dict = NULL;
+        std::map<std::string, int> *decoder_profile_dict = NULL;
+        // latest frame images for scrcpy_wait_next_frame, created by a call for a device and removed once idle
+        std::map<std::string, std::shared_ptr<frame_slot>> *frame_slot_map = NULL;
+        // seq of the idle slots removed, continued by the next slot of the device
+        std::map<std::string, uint64_t> *frame_slot_seq_map = NULL;
+        // shared memory rings of exported devices, shared with the publishing threads while they're replaced
+        std::map<std::string, std::shared_ptr<shm_frame_ring>> *shm_ring_map = NULL;
+        int default_decoder_profile = SCRCPY_DECODER_PROFILE_DEFAULT;
         std::map<std::string, std::vector<scrcpy_device_info_callback>*> *device_info_callback_dict = NULL;
         std::map<std::string, scrcpy_ctrl_socket_handler*> *ctrl_socket_handler_map = NULL;
         std::map<std::string, scrcpy_device_ctrl_msg_send_callback> *ctrl_sending_callback_map = NULL;
         std::map<std::string, int*> *video_socket_disconnect_flag_map = NULL;
         std::map<std::string, std::vector<scrcpy_frame_img_size_cfg_callback>*> *frame_img_size_cfg_callback_map = NULL;
+        std::map<std::string, pipeline_stats*> *pipeline_stats_map = NULL;
+        // snapshot capturing of devices, the callback is set by their decoders while connected
+        std::map<std::string, std::shared_ptr<snapshot_source>> *snapshot_callback_map = NULL;
+        // sockets accepted in async io mode
+        std::vector<boost::weak_ptr<tcp::socket>> *async_socket_list = NULL;
+        bool async_io = false;
+        int async_io_threads = 0;
+        boost::asio::thread_pool *decode_pool = NULL;
 
         std::mutex keep_accept_connection_lock;
         std::mutex image_size_lock;
+        std::mutex output_format_lock;
+        std::mutex delivery_cfg_lock;
+        std::mutex decoder_profile_lock;
+        std::mutex frame_slot_map_lock;
+        std::mutex shm_ring_map_lock;
         std::mutex device_info_callback_dict_lock;
         std::shared_mutex ctrl_socket_handler_map_lock;
         std::mutex ctrl_sending_callback_map_lock;
         std::mutex video_socket_disconnect_flag_map_lock;
         std::mutex frame_img_size_cfg_callback_map_lock;
+        std::mutex pipeline_stats_map_lock;
+        // shared while capturing, so a decoder could not remove its callback and go away during a capture
+        std::shared_mutex snapshot_callback_map_lock;
+        std::mutex async_socket_list_lock;
 
         frame_img_processor *callback_handler = new frame_img_processor();
         scrcpy_device_disconnected_callback disconnected_callback = NULL;
 
 
         // internal callback handling
-        void internal_video_frame_callback(std::string device_id, uint8_t* frame_data, uint32_t frame_data_size, int w, int h, int raw_w, int raw_h);
+        void internal_video_frame_callback(std::string device_id, std::vector<uint8_t>* frame_data, int w, int h, int raw_w, int raw_h);
         // release image size config
         void free_image_size_dict(std::map<std::string, image_size*>* dict);
         // get image size config for device
@@ -175,6 +384,27 @@ class socket_lib : video_decode_callback {
         int handle_connetion(ClientConnection* connection);
         // accept new connection
         int accept_new_connection(connection_buffer_config* cfg);
+        /*
+         * run the io_context with async_io_threads until shutdown, then close all connections
+         * @param		cfg				buffer config of the connections
+         */
+        int run_async_io(connection_buffer_config* cfg);
+        // accept a new connection in async io mode
+        void async_accept_connection(connection_buffer_config* cfg);
+        // read socket type of an accepted connection and start handling it in async io mode
+        void async_handle_connection(ClientConnection* connection);
+        /*
+         * cleanup a connection after its decoder or ctrl handler ended, the connection will be deleted
+         * @param		connection			the client connection
+         * @param		is_ctrl_socket		if it is a ctrl connection
+         */
+        void cleanup_connection(ClientConnection* connection, bool is_ctrl_socket);
+        // add disconnect flag for a video connection
+        int* add_video_disconnect_flag(ClientConnection* connection);
+        // add ctrl socket handler of a device
+        void add_ctrl_socket_handler(ClientConnection* connection, scrcpy_ctrl_socket_handler* handler);
+        // ctrl message sending callback for the ctrl socket handlers
+        std::function<void(std::string, std::string, int, int)> ctrl_msg_sent_callback();
         /*
          * invoke callback handlers for device info
          * @param		device_id		the devce's id
@@ -188,6 +418,13 @@ class socket_lib : video_decode_callback {
          * @return  socket type string
          */
         std::string* read_socket_type(ClientConnection* connection);
+        /**
+         * parse socket type from the socket header
+         * @param       connection          the client connection
+         * @param       data                SCRCPY_SOCKET_HEADER_SIZE bytes header
+         * @return  socket type string
+         */
+        std::string* parse_socket_type(ClientConnection* connection, char *data);
         /**
          * detect if a connection is a controll socket
          * @param       connection          the client connection
@@ -0,0 +1,64 @@
+#include "socket_reader.h"
+#include "logging.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include "boost/asio/buffer.hpp"
+
+socket_reader::socket_reader(boost::shared_ptr<tcp::socket> socket, int buffer_size) {
+    this->socket = socket;
+    this->capacity = std::max(buffer_size, SOCKET_READER_MIN_BUFFER_SIZE);
+    this->buffer = (char *)malloc(this->capacity);
+    if (!this->buffer) {
+        SPDLOG_ERROR("No enough memory for socket reader buffer of {} bytes", this->capacity);
+        this->capacity = 0;
+    }
+}
+socket_reader::~socket_reader() {
+    if (this->buffer) {
+        free(this->buffer);
+        this->buffer = NULL;
+    }
+}
+int socket_reader::read(char *dest, int length) {
+    int copied = std::min(this->end - this->start, length);
+    if (copied > 0) {
+        memcpy(dest, this->buffer + this->start, copied);
+        this->start += copied;
+    }
+    while (copied < length) {
+        int remaining = length - copied;
+        // nothing is buffered here, the data goes to dest directly and the rest fills the buffer
+        std::array<boost::asio::mutable_buffer, 2> buffers = {
+            boost::asio::buffer(dest + copied, remaining),
+            boost::asio::buffer(this->buffer, this->capacity)
+        };
+        size_t bytes_read = 0;
+        try {
+            bytes_read = this->socket->read_some(buffers);
+        } catch (boost::system::system_error &e) {
+            SPDLOG_ERROR("Failed to read {} bytes from socket: {}", remaining, e.what());
+            return 1;
+        }
+        this->calls++;
+        if (bytes_read == 0) {
+            SPDLOG_ERROR("Connection may be closed, {}/{} bytes read", copied, length);
+            return 1;
+        }
+        if ((int)bytes_read <= remaining) {
+            copied += (int)bytes_read;
+            continue;
+        }
+        this->start = 0;
+        this->end = (int)bytes_read - remaining;
+        copied = length;
+    }
+    return 0;
+}
+int socket_reader::buffered() {
+    return this->end - this->start;
+}
+uint64_t socket_reader::read_calls() {
+    return this->calls;
+}
@@ -0,0 +1,48 @@
+#ifndef SCRCPY_SOCKET_READER
+#define SCRCPY_SOCKET_READER
+#include <stdint.h>
+#include "boost/asio/ip/tcp.hpp"
+#include "boost/shared_ptr.hpp"
+
+using boost::asio::ip::tcp;
+
+#define SOCKET_READER_MIN_BUFFER_SIZE 64 * 1024
+
+/*
+ * buffered reader of a connection
+ * every read fills the destination first and keeps the bytes after it, usually the next headers, for the following reads
+ * so a small packet could be read together with its neighbours in one syscall
+ */
+class socket_reader {
+    public:
+        /*
+         * @param       socket              the connection
+         * @param       buffer_size         bytes read ahead at most
+         */
+        socket_reader(boost::shared_ptr<tcp::socket> socket, int buffer_size);
+        ~socket_reader();
+        /*
+         * read exactly @length bytes
+         * @param       dest                where the data goes
+         * @param       length
+         * @return      0 if ok
+         */
+        int read(char *dest, int length);
+        /*
+         * bytes read ahead and not consumed yet
+         */
+        int buffered();
+        /*
+         * socket reads issued since created
+         */
+        uint64_t read_calls();
+    private:
+        boost::shared_ptr<tcp::socket> socket = NULL;
+        char *buffer = NULL;
+        int capacity = 0;
+        // buffered bytes are buffer[start, end)
+        int start = 0;
+        int end = 0;
+        uint64_t calls = 0;
+};
+#endif //!SCRCPY_SOCKET_READER
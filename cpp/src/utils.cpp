@@ -5,7 +5,23 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include "logging.h"
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HASH_PLANE_SSE2
+#endif
+
+// initial keys, per block key steps, per row scramble keys and multiplier of hash_plane
+#define HASH_KEY_0 0xbe4ba423396cfeb8ULL
+#define HASH_KEY_1 0x1cad21f72c81017cULL
+#define HASH_KEY_STEP_0 0x9e3779b97f4a7c15ULL
+#define HASH_KEY_STEP_1 0xc2b2ae3d27d4eb4fULL
+#define HASH_SCRAMBLE_0 0xdb979083e96dd4deULL
+#define HASH_SCRAMBLE_1 0x1f67b3b7a4a44072ULL
+#define HASH_PRIME_32 0x9e3779b1U
+#define HASH_PRIME_TAIL 0x100000001b3ULL
 
 int string_compartor(void* a, void* b) {
     if (!a || !b) {
@@ -84,4 +100,172 @@ std::string con_addr(boost::shared_ptr<tcp::socket> conn) {
     std::string addr = fmt::format("{}:{}", remote.address().to_string(), remote.port());
     return addr;
 }
-
+static inline uint64_t hash_mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+/*
+ * 16 bytes blocks are accumulated into two 64bit lanes like xxh3 does, with keys changed per block,
+ * so moved content changes the hash. The lanes are scrambled after each row, so do moved rows.
+ * The bytes after the last block of a row are hashed one by one.
+ */
+uint64_t hash_plane(uint64_t seed, const uint8_t *data, int linesize, int row_bytes, int rows) {
+    if (!data || row_bytes <= 0 || rows <= 0) {
+        return seed;
+    }
+    int blocks = row_bytes / 16;
+    uint64_t lanes[2] = { hash_mix(seed), hash_mix(seed + 1) };
+    uint64_t tail = seed;
+#ifdef HASH_PLANE_SSE2
+    __m128i acc = _mm_loadu_si128((const __m128i *)lanes);
+    const __m128i key_start = _mm_set_epi64x((long long)HASH_KEY_1, (long long)HASH_KEY_0);
+    const __m128i key_step = _mm_set_epi64x((long long)HASH_KEY_STEP_1, (long long)HASH_KEY_STEP_0);
+    const __m128i scramble = _mm_set_epi64x((long long)HASH_SCRAMBLE_1, (long long)HASH_SCRAMBLE_0);
+    const __m128i prime = _mm_set1_epi32((int)HASH_PRIME_32);
+#endif
+    for (int row = 0; row < rows; row++) {
+        const uint8_t *pixels = data + (size_t)row * linesize;
+#ifdef HASH_PLANE_SSE2
+        __m128i key = key_start;
+        for (int i = 0; i < blocks; i++) {
+            __m128i value = _mm_loadu_si128((const __m128i *)(pixels + i * 16));
+            __m128i keyed = _mm_xor_si128(value, key);
+            // low 32 bits times high 32 bits of each lane, plus the value of the other lane
+            __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+            acc = _mm_add_epi64(acc, _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc = _mm_add_epi64(acc, product);
+            key = _mm_add_epi64(key, key_step);
+        }
+        acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+        acc = _mm_xor_si128(acc, scramble);
+        // 64bit multiply by a 32bit prime
+        __m128i low = _mm_mul_epu32(acc, prime);
+        __m128i high = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+        acc = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+#else
+        uint64_t key[2] = { HASH_KEY_0, HASH_KEY_1 };
+        for (int i = 0; i < blocks; i++) {
+            uint64_t value[2];
+            memcpy(value, pixels + i * 16, 16);
+            for (int lane = 0; lane < 2; lane++) {
+                uint64_t keyed = value[lane] ^ key[lane];
+                lanes[lane] += value[1 - lane] + (keyed & 0xFFFFFFFFULL) * (keyed >> 32);
+            }
+            key[0] += HASH_KEY_STEP_0;
+            key[1] += HASH_KEY_STEP_1;
+        }
+        lanes[0] = ((lanes[0] ^ (lanes[0] >> 47)) ^ HASH_SCRAMBLE_0) * HASH_PRIME_32;
+        lanes[1] = ((lanes[1] ^ (lanes[1] >> 47)) ^ HASH_SCRAMBLE_1) * HASH_PRIME_32;
+#endif
+        for (int i = blocks * 16; i < row_bytes; i++) {
+            tail = (tail ^ pixels[i]) * HASH_PRIME_TAIL;
+        }
+    }
+#ifdef HASH_PLANE_SSE2
+    _mm_storeu_si128((__m128i *)lanes, acc);
+#endif
+    return hash_mix(lanes[0] ^ hash_mix(lanes[1] ^ hash_mix(tail)));
+}
+/*
+ * runs of changed tiles in a tile row are merged with the rectangle right above them if it covers the same columns
+ */
+int diff_tiles(const uint8_t *prev, int prev_linesize, const uint8_t *cur, int cur_linesize, int width, int height,
+        int tile_size, scrcpy_area *rects, int max_rects) {
+    if (!prev || !cur || !rects || width <= 0 || height <= 0 || tile_size <= 0 || max_rects <= 0) {
+        return 0;
+    }
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    std::vector<bool> dirty(tiles_x);
+    int count = 0;
+    bool overflow = false;
+    int min_x = width, min_y = height, max_x = 0, max_y = 0;
+    // rectangles ending at the previous tile row
+    int open_start = 0;
+    int open_end = 0;
+    for (int tile_y = 0; tile_y < height; tile_y += tile_size) {
+        int rows = tile_y + tile_size > height ? height - tile_y : tile_size;
+        std::fill(dirty.begin(), dirty.end(), false);
+        for (int y = tile_y; y < tile_y + rows; y++) {
+            const uint8_t *prev_row = prev + (size_t)y * prev_linesize;
+            const uint8_t *cur_row = cur + (size_t)y * cur_linesize;
+            for (int i = 0; i < tiles_x; i++) {
+                int x = i * tile_size;
+                if (!dirty[i] && memcmp(prev_row + x, cur_row + x, x + tile_size > width ? width - x : tile_size) != 0) {
+                    dirty[i] = true;
+                }
+            }
+        }
+        for (int i = 0; i < tiles_x; i++) {
+            if (!dirty[i]) {
+                continue;
+            }
+            int end = i;
+            while (end < tiles_x && dirty[end]) {
+                end++;
+            }
+            int x = i * tile_size;
+            int w = (end * tile_size > width ? width : end * tile_size) - x;
+            min_x = std::min(min_x, x);
+            max_x = std::max(max_x, x + w);
+            min_y = std::min(min_y, tile_y);
+            max_y = std::max(max_y, tile_y + rows);
+            i = end;
+            if (overflow) {
+                continue;
+            }
+            bool merged = false;
+            for (int j = open_start; j < open_end; j++) {
+                if (rects[j].x == x && rects[j].width == w && rects[j].y + rects[j].height == tile_y) {
+                    rects[j].height += rows;
+                    // it ends at this tile row now, move it next to the ones added for this row
+                    std::swap(rects[j], rects[open_end - 1]);
+                    open_end--;
+                    merged = true;
+                    break;
+                }
+            }
+            if (merged) {
+                continue;
+            }
+            if (count == max_rects) {
+                overflow = true;
+                continue;
+            }
+            rects[count++] = scrcpy_area{ x, tile_y, w, rows };
+        }
+        // those left from the previous tile row won't grow anymore
+        open_start = open_end;
+        open_end = count;
+    }
+    if (overflow) {
+        rects[0] = scrcpy_area{ min_x, min_y, max_x - min_x, max_y - min_y };
+        return 1;
+    }
+    return count;
+}
+bool h264_has_idr(const char *data, int length) {
+    if (!data || length < 4) {
+        return false;
+    }
+    const unsigned char *bytes = (const unsigned char *)data;
+    // 3 bytes start code, also matches the tail of a 4 bytes one
+    for (int i = 0; i + 3 < length; i++) {
+        if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01) {
+            if ((bytes[i + 3] & 0x1F) == 5) {
+                return true;
+            }
+            i += 2;
+        }
+    }
+    return false;
+}
+int frame_plane_height(int format, int plane, int height) {
+    if (plane > 0 && (format == SCRCPY_PIXEL_FORMAT_NV12 || format == SCRCPY_PIXEL_FORMAT_I420)) {
+        return (height + 1) / 2;
+    }
+    return height;
+}
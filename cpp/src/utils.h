@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <string>
 #include "boost/asio/ip/tcp.hpp"
+#include "scrcpy_recv/scrcpy_recv.h"
 using boost::asio::ip::tcp;
 
 /*
@@ -48,4 +49,48 @@ void print_bytes(char *header, char *data, int length);
 
 std::string con_addr(boost::shared_ptr<tcp::socket> conn);
 
+/*
+* check if an annex-b h264 packet has an IDR slice, the packet may start with SPS/PPS
+* @param	data				the packet data
+* @param	length				the packet length
+* @return	true if there's a nal unit of type 5
+*/
+bool h264_has_idr(const char *data, int length);
+
+/*
+* hash the pixels of an image plane with sse2 when available, bytes after each row(the padding) are ignored
+* a 64bit result for telling if two frames are identical, not for security
+* @param	seed				the result of the previous plane, or 0
+* @param	data				first row of the plane
+* @param	linesize			bytes from a row to the next one
+* @param	row_bytes			bytes of pixels in a row
+* @param	rows				row count
+* @return	the hash, the same as the seed if there's nothing to hash
+*/
+uint64_t hash_plane(uint64_t seed, const uint8_t *data, int linesize, int row_bytes, int rows);
+
+/*
+* compare two 8bit planes of the same size in square tiles, and merge the changed tiles into rectangles
+* @param	prev				the previous plane
+* @param	prev_linesize		bytes from a row to the next one of the previous plane
+* @param	cur					the current plane
+* @param	cur_linesize		bytes from a row to the next one of the current plane
+* @param	width				plane width
+* @param	height				plane height
+* @param	tile_size			tile width and height
+* @param	rects				for receiving the changed rectangles, clipped to the plane
+* @param	max_rects			size of rects, if more are needed, the bounding box of all changed tiles is returned
+* @return	rectangle count, 0 if nothing changed
+*/
+int diff_tiles(const uint8_t *prev, int prev_linesize, const uint8_t *cur, int cur_linesize, int width, int height,
+        int tile_size, scrcpy_area *rects, int max_rects);
+
+/*
+* rows of a raw frame plane, chroma planes of NV12/I420 are subsampled vertically
+* @param	format				@see SCRCPY_PIXEL_FORMAT_BGRA
+* @param	plane				index of the plane
+* @param	height				frame height
+*/
+int frame_plane_height(int format, int plane, int height);
+
 #endif // !SCRCPY_UTILS
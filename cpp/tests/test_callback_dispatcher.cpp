@@ -0,0 +1,177 @@
+#include "callback_dispatcher.h"
+#include "assert.h"
+#include "logging.h"
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#define TEST_TASK_COUNT 50
+#define TEST_TASK_ITEMS 200
+
+// items are queued by the test thread and consumed by the task like the frames of a device
+typedef struct test_task {
+    dispatch_task task;
+    std::mutex lock;
+    std::deque<int> items;
+    std::atomic<int> last_item = 0;
+    std::atomic<bool> running = false;
+} test_task;
+
+static int run_test_task(test_task *item) {
+    // never run by two workers at once
+    assert(!item->running.exchange(true));
+    std::deque<int> items;
+    {
+        std::lock_guard<std::mutex> guard{ item->lock };
+        items.swap(item->items);
+    }
+    for (int value : items) {
+        // in the order they were queued
+        assert(value == item->last_item + 1);
+        item->last_item = value;
+    }
+    item->running = false;
+    return DISPATCH_TASK_IDLE;
+}
+
+static bool wait_for(std::function<bool()> done, int timeout_ms) {
+    for (int i = 0; i < timeout_ms; i++) {
+        if (done()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return done();
+}
+
+void test_callback_dispatcher_order() {
+    SPDLOG_INFO("test_callback_dispatcher_order");
+    log_flush();
+    callback_dispatcher *dispatcher = new callback_dispatcher(3);
+    assert(dispatcher->worker_count() == 3);
+    test_task *tasks = new test_task[TEST_TASK_COUNT];
+    for (int i = 0; i < TEST_TASK_COUNT; i++) {
+        tasks[i].task.run = std::bind(run_test_task, &tasks[i]);
+    }
+    for (int value = 1; value <= TEST_TASK_ITEMS; value++) {
+        for (int i = 0; i < TEST_TASK_COUNT; i++) {
+            {
+                std::lock_guard<std::mutex> guard{ tasks[i].lock };
+                tasks[i].items.push_back(value);
+            }
+            dispatcher->schedule(&tasks[i].task);
+        }
+    }
+    bool done = wait_for([tasks]() {
+        for (int i = 0; i < TEST_TASK_COUNT; i++) {
+            if (tasks[i].running || tasks[i].last_item != TEST_TASK_ITEMS) {
+                return false;
+            }
+        }
+        return true;
+    }, 5000);
+    assert(done);
+    delete dispatcher;
+    delete[] tasks;
+}
+
+void test_callback_dispatcher_stealing() {
+    SPDLOG_INFO("test_callback_dispatcher_stealing");
+    log_flush();
+    callback_dispatcher *dispatcher = new callback_dispatcher(2);
+    std::atomic<bool> blocked = true;
+    std::atomic<int> slow_runs = 0;
+    std::atomic<int> fast_runs = 0;
+    dispatch_task slow_task;
+    slow_task.run = [&blocked, &slow_runs]() {
+        slow_runs++;
+        while (blocked) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return DISPATCH_TASK_IDLE;
+    };
+    dispatch_task fast_tasks[4];
+    for (dispatch_task &task : fast_tasks) {
+        task.run = [&fast_runs]() {
+            fast_runs++;
+            return DISPATCH_TASK_IDLE;
+        };
+    }
+    dispatcher->schedule(&slow_task);
+    assert(wait_for([&slow_runs]() { return slow_runs == 1; }, 1000));
+    // queued behind the blocked worker or not, the other worker runs them
+    for (dispatch_task &task : fast_tasks) {
+        dispatcher->schedule(&task);
+    }
+    assert(wait_for([&fast_runs]() { return fast_runs == 4; }, 1000));
+    // scheduled while running, so it runs once more
+    dispatcher->schedule(&slow_task);
+    blocked = false;
+    assert(wait_for([&slow_runs]() { return slow_runs == 2; }, 1000));
+    delete dispatcher;
+}
+
+void test_callback_dispatcher_timer() {
+    SPDLOG_INFO("test_callback_dispatcher_timer");
+    log_flush();
+    callback_dispatcher *dispatcher = new callback_dispatcher(1);
+    std::atomic<int> runs = 0;
+    std::atomic<int> pending_runs = 0;
+    dispatch_task task;
+    task.run = [&runs]() {
+        runs++;
+        return DISPATCH_TASK_IDLE;
+    };
+    auto started_at = std::chrono::steady_clock::now();
+    dispatcher->schedule_at(&task, started_at + std::chrono::milliseconds(50));
+    assert(wait_for([&runs]() { return runs == 1; }, 1000));
+    assert(std::chrono::steady_clock::now() - started_at >= std::chrono::milliseconds(50));
+    // a cancelled timer doesn't run the task
+    dispatcher->schedule_at(&task, std::chrono::steady_clock::now() + std::chrono::milliseconds(20));
+    dispatcher->cancel(&task);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    assert(runs == 1);
+
+    // a task yielding with work left is run again
+    dispatch_task pending_task;
+    pending_task.run = [&pending_runs]() {
+        return ++pending_runs < 3 ? DISPATCH_TASK_PENDING : DISPATCH_TASK_IDLE;
+    };
+    dispatcher->schedule(&pending_task);
+    assert(wait_for([&pending_runs]() { return pending_runs == 3; }, 1000));
+
+    // a task freeing itself
+    std::atomic<bool> released = false;
+    dispatch_task *released_task = new dispatch_task();
+    released_task->run = [dispatcher, released_task, &released]() {
+        // the captures are freed with the task
+        std::atomic<bool> *done = &released;
+        dispatcher->cancel(released_task);
+        delete released_task;
+        *done = true;
+        return DISPATCH_TASK_RELEASED;
+    };
+    dispatcher->schedule(released_task);
+    assert(wait_for([&released]() { return released == true; }, 1000));
+    delete dispatcher;
+}
+
+void test_callback_dispatcher_shared() {
+    SPDLOG_INFO("test_callback_dispatcher_shared");
+    log_flush();
+    assert(callback_dispatcher::config_shared(2) == 0);
+    assert(callback_dispatcher::shared()->worker_count() == 2);
+    assert(callback_dispatcher::shared() == callback_dispatcher::shared());
+    // too late once started
+    assert(callback_dispatcher::config_shared(4) == 1);
+}
+
+int main() {
+    test_callback_dispatcher_order();
+    test_callback_dispatcher_stealing();
+    test_callback_dispatcher_timer();
+    test_callback_dispatcher_shared();
+    logging_cleanup();
+    return 0;
+}
@@ -2,6 +2,9 @@
 #include "frame_img_callback.h"
 #include <queue>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include "Windows.h"
 
 std::string test_token = "123";
@@ -20,10 +23,12 @@ scrcpy_rect original_img_size = scrcpy_rect {
 
 std::mutex global_lock;
 std::queue<bool> passed_flags;
+uint8_t *last_img_data = NULL;
 
 void frame_img_callback_handler(char *token, char *device_id, uint8_t *img_data, uint32_t img_data_len, scrcpy_rect img_size, scrcpy_rect orig_size) {
     std::lock_guard<std::mutex> lock(global_lock);
     got_msg_count ++;
+    last_img_data = img_data;
     SPDLOG_INFO("Got a frame image callback, token={}, device_id={}, img_data_len={}, img_size.width={}, img_size.height={}" 
             " orig_size.width={}, orig_size.height={}", 
             token ,device_id,
@@ -33,7 +38,7 @@ void frame_img_callback_handler(char *token, char *device_id, uint8_t *img_data,
     log_flush();
     auto is_correct = strcmp((char *)test_token.c_str(), token) == 0 &&
         strcmp((char *)test_device_id.c_str(), device_id) == 0 &&
-        strcmp((char *)&data, (char *)img_data) == 0 &&
+        memcmp(data, img_data, data_len) == 0 &&
         img_data_len == data_len && 
         img_size.width == current_img_size.width && img_size.height == current_img_size.height &&
         orig_size.width == original_img_size.width && orig_size.height == original_img_size.height;
@@ -125,12 +130,415 @@ void test_callback(frame_img_processor *processor) {
     log_flush();
     assert(got_msg_count == received_msg_count);
 }
+// a 4x2 nv12 frame with 8 bytes per row
+uint8_t raw_y_plane[16] = {1,2,3,4,0,0,0,0, 5,6,7,8,0,0,0,0};
+uint8_t raw_uv_plane[8] = {9,10,11,12,0,0,0,0};
+std::queue<bool> raw_passed_flags;
+
+void raw_frame_callback_handler(char *token, char *device_id, scrcpy_frame *frame, scrcpy_rect orig_size) {
+    std::lock_guard<std::mutex> lock(global_lock);
+    SPDLOG_INFO("Got a raw frame callback, token={}, device_id={}, format={}, size={}x{}, planes={}", token, device_id,
+            frame->format, frame->width, frame->height, frame->planes);
+    log_flush();
+    auto is_correct = strcmp((char *)test_token.c_str(), token) == 0 &&
+        strcmp((char *)test_device_id.c_str(), device_id) == 0 &&
+        frame->format == SCRCPY_PIXEL_FORMAT_NV12 && frame->width == 4 && frame->height == 2 && frame->planes == 2 &&
+        frame->linesize[0] == 8 && frame->linesize[1] == 8 &&
+        memcmp(frame->data[0], raw_y_plane, sizeof(raw_y_plane)) == 0 &&
+        memcmp(frame->data[1], raw_uv_plane, sizeof(raw_uv_plane)) == 0 &&
+        frame->dirty_rect_count == 1 && frame->dirty_rects[0].x == 2 && frame->dirty_rects[0].width == 2 &&
+        orig_size.width == original_img_size.width && orig_size.height == original_img_size.height;
+    assert(is_correct);
+    raw_passed_flags.push(is_correct);
+}
+
+void test_raw_callback(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    assert(processor->get_raw_format(device_id) == -1);
+
+    processor->add(device_id, frame_img_callback_handler, token);
+    processor->add_raw(device_id, SCRCPY_PIXEL_FORMAT_NV12, raw_frame_callback_handler, token);
+    assert(processor->get_raw_format(device_id) == SCRCPY_PIXEL_FORMAT_NV12);
+    assert(processor->has_handlers(device_id));
+
+    // removing png callbacks keeps the raw ones
+    processor->del_all(device_id);
+    assert(!processor->has_handlers(device_id));
+    assert(processor->get_raw_format(device_id) == SCRCPY_PIXEL_FORMAT_NV12);
+
+    scrcpy_frame frame = { SCRCPY_PIXEL_FORMAT_NV12, 4, 2, 2, { raw_y_plane, raw_uv_plane }, { 8, 8 }, 1, { { 2, 0, 2, 2 } } };
+    processor->invoke_raw(token, device_id, &frame, 200, 200);
+    bool got_result = false;
+    for (int i = 0; i < 10 && !got_result; i++) {
+        {
+            std::lock_guard<std::mutex> lock(global_lock);
+            got_result = !raw_passed_flags.empty();
+        }
+        if (!got_result) {
+            Sleep(100);
+        }
+    }
+    assert(got_result);
+    processor->del_all_raw(device_id);
+    assert(processor->get_raw_format(device_id) == -1);
+}
+std::atomic<int> ready_calls = 0;
+
+void test_ready_callback(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    auto received_msg_count = got_msg_count;
+    // set before the device has any callback
+    processor->set_ready_callback(device_id, [processor, token](char *ready_device_id) {
+        // send a frame from the callback thread on the first call only
+        if (ready_calls++ == 0) {
+            processor->invoke(token, ready_device_id, data, data_len, 100, 100, 200, 200);
+        }
+        return -1;
+    });
+    processor->add(device_id, frame_img_callback_handler, token);
+    Sleep(200);
+    // once idle and once more after the frame was delivered, not polled while waiting
+    assert(ready_calls == 2);
+    {
+        std::lock_guard<std::mutex> lock(global_lock);
+        assert(got_msg_count == received_msg_count + 1);
+    }
+    processor->request_ready(device_id);
+    Sleep(100);
+    assert(ready_calls == 3);
+    // called again after the ms it returned
+    processor->set_ready_callback(device_id, [](char *) {
+        ready_calls++;
+        return 20;
+    });
+    Sleep(200);
+    assert(ready_calls > 5 && ready_calls < 20);
+    // removing the callback waits for the call being made, so the objects it uses could be freed right after
+    std::atomic<bool> slow_ready_entered = false;
+    std::atomic<bool> slow_ready_done = false;
+    processor->set_ready_callback(device_id, [&slow_ready_entered, &slow_ready_done](char *) {
+        slow_ready_entered = true;
+        Sleep(100);
+        slow_ready_done = true;
+        return -1;
+    });
+    for (int i = 0; i < 100 && !slow_ready_entered; i++) {
+        Sleep(1);
+    }
+    assert(slow_ready_entered);
+    processor->set_ready_callback(device_id, NULL);
+    assert(slow_ready_done);
+    int calls = ready_calls;
+    Sleep(100);
+    assert(ready_calls == calls);
+    processor->del_all(device_id);
+}
+void test_image_handover(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    processor->add(device_id, frame_img_callback_handler, token);
+    uint32_t received_msg_count = 0;
+    {
+        std::lock_guard<std::mutex> lock(global_lock);
+        received_msg_count = got_msg_count;
+    }
+    std::vector<uint8_t> image(data, data + data_len);
+    uint8_t *image_data = image.data();
+    processor->invoke(token, device_id, &image, 100, 100, 200, 200);
+    // swapped with the buffer of a slot not used yet
+    assert(image.empty());
+    bool got_result = false;
+    for (int i = 0; i < 10 && !got_result; i++) {
+        {
+            std::lock_guard<std::mutex> lock(global_lock);
+            got_result = got_msg_count == received_msg_count + 1;
+        }
+        if (!got_result) {
+            Sleep(100);
+        }
+    }
+    assert(got_result);
+    {
+        // the handler got the sent buffer itself, not a copy
+        std::lock_guard<std::mutex> lock(global_lock);
+        assert(last_img_data == image_data);
+    }
+    processor->del_all(device_id);
+}
+std::atomic<int> slow_calls = 0;
+std::atomic<bool> slow_handler_blocked = true;
+
+void slow_frame_callback_handler(char *, char *, uint8_t *, uint32_t, scrcpy_rect, scrcpy_rect) {
+    slow_calls++;
+    while (slow_handler_blocked) {
+        Sleep(1);
+    }
+}
+
+void test_slow_callback(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    processor->add(device_id, slow_frame_callback_handler, token);
+    processor->invoke(token, device_id, data, data_len, 100, 100, 200, 200);
+    for (int i = 0; i < 100 && slow_calls == 0; i++) {
+        Sleep(10);
+    }
+    assert(slow_calls == 1);
+    // the handler is blocked, sending frames must not wait for it
+    auto started_at = std::chrono::steady_clock::now();
+    for (int i = 0; i < DEFAULT_PENDING_FRAMES * 4; i++) {
+        processor->invoke(token, device_id, data, data_len, 100, 100, 200, 200);
+    }
+    assert(std::chrono::steady_clock::now() - started_at < std::chrono::seconds(1));
+    slow_handler_blocked = false;
+    Sleep(200);
+    // the frame being delivered kept its slot, the other slots took the first frames, the rest were dropped
+    assert(slow_calls == DEFAULT_PENDING_FRAMES);
+    processor->del_all(device_id);
+}
+#define TEST_POLICY_DEPTH 3
+#define TEST_POLICY_FRAMES 10
+std::vector<int> policy_frames;
+std::atomic<bool> policy_handler_blocked = true;
+
+void policy_frame_callback_handler(char *, char *, uint8_t *, uint32_t, scrcpy_rect img_size, scrcpy_rect) {
+    {
+        // the frames are told apart by their width
+        std::lock_guard<std::mutex> lock(global_lock);
+        policy_frames.push_back(img_size.width);
+    }
+    while (policy_handler_blocked) {
+        Sleep(1);
+    }
+}
+
+/*
+ * send frames 2 to TEST_POLICY_FRAMES while the handler is blocked by frame 1
+ * @return the frames got by the handler
+ */
+static std::vector<int> run_delivery_policy(frame_img_processor *processor, int depth, int policy, pipeline_stats *stats) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    {
+        std::lock_guard<std::mutex> lock(global_lock);
+        policy_frames.clear();
+    }
+    policy_handler_blocked = true;
+    assert(processor->set_delivery_policy(device_id, depth, policy) == 0);
+    processor->add(device_id, policy_frame_callback_handler, token);
+    processor->invoke(token, device_id, data, data_len, 1, 100, 200, 200, stats);
+    bool delivering = false;
+    for (int i = 0; i < 100 && !delivering; i++) {
+        Sleep(10);
+        std::lock_guard<std::mutex> lock(global_lock);
+        delivering = policy_frames.size() == 1;
+    }
+    assert(delivering);
+    std::atomic<bool> sent = false;
+    std::thread sender([processor, token, device_id, stats, &sent]() {
+        for (int i = 2; i <= TEST_POLICY_FRAMES; i++) {
+            processor->invoke(token, device_id, data, data_len, i, 100, 200, 200, stats);
+        }
+        sent = true;
+    });
+    Sleep(100);
+    // only SCRCPY_DELIVERY_BLOCK waits for the handler
+    assert(sent == (policy != SCRCPY_DELIVERY_BLOCK));
+    policy_handler_blocked = false;
+    sender.join();
+    Sleep(200);
+    processor->del_all(device_id);
+    std::lock_guard<std::mutex> lock(global_lock);
+    return policy_frames;
+}
+
+void test_delivery_policy(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    assert(processor->set_delivery_policy(device_id, SCRCPY_DELIVERY_MAX_DEPTH + 1, SCRCPY_DELIVERY_DROP_NEWEST) == 1);
+    assert(processor->set_delivery_policy(device_id, TEST_POLICY_DEPTH, SCRCPY_DELIVERY_BLOCK + 1) == 1);
+    // nothing could wait besides the frame being delivered
+    assert(processor->set_delivery_policy(device_id, 1, SCRCPY_DELIVERY_DROP_OLDEST) == 1);
+    assert(processor->set_delivery_policy(device_id, 1, SCRCPY_DELIVERY_COALESCE) == 1);
+
+    // the queue keeps the first frames
+    pipeline_stats *stats = new pipeline_stats();
+    assert(run_delivery_policy(processor, TEST_POLICY_DEPTH, SCRCPY_DELIVERY_DROP_NEWEST, stats) == std::vector<int>({1, 2, 3}));
+    assert(stats->counter(PIPELINE_COUNTER_DROPPED_NEWEST) == 7 && stats->counter(PIPELINE_COUNTER_DROPPED_FRAMES) == 7);
+    delete stats;
+
+    // the queue keeps the last frames
+    stats = new pipeline_stats();
+    assert(run_delivery_policy(processor, TEST_POLICY_DEPTH, SCRCPY_DELIVERY_DROP_OLDEST, stats) == std::vector<int>({1, 9, 10}));
+    assert(stats->counter(PIPELINE_COUNTER_DROPPED_OLDEST) == 7 && stats->counter(PIPELINE_COUNTER_DROPPED_FRAMES) == 7);
+    delete stats;
+
+    // only the latest frame waits
+    stats = new pipeline_stats();
+    assert(run_delivery_policy(processor, TEST_POLICY_DEPTH, SCRCPY_DELIVERY_COALESCE, stats) == std::vector<int>({1, 10}));
+    assert(stats->counter(PIPELINE_COUNTER_COALESCED_FRAMES) == 8 && stats->counter(PIPELINE_COUNTER_DROPPED_FRAMES) == 8);
+    delete stats;
+
+    // every frame is delivered in order
+    stats = new pipeline_stats();
+    std::vector<int> all_frames;
+    for (int i = 1; i <= TEST_POLICY_FRAMES; i++) {
+        all_frames.push_back(i);
+    }
+    assert(run_delivery_policy(processor, TEST_POLICY_DEPTH, SCRCPY_DELIVERY_BLOCK, stats) == all_frames);
+    assert(stats->counter(PIPELINE_COUNTER_BLOCKED_FRAMES) > 0 && stats->counter(PIPELINE_COUNTER_DROPPED_FRAMES) == 0);
+    delete stats;
+
+    // only the frame being delivered is kept with a depth of 1
+    stats = new pipeline_stats();
+    assert(run_delivery_policy(processor, 1, SCRCPY_DELIVERY_DROP_NEWEST, stats) == std::vector<int>({1}));
+    assert(stats->counter(PIPELINE_COUNTER_DROPPED_NEWEST) == 9 && stats->counter(PIPELINE_COUNTER_DROPPED_FRAMES) == 9);
+    delete stats;
+    stats = new pipeline_stats();
+    assert(run_delivery_policy(processor, 1, SCRCPY_DELIVERY_BLOCK, stats) == all_frames);
+    assert(stats->counter(PIPELINE_COUNTER_BLOCKED_FRAMES) > 0 && stats->counter(PIPELINE_COUNTER_DROPPED_FRAMES) == 0);
+    delete stats;
+
+    assert(processor->set_delivery_policy(device_id, 0, SCRCPY_DELIVERY_DROP_NEWEST) == 0);
+}
+void test_wait_for_slot(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    // nothing to wait for without callbacks
+    assert(processor->wait_for_slot(device_id, 0));
+    {
+        std::lock_guard<std::mutex> lock(global_lock);
+        policy_frames.clear();
+    }
+    policy_handler_blocked = true;
+    assert(processor->set_delivery_policy(device_id, 1, SCRCPY_DELIVERY_BLOCK) == 0);
+    processor->add(device_id, policy_frame_callback_handler, token);
+    processor->invoke(token, device_id, data, data_len, 1, 100, 200, 200);
+    bool delivering = false;
+    for (int i = 0; i < 100 && !delivering; i++) {
+        Sleep(10);
+        std::lock_guard<std::mutex> lock(global_lock);
+        delivering = policy_frames.size() == 1;
+    }
+    assert(delivering);
+    // the only slot is taken by the frame being delivered
+    assert(!processor->wait_for_slot(device_id, 0));
+    assert(!processor->wait_for_slot(device_id, 50));
+    std::thread releaser([]() {
+        Sleep(100);
+        policy_handler_blocked = false;
+    });
+    assert(processor->wait_for_slot(device_id, -1));
+    releaser.join();
+    processor->del_all(device_id);
+    // the other policies never wait
+    policy_handler_blocked = true;
+    assert(processor->set_delivery_policy(device_id, 1, SCRCPY_DELIVERY_DROP_NEWEST) == 0);
+    processor->add(device_id, policy_frame_callback_handler, token);
+    processor->invoke(token, device_id, data, data_len, 1, 100, 200, 200);
+    Sleep(100);
+    assert(processor->wait_for_slot(device_id, 0));
+    policy_handler_blocked = false;
+    processor->del_all(device_id);
+    assert(processor->set_delivery_policy(device_id, 0, SCRCPY_DELIVERY_DROP_NEWEST) == 0);
+}
+void test_remove_while_writing(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    {
+        std::lock_guard<std::mutex> lock(global_lock);
+        policy_frames.clear();
+    }
+    policy_handler_blocked = true;
+    assert(processor->set_delivery_policy(device_id, TEST_POLICY_DEPTH, SCRCPY_DELIVERY_BLOCK) == 0);
+    processor->add(device_id, policy_frame_callback_handler, token);
+    std::atomic<int> sent = 0;
+    // 2 writers, one waits for a slot and the other waits for the write_lock
+    std::vector<std::thread> senders;
+    for (int i = 0; i < 2; i++) {
+        senders.emplace_back([processor, token, device_id, &sent]() {
+            for (int j = 1; j <= TEST_POLICY_FRAMES; j++) {
+                processor->invoke(token, device_id, data, data_len, j, 100, 200, 200);
+                sent++;
+            }
+        });
+    }
+    Sleep(100);
+    assert(sent < TEST_POLICY_FRAMES * 2);
+    // the container is released by the last writer once the delivering task stopped
+    processor->del_all(device_id);
+    for (auto &sender : senders) {
+        sender.join();
+    }
+    assert(sent == TEST_POLICY_FRAMES * 2);
+    policy_handler_blocked = false;
+    Sleep(100);
+    assert(processor->set_delivery_policy(device_id, 0, SCRCPY_DELIVERY_DROP_NEWEST) == 0);
+}
+std::vector<int> dirty_rect_counts;
+std::vector<scrcpy_area> first_dirty_rects;
+
+void dirty_rects_callback_handler(char *, char *, scrcpy_frame *frame, scrcpy_rect) {
+    {
+        std::lock_guard<std::mutex> lock(global_lock);
+        dirty_rect_counts.push_back(frame->dirty_rect_count);
+        first_dirty_rects.push_back(frame->dirty_rects[0]);
+    }
+    while (policy_handler_blocked) {
+        Sleep(1);
+    }
+}
+void test_dirty_rects_after_drop(frame_img_processor *processor) {
+    char *device_id = (char *)test_device_id.c_str();
+    char *token = (char *)test_token.c_str();
+    {
+        std::lock_guard<std::mutex> lock(global_lock);
+        dirty_rect_counts.clear();
+        first_dirty_rects.clear();
+    }
+    policy_handler_blocked = true;
+    assert(processor->set_delivery_policy(device_id, 2, SCRCPY_DELIVERY_DROP_NEWEST) == 0);
+    processor->add_raw(device_id, SCRCPY_PIXEL_FORMAT_NV12, dirty_rects_callback_handler, token);
+    // only the tile at x=2 changed in each frame
+    scrcpy_frame frame = { SCRCPY_PIXEL_FORMAT_NV12, 4, 2, 2, { raw_y_plane, raw_uv_plane }, { 8, 8 }, 1, { { 2, 0, 2, 2 } } };
+    processor->invoke_raw(token, device_id, &frame, 200, 200);
+    bool delivering = false;
+    for (int i = 0; i < 100 && !delivering; i++) {
+        Sleep(10);
+        std::lock_guard<std::mutex> lock(global_lock);
+        delivering = dirty_rect_counts.size() == 1;
+    }
+    assert(delivering);
+    // the second one waits, the third one is dropped
+    processor->invoke_raw(token, device_id, &frame, 200, 200);
+    processor->invoke_raw(token, device_id, &frame, 200, 200);
+    policy_handler_blocked = false;
+    Sleep(200);
+    // sent after the drop, the change of the dropped frame has to be reported too
+    processor->invoke_raw(token, device_id, &frame, 200, 200);
+    Sleep(200);
+    processor->del_all_raw(device_id);
+    std::lock_guard<std::mutex> lock(global_lock);
+    assert(dirty_rect_counts == std::vector<int>({1, 1, 1}));
+    assert(first_dirty_rects[0].x == 2 && first_dirty_rects[1].x == 2);
+    assert(first_dirty_rects[2].x == 0 && first_dirty_rects[2].width == 4 && first_dirty_rects[2].height == 2);
+    assert(processor->set_delivery_policy(device_id, 0, SCRCPY_DELIVERY_DROP_NEWEST) == 0);
+}
 int main() {
     SPDLOG_INFO("test_utils");
     log_flush();
     frame_img_processor *img_processor = new frame_img_processor();
     test_setup_callback(img_processor);
     test_callback(img_processor);
+    test_raw_callback(img_processor);
+    test_ready_callback(img_processor);
+    test_image_handover(img_processor);
+    test_slow_callback(img_processor);
+    test_delivery_policy(img_processor);
+    test_wait_for_slot(img_processor);
+    test_remove_while_writing(img_processor);
+    test_dirty_rects_after_drop(img_processor);
     delete img_processor;
     // wait the callback thread to shutdown
     Sleep(100);
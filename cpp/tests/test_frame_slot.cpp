@@ -0,0 +1,107 @@
+#include "frame_slot.h"
+#include "assert.h"
+#include "logging.h"
+#include <string.h>
+#include <thread>
+
+#define TEST_FRAME_COUNT 1000
+
+void test_frame_slot_wait() {
+    SPDLOG_INFO("test_frame_slot_wait");
+    log_flush();
+    frame_slot *slot = new frame_slot();
+    uint8_t buffer[8] = {0};
+    scrcpy_frame_info info = {};
+    // nothing yet
+    assert(slot->wait_next(0, 0, buffer, sizeof(buffer), &info) == SCRCPY_WAIT_FRAME_TIMEOUT);
+    assert(slot->wait_next(0, 10, buffer, sizeof(buffer), &info) == SCRCPY_WAIT_FRAME_TIMEOUT);
+
+    uint8_t first[] = {1, 2, 3};
+    uint8_t second[] = {4, 5, 6, 7};
+    slot->put(first, sizeof(first), 10, 20, 100, 200);
+    slot->put(second, sizeof(second), 10, 20, 100, 200);
+    // the first frame was replaced
+    assert(slot->wait_next(0, 0, buffer, sizeof(buffer), &info) == SCRCPY_WAIT_FRAME_OK);
+    assert(info.seq == 2 && info.size == sizeof(second) && memcmp(buffer, second, sizeof(second)) == 0);
+    assert(info.img_size.width == 10 && info.img_size.height == 20);
+    assert(info.orig_size.width == 100 && info.orig_size.height == 200);
+    assert(slot->wait_next(info.seq, 0, buffer, sizeof(buffer), &info) == SCRCPY_WAIT_FRAME_TIMEOUT);
+
+    // the frame is kept for a bigger buffer
+    slot->put(first, sizeof(first), 10, 20, 100, 200);
+    assert(slot->wait_next(2, 0, buffer, 2, &info) == SCRCPY_WAIT_FRAME_BUFFER_TOO_SMALL);
+    assert(info.seq == 3 && info.size == sizeof(first));
+    assert(slot->wait_next(2, 0, buffer, sizeof(buffer), &info) == SCRCPY_WAIT_FRAME_OK);
+    assert(memcmp(buffer, first, sizeof(first)) == 0);
+
+    // closing wakes up a waiter without timeout
+    std::thread waiter([slot]() {
+        uint8_t out[8];
+        assert(slot->wait_next(3, -1, out, sizeof(out), NULL) == SCRCPY_WAIT_FRAME_CLOSED);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    slot->close();
+    waiter.join();
+    delete slot;
+}
+
+void test_frame_slot_threads() {
+    SPDLOG_INFO("test_frame_slot_threads");
+    log_flush();
+    frame_slot *slot = new frame_slot();
+    std::thread producer([slot]() {
+        for (uint32_t i = 1; i <= TEST_FRAME_COUNT; i++) {
+            slot->put((uint8_t *)&i, sizeof(i), 1, 1, 1, 1);
+        }
+    });
+    uint64_t last_seq = 0;
+    uint32_t value = 0;
+    int frames = 0;
+    while (last_seq < TEST_FRAME_COUNT) {
+        scrcpy_frame_info info = {};
+        int status = slot->wait_next(last_seq, 1000, (uint8_t *)&value, sizeof(value), &info);
+        assert(status == SCRCPY_WAIT_FRAME_OK);
+        // always newer, the content matches the seq
+        assert(info.seq > last_seq && value == info.seq);
+        last_seq = info.seq;
+        frames++;
+    }
+    producer.join();
+    SPDLOG_INFO("Got {} of {} frames", frames, TEST_FRAME_COUNT);
+    assert(frames > 0 && frames <= TEST_FRAME_COUNT);
+    delete slot;
+}
+
+void test_frame_slot_idle() {
+    SPDLOG_INFO("test_frame_slot_idle");
+    log_flush();
+    uint8_t first[] = {1, 2, 3};
+    // continues the seq of an idle slot removed
+    frame_slot *slot = new frame_slot(5);
+    assert(!slot->is_idle());
+    slot->put(first, sizeof(first), 10, 20, 100, 200);
+    assert(slot->last_seq() == 6);
+    std::this_thread::sleep_for(std::chrono::milliseconds(FRAME_SLOT_IDLE_MS + 50));
+    assert(slot->is_idle());
+
+    // never idle while a thread is waiting
+    std::thread waiter([slot]() {
+        uint8_t out[8];
+        assert(slot->wait_next(6, -1, out, sizeof(out), NULL) == SCRCPY_WAIT_FRAME_OK);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(FRAME_SLOT_IDLE_MS + 50));
+    assert(!slot->is_idle());
+    slot->put(first, sizeof(first), 10, 20, 100, 200);
+    waiter.join();
+    // nor right after a call returned
+    assert(!slot->is_idle());
+    delete slot;
+}
+
+int main() {
+    test_frame_slot_wait();
+    test_frame_slot_threads();
+    test_frame_slot_idle();
+    logging_cleanup();
+    return 0;
+}
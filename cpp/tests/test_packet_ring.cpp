@@ -0,0 +1,96 @@
+#include "packet_ring.h"
+#include "assert.h"
+#include "logging.h"
+#include <string.h>
+#include <thread>
+
+#define TEST_RING_SIZE 4
+#define TEST_PACKET_COUNT 10000
+
+void test_packet_ring_bounds() {
+    SPDLOG_INFO("test_packet_ring_bounds");
+    log_flush();
+    packet_ring *ring = new packet_ring(TEST_RING_SIZE);
+    assert(ring->depth() == 0);
+    assert(ring->try_acquire_read() == NULL);
+    for (int i = 0; i < TEST_RING_SIZE; i++) {
+        packet_ring_slot *slot = ring->try_acquire_write();
+        assert(slot != NULL);
+        assert(ring->reserve(slot, 100) == 0);
+        assert(slot->buffer->size >= 100 + AV_INPUT_BUFFER_PADDING_SIZE);
+        assert(slot->data[100] == 0 && slot->data[100 + AV_INPUT_BUFFER_PADDING_SIZE - 1] == 0);
+        slot->pts = i;
+        slot->length = 100;
+        ring->commit_write();
+    }
+    // full now
+    assert(ring->depth() == TEST_RING_SIZE);
+    assert(ring->try_acquire_write() == NULL);
+    packet_ring_slot *slot = ring->try_acquire_read();
+    assert(slot != NULL && slot->pts == 0);
+    ring->commit_read();
+    assert(ring->depth() == TEST_RING_SIZE - 1);
+    assert(ring->try_acquire_write() != NULL);
+    // bytes kept when growing a slot
+    packet_ring_slot *grow_slot = ring->try_acquire_write();
+    assert(ring->reserve(grow_slot, 4) == 0);
+    memcpy(grow_slot->data, "sps!", 4);
+    assert(ring->reserve(grow_slot, PACKET_RING_SLOT_GROW_SIZE * 2, 4) == 0);
+    assert(memcmp(grow_slot->data, "sps!", 4) == 0);
+    // a buffer still referenced elsewhere is not overwritten
+    AVBufferRef *decoder_ref = av_buffer_ref(grow_slot->buffer);
+    assert(ring->reserve(grow_slot, 4, 4) == 0);
+    assert(grow_slot->buffer->data != decoder_ref->data);
+    assert(memcmp(grow_slot->data, "sps!", 4) == 0);
+    av_buffer_unref(&decoder_ref);
+    // packets written before closing could still be read
+    ring->close();
+    assert(ring->is_closed());
+    assert(ring->acquire_write() == NULL);
+    for (int i = 1; i < TEST_RING_SIZE; i++) {
+        slot = ring->acquire_read();
+        assert(slot != NULL && slot->pts == i);
+        ring->commit_read();
+    }
+    assert(ring->acquire_read() == NULL);
+    delete ring;
+}
+
+void test_packet_ring_threads() {
+    SPDLOG_INFO("test_packet_ring_threads");
+    log_flush();
+    packet_ring *ring = new packet_ring(TEST_RING_SIZE);
+    std::thread producer([ring]() {
+        for (int i = 0; i < TEST_PACKET_COUNT; i++) {
+            packet_ring_slot *slot = ring->acquire_write();
+            assert(slot != NULL);
+            int length = (i % 7 + 1) * 1024;
+            assert(ring->reserve(slot, length) == 0);
+            memset(slot->data, i % 128, length);
+            slot->pts = i;
+            slot->length = length;
+            ring->commit_write();
+        }
+        ring->close();
+    });
+    int received = 0;
+    packet_ring_slot *slot = NULL;
+    while ((slot = ring->acquire_read()) != NULL) {
+        assert(slot->pts == (uint64_t)received);
+        assert(slot->length == (received % 7 + 1) * 1024);
+        assert(slot->data[0] == received % 128 && slot->data[slot->length - 1] == received % 128);
+        ring->commit_read();
+        received++;
+    }
+    producer.join();
+    SPDLOG_INFO("received {} packets", received);
+    log_flush();
+    assert(received == TEST_PACKET_COUNT);
+    delete ring;
+}
+
+int main() {
+    test_packet_ring_bounds();
+    test_packet_ring_threads();
+    return 0;
+}
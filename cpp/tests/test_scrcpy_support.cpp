@@ -48,7 +48,7 @@ scrcpy_listener_t s_svr = NULL;
 
 class scrcpy_support_tester{
 public:
-    scrcpy_support_tester(std::string video_file):m_video_file_path(video_file) {
+    scrcpy_support_tester(std::string video_file, bool async_io = false):m_video_file_path(video_file), m_async_io(async_io) {
 
     }
     ~scrcpy_support_tester() {
@@ -67,6 +67,17 @@ public:
                 register_all_events();
                 unregister_all_events();
                 unregister_all_events();
+                assert(scrcpy_set_output_format(this->listener, (char *)TEST_RECV_DEVICE_ID, SCRCPY_OUTPUT_FORMAT_JPEG, 80) == 0);
+                assert(scrcpy_set_output_format(this->listener, (char *)TEST_RECV_DEVICE_ID, -1, 80) == 1);
+                assert(scrcpy_set_decoder_profile(this->listener, (char *)TEST_RECV_DEVICE_ID, SCRCPY_DECODER_PROFILE_LOW_LATENCY) == 0);
+                assert(scrcpy_set_decoder_profile(this->listener, (char *)TEST_RECV_DEVICE_ID, 100) == 1);
+                assert(scrcpy_set_default_decoder_profile(this->listener, -1) == 1);
+                // no device connected yet
+                scrcpy_frame_info snapshot_info = {};
+                assert(scrcpy_capture_snapshot(this->listener, (char *)TEST_RECV_DEVICE_ID, 0, 0, -1, -1, NULL, 0,
+                            &snapshot_info) == SCRCPY_SNAPSHOT_NO_FRAME);
+                assert(scrcpy_capture_snapshot(this->listener, (char *)TEST_RECV_DEVICE_ID, 0, 0, 100, -1, NULL, 0,
+                            &snapshot_info) == SCRCPY_SNAPSHOT_FAILED);
         });
 
         // step 02: start receiver, register calblack, 
@@ -134,6 +145,7 @@ private:
     scrcpy_listener_t listener = NULL;
     std::mutex m_svr_lock;
     std::string m_video_file_path;
+    bool m_async_io = false;
     volatile int m_svr_status = TEST_RECV_STATUS_STOPPED;
     bool wait_for_result(char *label, std::queue<bool> *q, std::mutex& lock, int time_seconds = 10, int min_size = 1) {
         int sleep_ms = 100;
@@ -242,6 +254,9 @@ private:
         auto token = (char *)TEST_RECV_TOKEN;
         this->listener = scrcpy_new_receiver(token);
         assert(this->listener);
+        if (this->m_async_io) {
+            scrcpy_enable_async_io(this->listener, 0);
+        }
         std::thread t(&scrcpy_support_tester::receiver_thread_entry, this);
         t.detach();
 
@@ -549,6 +564,13 @@ int main(int argc, char *argv[]) {
     std::this_thread::sleep_for(std::chrono::seconds(2));
     delete tester;
 
+    SPDLOG_INFO("Running test_scrcpy_support again with async io");
+    log_flush();
+    tester = new scrcpy_support_tester(std::string(video_file), true);
+    tester->do_test();
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    delete tester;
+
     SPDLOG_INFO("Finished running test_scrcpy_support");
     log_flush();
     return 0;
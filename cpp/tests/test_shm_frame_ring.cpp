@@ -0,0 +1,159 @@
+#include "shm_frame_ring.h"
+#include "assert.h"
+#include "logging.h"
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define TEST_RING_NAME "Local\\scrcpy_recv_test_shm_frame_ring"
+#define TEST_READ_FRAMES 200
+#define TEST_FRAME_SIZE 4096
+
+/*
+ * read the newest frame like a consumer in another process would, copying it out only for checking
+ * @return the seq of the frame, 0 if the slot was being written
+ */
+static uint64_t read_latest(uint8_t *base, scrcpy_shm_slot_header *out_header, std::vector<uint8_t> *out_data) {
+    scrcpy_shm_ring_header *header = (scrcpy_shm_ring_header *)base;
+    assert(std::atomic_ref<uint32_t>(header->magic).load(std::memory_order_acquire) == SCRCPY_SHM_RING_MAGIC);
+    uint64_t seq = std::atomic_ref<uint64_t>(header->last_seq).load(std::memory_order_acquire);
+    if (seq == 0) {
+        return 0;
+    }
+    scrcpy_shm_slot_header *slot = (scrcpy_shm_slot_header *)(base + SCRCPY_SHM_RING_HEADER_SIZE +
+            (uint64_t)header->slot_stride * ((seq - 1) % header->slot_count));
+    uint64_t lock = std::atomic_ref<uint64_t>(slot->lock).load(std::memory_order_acquire);
+    if (lock & 1) {
+        return 0;
+    }
+    *out_header = *slot;
+    uint32_t size = out_header->size > header->slot_size ? header->slot_size : out_header->size;
+    out_data->assign((uint8_t *)slot + SCRCPY_SHM_SLOT_HEADER_SIZE, (uint8_t *)slot + SCRCPY_SHM_SLOT_HEADER_SIZE + size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (std::atomic_ref<uint64_t>(slot->lock).load(std::memory_order_relaxed) != lock) {
+        return 0;
+    }
+    return lock / 2;
+}
+
+void test_shm_frame_ring_publish() {
+    SPDLOG_INFO("test_shm_frame_ring_publish");
+    log_flush();
+    shm_frame_ring *ring = new shm_frame_ring();
+    assert(ring->open(TEST_RING_NAME, 0, 16) != 0);
+    assert(ring->open(TEST_RING_NAME, 2, 16) == 0);
+    assert(ring->last_seq() == 0);
+
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, TEST_RING_NAME);
+    assert(mapping);
+    uint8_t *base = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    assert(base);
+    scrcpy_shm_ring_header *header = (scrcpy_shm_ring_header *)base;
+    assert(header->version == SCRCPY_SHM_RING_VERSION && header->slot_count == 2 && header->slot_size == 16);
+    assert(header->slot_stride % 64 == 0 && header->slot_stride >= SCRCPY_SHM_SLOT_HEADER_SIZE + 16);
+
+    scrcpy_shm_slot_header slot = {};
+    std::vector<uint8_t> data;
+    assert(read_latest(base, &slot, &data) == 0);
+
+    uint8_t image[] = {1, 2, 3, 4, 5};
+    assert(ring->publish_image(SCRCPY_OUTPUT_FORMAT_JPEG, image, sizeof(image), 10, 20, 100, 200) == 0);
+    assert(read_latest(base, &slot, &data) == 1);
+    assert(slot.kind == SCRCPY_SHM_FRAME_IMAGE && slot.format == SCRCPY_OUTPUT_FORMAT_JPEG);
+    assert(slot.width == 10 && slot.height == 20 && slot.screen_width == 100 && slot.screen_height == 200);
+    assert(data.size() == sizeof(image) && memcmp(data.data(), image, sizeof(image)) == 0);
+
+    // a frame bigger than a slot is not published
+    uint8_t big[17] = {0};
+    assert(ring->publish_image(SCRCPY_OUTPUT_FORMAT_PNG, big, sizeof(big), 1, 1, 1, 1) == 1);
+    assert(ring->last_seq() == 1);
+
+    // nv12 4x2 with a linesize of 4: 8 bytes of luma, 4 bytes of chroma in a row
+    uint8_t luma[8] = {1, 1, 1, 1, 2, 2, 2, 2};
+    uint8_t chroma[4] = {3, 3, 3, 3};
+    scrcpy_frame frame = {};
+    frame.format = SCRCPY_PIXEL_FORMAT_NV12;
+    frame.width = 4;
+    frame.height = 2;
+    frame.planes = 2;
+    frame.data[0] = luma;
+    frame.data[1] = chroma;
+    frame.linesize[0] = 4;
+    frame.linesize[1] = 4;
+    assert(ring->publish_raw(&frame, 100, 200) == 0);
+    assert(read_latest(base, &slot, &data) == 2);
+    assert(slot.kind == SCRCPY_SHM_FRAME_RAW && slot.format == SCRCPY_PIXEL_FORMAT_NV12 && slot.planes == 2);
+    assert(slot.size == 12 && slot.plane_offset[0] == 0 && slot.plane_offset[1] == 8);
+    assert(slot.linesize[0] == 4 && slot.linesize[1] == 4);
+    assert(memcmp(data.data(), luma, 8) == 0 && memcmp(data.data() + 8, chroma, 4) == 0);
+
+    // the third frame wraps around into the first slot
+    assert(ring->publish_image(SCRCPY_OUTPUT_FORMAT_PNG, image, 3, 1, 1, 1, 1) == 0);
+    assert(read_latest(base, &slot, &data) == 3);
+    assert(slot.lock == 6 && data.size() == 3);
+    scrcpy_shm_slot_header *first_slot = (scrcpy_shm_slot_header *)(base + SCRCPY_SHM_RING_HEADER_SIZE);
+    assert(first_slot->lock == 6);
+
+    UnmapViewOfFile(base);
+    CloseHandle(mapping);
+    delete ring;
+}
+
+void test_shm_frame_ring_threads() {
+    SPDLOG_INFO("test_shm_frame_ring_threads");
+    log_flush();
+    shm_frame_ring *ring = new shm_frame_ring();
+    assert(ring->open(TEST_RING_NAME, 3, TEST_FRAME_SIZE) == 0);
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, TEST_RING_NAME);
+    assert(mapping);
+    uint8_t *base = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    assert(base);
+
+    std::atomic<int> frames = 0;
+    // keeps overwriting the slots until the reader got enough frames
+    std::thread producer([ring, &frames]() {
+        std::vector<uint8_t> image(TEST_FRAME_SIZE);
+        for (uint32_t i = 1; frames < TEST_READ_FRAMES; i++) {
+            // every byte tells the frame, so a torn read shows up as mixed bytes
+            memset(image.data(), (uint8_t)i, image.size());
+            uint32_t size = TEST_FRAME_SIZE - (i % 64);
+            assert(ring->publish_image(SCRCPY_OUTPUT_FORMAT_PNG, image.data(), size, (int)i, 1, 1, 1) == 0);
+        }
+    });
+    scrcpy_shm_slot_header slot = {};
+    std::vector<uint8_t> data;
+    uint64_t last_seq = 0;
+    int retries = 0;
+    while (frames < TEST_READ_FRAMES) {
+        uint64_t seq = read_latest(base, &slot, &data);
+        if (seq == 0) {
+            retries++;
+            continue;
+        }
+        assert(seq >= last_seq);
+        if (seq == last_seq) {
+            continue;
+        }
+        // consistent header and data of the same frame
+        assert(slot.width == (int)seq && slot.size == TEST_FRAME_SIZE - (seq % 64) && data.size() == slot.size);
+        for (uint8_t value : data) {
+            assert(value == (uint8_t)seq);
+        }
+        last_seq = seq;
+        frames++;
+    }
+    producer.join();
+    SPDLOG_INFO("Read {} of {} frames, {} retries", (int)frames, last_seq, retries);
+    assert(ring->last_seq() >= last_seq);
+    UnmapViewOfFile(base);
+    CloseHandle(mapping);
+    delete ring;
+}
+
+int main() {
+    test_shm_frame_ring_publish();
+    test_shm_frame_ring_threads();
+    logging_cleanup();
+    return 0;
+}
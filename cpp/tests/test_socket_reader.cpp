@@ -0,0 +1,98 @@
+#include "socket_reader.h"
+#include "assert.h"
+#include "logging.h"
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "boost/asio.hpp"
+
+#define TEST_READER_BUFFER_SIZE 64 * 1024
+#define TEST_HEADER_SIZE 12
+#define TEST_PACKET_COUNT 200
+// about 28 KB of small packets, well below the default socket buffers, so they're sent before being read
+#define TEST_SMALL_PACKET_COUNT 40
+
+/*
+ * fake scrcpy packets, a 12 bytes header with the packet index and length, then the payload filled with the index
+ * @param big_packets   add a big packet bypassing the buffer every 50 packets
+ */
+std::vector<char>* make_packets(int count, bool big_packets) {
+    std::vector<char> *packets = new std::vector<char>();
+    for (int i = 0; i < count; i++) {
+        // small p-frames mostly, with a big one bypassing the buffer sometimes
+        int length = big_packets && i % 50 == 0 ? TEST_READER_BUFFER_SIZE * 3 : (i % 13 + 1) * 100;
+        char header[TEST_HEADER_SIZE] = {0};
+        memcpy(header, &i, sizeof(int));
+        memcpy(header + 8, &length, sizeof(int));
+        packets->insert(packets->end(), header, header + TEST_HEADER_SIZE);
+        packets->insert(packets->end(), length, (char)(i % 128));
+    }
+    return packets;
+}
+
+void send_packets(uint16_t port, std::vector<char> *packets, int piece_size) {
+    boost::asio::io_context io_context;
+    tcp::socket socket(io_context);
+    socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+    size_t sent = 0;
+    while (sent < packets->size()) {
+        size_t piece = std::min((size_t)piece_size, packets->size() - sent);
+        boost::asio::write(socket, boost::asio::buffer(packets->data() + sent, piece));
+        sent += piece;
+    }
+    socket.shutdown(tcp::socket::shutdown_both);
+    socket.close();
+}
+
+/*
+ * @param big_packets   the stream is bigger than the socket buffers then, so it's read while being sent
+ */
+void test_socket_reader_packets(int piece_size, int count, bool big_packets) {
+    SPDLOG_INFO("test_socket_reader_packets piece_size={} count={} big_packets={}", piece_size, count, big_packets);
+    log_flush();
+    std::vector<char> *packets = make_packets(count, big_packets);
+    boost::asio::io_context io_context;
+    tcp::acceptor acceptor(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    auto socket = boost::shared_ptr<tcp::socket>(new tcp::socket(io_context));
+    std::thread sender(send_packets, acceptor.local_endpoint().port(), packets, piece_size);
+    acceptor.accept(*socket);
+    if (!big_packets) {
+        // let the whole stream arrive, so reads could be coalesced
+        sender.join();
+    }
+
+    socket_reader *reader = new socket_reader(socket, TEST_READER_BUFFER_SIZE);
+    std::vector<char> payload(TEST_READER_BUFFER_SIZE * 3);
+    char header[TEST_HEADER_SIZE];
+    for (int i = 0; i < count; i++) {
+        assert(reader->read(header, TEST_HEADER_SIZE) == 0);
+        int index = 0;
+        int length = 0;
+        memcpy(&index, header, sizeof(int));
+        memcpy(&length, header + 8, sizeof(int));
+        assert(index == i);
+        assert(reader->read(payload.data(), length) == 0);
+        assert(payload[0] == (char)(i % 128) && payload[length - 1] == (char)(i % 128));
+    }
+    SPDLOG_INFO("{} packets read with {} socket reads", count, reader->read_calls());
+    log_flush();
+    if (big_packets) {
+        // the sender could only finish once the stream was drained
+        sender.join();
+    } else {
+        assert(reader->read_calls() < count);
+    }
+    assert(reader->buffered() == 0);
+    // the sender has closed the connection
+    assert(reader->read(header, TEST_HEADER_SIZE) != 0);
+    delete reader;
+    delete packets;
+}
+
+int main() {
+    test_socket_reader_packets(1024 * 1024, TEST_SMALL_PACKET_COUNT, false);
+    test_socket_reader_packets(7, TEST_SMALL_PACKET_COUNT, false);
+    test_socket_reader_packets(1024 * 1024, TEST_PACKET_COUNT, true);
+    test_socket_reader_packets(7, TEST_PACKET_COUNT, true);
+    return 0;
+}
@@ -61,6 +61,95 @@ void test_array_copy_to() {
     assert(strcmp(a_str.c_str(), b_str_oroginal.c_str()) != 0);
 }
 
+void test_h264_has_idr() {
+    SPDLOG_INFO("test_h264_has_idr");
+    log_flush();
+    assert(!h264_has_idr(NULL, 0));
+    // sps, pps then an idr slice
+    char config_and_idr[] = {0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x00, 0x00, 0x01, 0x68, 0x11,
+        0x00, 0x00, 0x01, 0x65, (char)0x88};
+    assert(h264_has_idr(config_and_idr, sizeof(config_and_idr)));
+    // a non-idr slice
+    char slice[] = {0x00, 0x00, 0x00, 0x01, 0x41, (char)0x9A, 0x00, 0x65};
+    assert(!h264_has_idr(slice, sizeof(slice)));
+    // start code at the end without a nal header
+    char truncated[] = {0x41, 0x00, 0x00, 0x01};
+    assert(!h264_has_idr(truncated, sizeof(truncated)));
+}
+void test_hash_plane() {
+    SPDLOG_INFO("test_hash_plane");
+    log_flush();
+    // 4 rows of 40 bytes(2 blocks and a tail) with 8 bytes padding
+    const int linesize = 48;
+    const int row_bytes = 40;
+    const int rows = 4;
+    uint8_t plane[linesize * rows];
+    for (int i = 0; i < (int)sizeof(plane); i++) {
+        plane[i] = (uint8_t)(i * 7);
+    }
+    assert(hash_plane(123, NULL, linesize, row_bytes, rows) == 123);
+    uint64_t hash = hash_plane(0, plane, linesize, row_bytes, rows);
+    assert(hash == hash_plane(0, plane, linesize, row_bytes, rows));
+    assert(hash != hash_plane(1, plane, linesize, row_bytes, rows));
+
+    // padding is ignored
+    uint8_t copy[linesize * rows];
+    memcpy(copy, plane, sizeof(plane));
+    copy[linesize + row_bytes] ^= 0xFF;
+    assert(hash == hash_plane(0, copy, linesize, row_bytes, rows));
+    // a changed pixel within a block or the tail
+    memcpy(copy, plane, sizeof(plane));
+    copy[linesize * 2 + 5] ^= 1;
+    assert(hash != hash_plane(0, copy, linesize, row_bytes, rows));
+    memcpy(copy, plane, sizeof(plane));
+    copy[linesize * 3 + row_bytes - 1] ^= 1;
+    assert(hash != hash_plane(0, copy, linesize, row_bytes, rows));
+    // swapped rows
+    memcpy(copy, plane, sizeof(plane));
+    memcpy(copy, plane + linesize, linesize);
+    memcpy(copy + linesize, plane, linesize);
+    assert(hash != hash_plane(0, copy, linesize, row_bytes, rows));
+    // swapped blocks of a row
+    memcpy(copy, plane, sizeof(plane));
+    memcpy(copy, plane + 16, 16);
+    memcpy(copy + 16, plane, 16);
+    assert(hash != hash_plane(0, copy, linesize, row_bytes, rows));
+}
+void test_diff_tiles() {
+    SPDLOG_INFO("test_diff_tiles");
+    log_flush();
+    // 10x7 plane with 12 bytes per row, 4x4 tiles
+    const int linesize = 12;
+    const int width = 10;
+    const int height = 7;
+    uint8_t prev[linesize * height] = {0};
+    uint8_t cur[linesize * height] = {0};
+    scrcpy_area rects[4];
+    assert(diff_tiles(prev, linesize, cur, linesize, width, height, 4, rects, 4) == 0);
+    // padding is ignored
+    cur[width] = 1;
+    assert(diff_tiles(prev, linesize, cur, linesize, width, height, 4, rects, 4) == 0);
+
+    // a column of changed tiles in both tile rows is merged
+    cur[1 * linesize + 5] = 1;
+    cur[6 * linesize + 4] = 1;
+    assert(diff_tiles(prev, linesize, cur, linesize, width, height, 4, rects, 4) == 1);
+    assert(rects[0].x == 4 && rects[0].y == 0 && rects[0].width == 4 && rects[0].height == 7);
+
+    // the partial tile at the right edge is clipped, and not merged with a wider run
+    cur[0 * linesize + 9] = 1;
+    assert(diff_tiles(prev, linesize, cur, linesize, width, height, 4, rects, 4) == 2);
+    assert(rects[0].x == 4 && rects[0].y == 0 && rects[0].width == 6 && rects[0].height == 4);
+    assert(rects[1].x == 4 && rects[1].y == 4 && rects[1].width == 4 && rects[1].height == 3);
+
+    // adjacent changed tiles make a single run
+    cur[6 * linesize + 0] = 1;
+    assert(diff_tiles(prev, linesize, cur, linesize, width, height, 4, rects, 4) == 2);
+    assert(rects[1].x == 0 && rects[1].y == 4 && rects[1].width == 8 && rects[1].height == 3);
+    // the bounding box if there are more rectangles than wanted
+    assert(diff_tiles(prev, linesize, cur, linesize, width, height, 4, rects, 1) == 1);
+    assert(rects[0].x == 0 && rects[0].y == 0 && rects[0].width == 10 && rects[0].height == 7);
+}
 int main() {
     SPDLOG_INFO("test_utils");
     log_flush();
@@ -68,6 +157,9 @@ int main() {
     test_to_long();
     test_to_int();
     test_array_copy_to();
+    test_h264_has_idr();
+    test_hash_plane();
+    test_diff_tiles();
     logging_cleanup();
     return 0;
 }
@@ -10,6 +10,7 @@ package go_scrcpy_recv
 #include <stdint.h>
 
 extern void c_goScrcpyFrameImageCallback(char *token, char *device_id, uint8_t * img_data, uint32_t img_data_len, scrcpy_rect img_size, scrcpy_rect screen_size);
+extern void c_goScrcpyRawFrameCallback(char *token, char *device_id, scrcpy_frame *frame, scrcpy_rect screen_size);
 extern void c_goScrcpyDeviceInfoCallback(char *token, char *device_id, int width, int height);
 extern void c_goScrcpyCtrlSendCallback(char *token, char *device_id, char *msg_id, int status, int data_len);
 void c_goScrcpyDeviceDisconnectedCallback(char *token, char *device_id, char *con_type);
@@ -32,6 +33,112 @@ func (i *ImageSize) String() string {
 	return fmt.Sprintf("%dx%d", i.Width, i.Height)
 }
 
+// encoded format of frame images
+type ImageFormat int
+
+const (
+	ImageFormatPNG  ImageFormat = C.SCRCPY_OUTPUT_FORMAT_PNG
+	ImageFormatJPEG ImageFormat = C.SCRCPY_OUTPUT_FORMAT_JPEG
+	ImageFormatWEBP ImageFormat = C.SCRCPY_OUTPUT_FORMAT_WEBP
+)
+
+// h264 decoder profile
+type DecoderProfile int
+
+const (
+	DecoderProfileDefault     DecoderProfile = C.SCRCPY_DECODER_PROFILE_DEFAULT
+	DecoderProfileLowLatency  DecoderProfile = C.SCRCPY_DECODER_PROFILE_LOW_LATENCY
+	DecoderProfileThroughput  DecoderProfile = C.SCRCPY_DECODER_PROFILE_THROUGHPUT
+	DecoderProfileReducedCost DecoderProfile = C.SCRCPY_DECODER_PROFILE_REDUCED_COST
+)
+
+// what happens to a new frame of a device once its callback queue is full
+type DeliveryPolicy int
+
+const (
+	DeliveryDropNewest DeliveryPolicy = C.SCRCPY_DELIVERY_DROP_NEWEST
+	DeliveryDropOldest DeliveryPolicy = C.SCRCPY_DELIVERY_DROP_OLDEST
+	DeliveryCoalesce   DeliveryPolicy = C.SCRCPY_DELIVERY_COALESCE
+	DeliveryBlock      DeliveryPolicy = C.SCRCPY_DELIVERY_BLOCK
+)
+
+// pixel format of raw frames
+type PixelFormat int
+
+const (
+	PixelFormatBGRA  PixelFormat = C.SCRCPY_PIXEL_FORMAT_BGRA
+	PixelFormatRGB24 PixelFormat = C.SCRCPY_PIXEL_FORMAT_RGB24
+	PixelFormatNV12  PixelFormat = C.SCRCPY_PIXEL_FORMAT_NV12
+	PixelFormatI420  PixelFormat = C.SCRCPY_PIXEL_FORMAT_I420
+)
+
+// a scaled frame in raw pixels
+type Frame struct {
+	Format PixelFormat
+	Width  int
+	Height int
+	// 1 plane for BGRA/RGB24, 2 for NV12(y, uv), 3 for I420(y, u, v)
+	Planes [][]byte
+	// bytes per row of each plane
+	Strides []int
+	// regions changed since the previous frame, nil if not tracked, @see Receiver.SetDirtyRects
+	DirtyRects []Rect
+}
+
+// an encoded frame image got from Receiver.WaitNextFrame or Receiver.CaptureSnapshot
+type FrameImage struct {
+	// increased by 1 for every frame of the device, pass it to the next WaitNextFrame call
+	// for snapshots it's increased for every decoded frame, the same seq means the same frame
+	Seq uint64
+	// image data in the configured output format
+	Data       []byte
+	ImageSize  *ImageSize
+	ScreenSize *ImageSize
+}
+
+// a region of an image
+type Rect struct {
+	X      int
+	Y      int
+	Width  int
+	Height int
+}
+
+// counters and recent latency percentiles of a device's video pipeline
+type DeviceStats struct {
+	BytesReceived      uint64
+	Packets            uint64
+	DecodedFrames      uint64
+	EncodedFrames      uint64
+	DeliveredCallbacks uint64
+	DroppedFrames      uint64
+	// frames dropped by the delivery policy, also counted in DroppedFrames
+	DroppedNewest   uint64
+	DroppedOldest   uint64
+	CoalescedFrames uint64
+	// frames the decoding thread waited for with DeliveryBlock
+	BlockedFrames uint64
+	// frames waiting for callbacks
+	QueueDepth int
+	// packets received but not decoded yet
+	PacketQueueDepth int
+	RecvP50          time.Duration
+	RecvP99          time.Duration
+	DecodeP50        time.Duration
+	DecodeP99        time.Duration
+	ConvertP50       time.Duration
+	ConvertP99       time.Duration
+	CallbackP50      time.Duration
+	CallbackP99      time.Duration
+}
+
+func (s *DeviceStats) String() string {
+	return fmt.Sprintf("packets=%d decoded=%d encoded=%d delivered=%d dropped=%d(newest=%d oldest=%d coalesced=%d) blocked=%d queue=%d packets_queue=%d recv=%v/%v decode=%v/%v convert=%v/%v callback=%v/%v",
+		s.Packets, s.DecodedFrames, s.EncodedFrames, s.DeliveredCallbacks, s.DroppedFrames, s.DroppedNewest, s.DroppedOldest, s.CoalescedFrames,
+		s.BlockedFrames, s.QueueDepth, s.PacketQueueDepth,
+		s.RecvP50, s.RecvP99, s.DecodeP50, s.DecodeP99, s.ConvertP50, s.ConvertP99, s.CallbackP50, s.CallbackP99)
+}
+
 type Receiver interface {
 	/**
 	* start up the receiver
@@ -42,6 +149,19 @@ type Receiver interface {
 	 */
 	Startup(listenAddr string, networkBufferSizeKb int, videoBufferSizeKb int)
 
+	/**
+	* read connections with async io instead of threads per connection, must be called before Startup
+	* @param            ioThreads               threads for network io, 0 means using the core count
+	 */
+	EnableAsyncIo(ioThreads int)
+
+	/**
+	 * Set the h264 decoder profile of devices without their own profile, must be called before Startup
+	 * @param            profile             the decoder profile
+	 * @return       false if the profile is unknown
+	 */
+	SetDefaultDecoderProfile(profile DecoderProfile) bool
+
 	/**
 	 * shutdown the receiver
 	 */
@@ -69,10 +189,126 @@ type Receiver interface {
 	 */
 	GetOriginalFrameImageSize(deviceId string) *ImageSize
 
+	/**
+	 * Set the encoded format of frame images for a device, png with default compression level if not set
+	 * @param            deviceId            device's id
+	 * @param            format              png, jpeg or webp
+	 * @param            quality             png compression level 0-9, jpeg quality 0-100, webp quality 1-100 or lossless if above 100, -1 for the encoder's default
+	 * @return       false if the format is unknown
+	 */
+	SetOutputFormat(deviceId string, format ImageFormat, quality int) bool
+
+	/**
+	 * Set the h264 decoder profile of a device, used from the next time its video socket connects
+	 * @param            deviceId            device's id
+	 * @param            profile             the decoder profile
+	 * @return       false if the profile is unknown
+	 */
+	SetDecoderProfile(deviceId string, profile DecoderProfile) bool
+
+	/**
+	 * Set how many frames of a device are queued for its callbacks and what happens to new frames once it's full
+	 * @param            deviceId            device's id
+	 * @param            depth               frames queued including the one being delivered, 0 for the default(4),
+	 *                                       at least 2 for DeliveryDropOldest and DeliveryCoalesce
+	 * @param            policy              DeliveryDropNewest(the default), DeliveryDropOldest, DeliveryCoalesce or DeliveryBlock
+	 * @return       false if the depth or the policy is invalid
+	 */
+	SetDeliveryPolicy(deviceId string, depth int, policy DeliveryPolicy) bool
+
+	/**
+	 * Only scale and encode the newest decoded frame once the device's callbacks are ready for it
+	 * @param            deviceId            device's id
+	 * @param            enabled             false to convert every decoded frame(the default)
+	 */
+	SetLatestFrameOnly(deviceId string, enabled bool)
+
+	/**
+	 * Limit how many frames per second of a device are scaled, encoded and sent to callbacks
+	 * @param            deviceId            device's id
+	 * @param            fps                 max frames per second, 0 for no limit(the default)
+	 */
+	SetMaxFps(deviceId string, fps int)
+
+	/**
+	 * Skip decoding a device's video while it has no frame image or raw frame callback
+	 * @param            deviceId            device's id
+	 * @param            enabled             false to decode anyway(the default)
+	 */
+	SetDrainWhenIdle(deviceId string, enabled bool)
+
+	/**
+	 * Only decode the keyframes of a device, one scaled frame per GOP is delivered
+	 * @param            deviceId            device's id
+	 * @param            enabled             false to decode all frames(the default)
+	 */
+	SetKeyframeOnly(deviceId string, enabled bool)
+
+	/**
+	 * Keep the deblocking filter and bicubic scaling even if the image size is a third of the screen or smaller
+	 * @param            deviceId            device's id
+	 * @param            enabled             false to take the low resolution path automatically(the default)
+	 */
+	SetFullResDecoding(deviceId string, enabled bool)
+
+	/**
+	 * Skip decoded frames identical to the last frame sent to the callbacks
+	 * @param            deviceId            device's id
+	 * @param            enabled             false to send every frame(the default)
+	 * @param            heartbeatMs         send an identical frame anyway after this many ms, 0 for never
+	 */
+	SetSkipIdenticalFrames(deviceId string, enabled bool, heartbeatMs int)
+
+	/**
+	 * Report the regions changed since the previous raw frame in Frame.DirtyRects
+	 * @param            deviceId            device's id
+	 * @param            enabled             false to skip comparing frames(the default)
+	 */
+	SetDirtyRects(deviceId string, enabled bool)
+
+	/**
+	 * Wait for a frame image newer than lastSeq, frames in between are skipped
+	 * @param            deviceId            device's id
+	 * @param            lastSeq             seq of the last frame got, 0 for the current frame
+	 * @param            timeout             how long to wait, below 0 for forever
+	 * @return           nil on timeout or when the receiver is shutting down
+	 */
+	WaitNextFrame(deviceId string, lastSeq uint64, timeout time.Duration) *FrameImage
+
+	/**
+	 * Stop scaling and encoding every frame of a device, only the latest decoded frame is kept for CaptureSnapshot
+	 * Callbacks and WaitNextFrame get no frame while it's enabled.
+	 * @param            deviceId            device's id
+	 * @param            enabled             false to convert every frame(the default)
+	 */
+	SetSnapshotMode(deviceId string, enabled bool)
+
+	/**
+	 * Scale and encode the latest decoded frame of a device now
+	 * @param            deviceId            device's id
+	 * @param            size                image size, nil for the configured image size or the screen size,
+	 *                                       scaled down to fit the decoded frame if bigger
+	 * @param            format              image format, -1 for the format and quality set by SetOutputFormat
+	 * @param            quality             png compression level or jpeg/webp quality, -1 for the encoder's default
+	 * @return           nil if no frame was decoded yet or it could not be encoded
+	 */
+	CaptureSnapshot(deviceId string, size *ImageSize, format ImageFormat, quality int) *FrameImage
+
+	/**
+	 * Publish frames of a device into a named shared memory ring(file mapping) for reading by other local processes
+	 * The layout is described by scrcpy_shm_ring_header in scrcpy_recv.h
+	 * @param            deviceId            device's id
+	 * @param            name                name of the file mapping
+	 * @param            slotCount           frames kept in the ring, 0 to stop exporting
+	 * @param            slotSize            max bytes of a frame, bigger frames are dropped
+	 * @return           false if the file mapping could not be created
+	 */
+	ExportShmRing(deviceId string, name string, slotCount int, slotSize int) bool
+
 	/**
 	 * Add frame image callback for device
 	 * @param            deviceId            device's id
-	 * @param            callbackMethod      the callback method. (deviceId, png image data, png image size, screen size) in order.
+	 * @param            callbackMethod      the callback method. (deviceId, image data in the configured output format, image size, screen size) in order.
 	 */
 	AddFrameImageCallback(deviceId string, callbackMethod func(string, *[]byte, *ImageSize, *ImageSize))
 
@@ -82,6 +318,20 @@ type Receiver interface {
 	 */
 	RemoveAllImageCallbacks(deviceId string)
 
+	/**
+	 * Add raw frame callback for device, png encoding is skipped when a device has raw frame callbacks only
+	 * @param            deviceId            device's id
+	 * @param            format              pixel format, shared by all raw frame callbacks of the device
+	 * @param            callbackMethod      the callback method. (deviceId, frame, screen size) in order.
+	 */
+	AddRawFrameCallback(deviceId string, format PixelFormat, callbackMethod func(string, *Frame, *ImageSize))
+
+	/**
+	 * Remove all raw frame callback methods for a device
+	 * @param           deviceId            device's id
+	 */
+	RemoveAllRawFrameCallbacks(deviceId string)
+
 	/**
 	 * Add device info callback
 	 * @param           deviceId            device's id
@@ -132,6 +382,13 @@ type Receiver interface {
 	 * @param         deviceId        the device's identifier
 	 **/
 	RemoveAllDisconnectedCallbck(deviceId string)
+
+	/**
+	 * Get video pipeline stats of a device
+	 * @param         deviceId        the device's identifier
+	 * @return        nil if the device never sent any video
+	 **/
+	GetStats(deviceId string) *DeviceStats
 }
 
 var globalTokenAndReceiverMap = make(map[string][]*receiver)
@@ -143,6 +400,7 @@ type receiver struct {
 	r                      C.scrcpy_listener_t
 	token                  string
 	frameImageCallbacks    map[string][]func(string, *[]byte, *ImageSize, *ImageSize)
+	rawFrameCallbacks      map[string][]func(string, *Frame, *ImageSize)
 	deviceInfoCallbacks    map[string][]func(string, int, int)
 	ctrlEventSendCallbacks map[string][]func(string, string, int, int)
 	disconnectedCallbacks  map[string][]DeviceDisconnectedCallback
@@ -154,6 +412,14 @@ func (r *receiver) Startup(listenAddr string, networkBufferSizeKb int, videoBuff
 	C.scrcpy_start_receiver(r.r, addr, C.int(networkBufferSizeKb), C.int(videoBufferSizeKb))
 }
 
+func (r *receiver) EnableAsyncIo(ioThreads int) {
+	C.scrcpy_enable_async_io(r.r, C.int(ioThreads))
+}
+
+func (r *receiver) SetDefaultDecoderProfile(profile DecoderProfile) bool {
+	return C.scrcpy_set_default_decoder_profile(r.r, C.int(profile)) == 0
+}
+
 func (r *receiver) Shutdown() {
 	C.scrcpy_shutdown_receiver_and_logger(r.r)
 }
@@ -180,6 +446,166 @@ func (r *receiver) GetOriginalFrameImageSize(deviceId string) *ImageSize {
 	return scrcpyRectToImageSize(cReturn)
 }
 
+func (r *receiver) SetOutputFormat(deviceId string, format ImageFormat, quality int) bool {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	return C.scrcpy_set_output_format(r.r, deviceIdCStr, C.int(format), C.int(quality)) == 0
+}
+
+func (r *receiver) SetDecoderProfile(deviceId string, profile DecoderProfile) bool {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	return C.scrcpy_set_decoder_profile(r.r, deviceIdCStr, C.int(profile)) == 0
+}
+
+func (r *receiver) SetDeliveryPolicy(deviceId string, depth int, policy DeliveryPolicy) bool {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	return C.scrcpy_set_delivery_policy(r.r, deviceIdCStr, C.int(depth), C.int(policy)) == 0
+}
+
+func (r *receiver) SetLatestFrameOnly(deviceId string, enabled bool) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	cEnabled := C.int(0)
+	if enabled {
+		cEnabled = 1
+	}
+	C.scrcpy_set_latest_frame_only(r.r, deviceIdCStr, cEnabled)
+}
+
+func (r *receiver) SetMaxFps(deviceId string, fps int) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	C.scrcpy_set_max_fps(r.r, deviceIdCStr, C.int(fps))
+}
+
+func (r *receiver) SetDrainWhenIdle(deviceId string, enabled bool) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	cEnabled := C.int(0)
+	if enabled {
+		cEnabled = 1
+	}
+	C.scrcpy_set_drain_when_idle(r.r, deviceIdCStr, cEnabled)
+}
+
+func (r *receiver) SetKeyframeOnly(deviceId string, enabled bool) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	cEnabled := C.int(0)
+	if enabled {
+		cEnabled = 1
+	}
+	C.scrcpy_set_keyframe_only(r.r, deviceIdCStr, cEnabled)
+}
+
+func (r *receiver) SetFullResDecoding(deviceId string, enabled bool) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	cEnabled := C.int(0)
+	if enabled {
+		cEnabled = 1
+	}
+	C.scrcpy_set_full_res_decoding(r.r, deviceIdCStr, cEnabled)
+}
+
+func (r *receiver) SetSkipIdenticalFrames(deviceId string, enabled bool, heartbeatMs int) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	cEnabled := C.int(0)
+	if enabled {
+		cEnabled = 1
+	}
+	C.scrcpy_set_skip_identical_frames(r.r, deviceIdCStr, cEnabled, C.int(heartbeatMs))
+}
+
+func (r *receiver) SetDirtyRects(deviceId string, enabled bool) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	cEnabled := C.int(0)
+	if enabled {
+		cEnabled = 1
+	}
+	C.scrcpy_set_dirty_rects(r.r, deviceIdCStr, cEnabled)
+}
+
+func (r *receiver) WaitNextFrame(deviceId string, lastSeq uint64, timeout time.Duration) *FrameImage {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	timeoutMs := -1
+	if timeout >= 0 {
+		timeoutMs = int(timeout / time.Millisecond)
+	}
+	// the frame is kept when the buffer is too small, so a retry with the reported size gets the same frame
+	buffer := make([]byte, 512*1024)
+	for {
+		var info C.scrcpy_frame_info
+		result := C.scrcpy_wait_next_frame(r.r, deviceIdCStr, C.uint64_t(lastSeq), C.int(timeoutMs),
+			(*C.uint8_t)(unsafe.Pointer(&buffer[0])), C.uint32_t(len(buffer)), &info)
+		switch result {
+		case C.SCRCPY_WAIT_FRAME_OK:
+			return &FrameImage{
+				Seq:        uint64(info.seq),
+				Data:       buffer[:int(info.size)],
+				ImageSize:  scrcpyRectToImageSize(info.img_size),
+				ScreenSize: scrcpyRectToImageSize(info.orig_size),
+			}
+		case C.SCRCPY_WAIT_FRAME_BUFFER_TOO_SMALL:
+			buffer = make([]byte, int(info.size))
+		default:
+			return nil
+		}
+	}
+}
+
+func (r *receiver) ExportShmRing(deviceId string, name string, slotCount int, slotSize int) bool {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	nameCStr := C.CString(name)
+	defer C.free(unsafe.Pointer(nameCStr))
+	return C.scrcpy_export_shm_ring(r.r, deviceIdCStr, nameCStr, C.int(slotCount), C.uint32_t(slotSize)) == 0
+}
+
+func (r *receiver) SetSnapshotMode(deviceId string, enabled bool) {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	cEnabled := C.int(0)
+	if enabled {
+		cEnabled = 1
+	}
+	C.scrcpy_set_snapshot_mode(r.r, deviceIdCStr, cEnabled)
+}
+
+func (r *receiver) CaptureSnapshot(deviceId string, size *ImageSize, format ImageFormat, quality int) *FrameImage {
+	deviceIdCStr := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(deviceIdCStr))
+	width, height := 0, 0
+	if size != nil {
+		width, height = size.Width, size.Height
+	}
+	// the snapshot is encoded again if the buffer is too small, so start with room for most images
+	buffer := make([]byte, 2*1024*1024)
+	for {
+		var info C.scrcpy_frame_info
+		result := C.scrcpy_capture_snapshot(r.r, deviceIdCStr, C.int(width), C.int(height), C.int(format), C.int(quality),
+			(*C.uint8_t)(unsafe.Pointer(&buffer[0])), C.uint32_t(len(buffer)), &info)
+		switch result {
+		case C.SCRCPY_SNAPSHOT_OK:
+			return &FrameImage{
+				Seq:        uint64(info.seq),
+				Data:       buffer[:int(info.size)],
+				ImageSize:  scrcpyRectToImageSize(info.img_size),
+				ScreenSize: scrcpyRectToImageSize(info.orig_size),
+			}
+		case C.SCRCPY_SNAPSHOT_BUFFER_TOO_SMALL:
+			buffer = make([]byte, int(info.size))
+		default:
+			return nil
+		}
+	}
+}
+
 func (r *receiver) addToGlobalMap() {
 	token := r.token
 	globalCallbackItems, globalCallbackFound := globalTokenAndReceiverMap[token]
@@ -204,7 +630,7 @@ func (r *receiver) addToGlobalMap() {
 }
 func (r *receiver) removeFromGlobalMap() {
 	// remove from global only when there's no callbacks
-	if len(r.deviceInfoCallbacks) == 0 && len(r.frameImageCallbacks) == 0 && len(r.ctrlEventSendCallbacks) == 0 && len(r.disconnectedCallbacks) == 0 {
+	if len(r.deviceInfoCallbacks) == 0 && len(r.frameImageCallbacks) == 0 && len(r.rawFrameCallbacks) == 0 && len(r.ctrlEventSendCallbacks) == 0 && len(r.disconnectedCallbacks) == 0 {
 		delete(globalTokenAndReceiverMap, r.token)
 	}
 }
@@ -244,6 +670,41 @@ func (r *receiver) RemoveAllImageCallbacks(deviceId string) {
 	}
 }
 
+func (r *receiver) AddRawFrameCallback(deviceId string, format PixelFormat, callbackMethod func(string, *Frame, *ImageSize)) {
+	items, found := r.rawFrameCallbacks[deviceId]
+	if found {
+		items = append(items, callbackMethod)
+	} else {
+		items = make([]func(string, *Frame, *ImageSize), 1)
+		items[0] = callbackMethod
+		r.addToGlobalMap()
+	}
+	r.rawFrameCallbacks[deviceId] = items
+
+	cDeviceId := C.CString(deviceId)
+	defer func() {
+		C.free(unsafe.Pointer(cDeviceId))
+	}()
+	// unregister all callbacks for device first
+	C.scrcpy_frame_unregister_all_raw_callbacks(r.r, cDeviceId)
+
+	c_goScrcpyRawFrameCallback := C.scrcpy_frame_raw_callback(C.c_goScrcpyRawFrameCallback)
+	C.scrcpy_frame_register_raw_callback(r.r, cDeviceId, C.int(format), c_goScrcpyRawFrameCallback)
+}
+
+func (r *receiver) RemoveAllRawFrameCallbacks(deviceId string) {
+	_, found := r.rawFrameCallbacks[deviceId]
+	if found {
+		delete(r.rawFrameCallbacks, deviceId)
+		r.removeFromGlobalMap()
+		cDeviceId := C.CString(deviceId)
+		defer func() {
+			C.free(unsafe.Pointer(cDeviceId))
+		}()
+		C.scrcpy_frame_unregister_all_raw_callbacks(r.r, cDeviceId)
+	}
+}
+
 func (r *receiver) AddDeviceInfoCallback(deviceId string, callbackMethod func(string, int, int)) {
 	items, found := r.deviceInfoCallbacks[deviceId]
 	if found {
@@ -304,6 +765,24 @@ func (r *receiver) invokeFrameImageCallbacks(deviceId string, imgData *[]byte, i
 	}
 	internalWg.Wait()
 }
+func (r *receiver) invokeRawFrameCallbacks(deviceId string, frame *Frame, screenSize *ImageSize) {
+	callbacks, found := r.rawFrameCallbacks[deviceId]
+	if !found {
+		fmt.Printf("No raw frame callback configured for device %v, got frame %dx%d, screen size is %v\n", deviceId, frame.Width, frame.Height, screenSize)
+		return
+	}
+	var internalWg sync.WaitGroup
+	internalWgPointer := &internalWg
+	for _, item := range callbacks {
+		internalWg.Add(1)
+		callback := item
+		go func() {
+			defer internalWgPointer.Done()
+			callback(deviceId, frame, screenSize)
+		}()
+	}
+	internalWg.Wait()
+}
 func (r *receiver) invokeDeviceInfoCallbacks(deviceId string, width int, height int) {
 	callbacks, found := r.deviceInfoCallbacks[deviceId]
 	if !found {
@@ -412,6 +891,37 @@ func (r *receiver) invokeDeviceDisconnectedCallbacks(deviceId string, connection
 	}
 }
 
+func (r *receiver) GetStats(deviceId string) *DeviceStats {
+	cDeviceId := C.CString(deviceId)
+	defer C.free(unsafe.Pointer(cDeviceId))
+	var cStats C.struct_scrcpy_device_stats
+	if C.scrcpy_get_device_stats(r.r, cDeviceId, &cStats) != 0 {
+		return nil
+	}
+	return &DeviceStats{
+		BytesReceived:      uint64(cStats.bytes_received),
+		Packets:            uint64(cStats.packets),
+		DecodedFrames:      uint64(cStats.decoded_frames),
+		EncodedFrames:      uint64(cStats.encoded_frames),
+		DeliveredCallbacks: uint64(cStats.delivered_callbacks),
+		DroppedFrames:      uint64(cStats.dropped_frames),
+		DroppedNewest:      uint64(cStats.dropped_newest),
+		DroppedOldest:      uint64(cStats.dropped_oldest),
+		CoalescedFrames:    uint64(cStats.coalesced_frames),
+		BlockedFrames:      uint64(cStats.blocked_frames),
+		QueueDepth:         int(cStats.queue_depth),
+		PacketQueueDepth:   int(cStats.packet_queue_depth),
+		RecvP50:            time.Duration(cStats.recv_p50_us) * time.Microsecond,
+		RecvP99:            time.Duration(cStats.recv_p99_us) * time.Microsecond,
+		DecodeP50:          time.Duration(cStats.decode_p50_us) * time.Microsecond,
+		DecodeP99:          time.Duration(cStats.decode_p99_us) * time.Microsecond,
+		ConvertP50:         time.Duration(cStats.convert_p50_us) * time.Microsecond,
+		ConvertP99:         time.Duration(cStats.convert_p99_us) * time.Microsecond,
+		CallbackP50:        time.Duration(cStats.callback_p50_us) * time.Microsecond,
+		CallbackP99:        time.Duration(cStats.callback_p99_us) * time.Microsecond,
+	}
+}
+
 func New(token string) Receiver {
 	cToken := C.CString(token)
 	res := C.scrcpy_new_receiver(cToken)
@@ -421,6 +931,7 @@ func New(token string) Receiver {
 	return &receiver{
 		r: res, token: token,
 		frameImageCallbacks:    make(map[string][]func(string, *[]byte, *ImageSize, *ImageSize)),
+		rawFrameCallbacks:      make(map[string][]func(string, *Frame, *ImageSize)),
 		deviceInfoCallbacks:    make(map[string][]func(string, int, int)),
 		ctrlEventSendCallbacks: make(map[string][]func(string, string, int, int)),
 		disconnectedCallbacks:  make(map[string][]DeviceDisconnectedCallback),
@@ -430,6 +941,16 @@ func Release(handle Receiver, timeout int) {
 	handle.(*receiver).release(timeout)
 }
 
+/**
+ * Set the worker threads invoking the frame callbacks, shared by the devices of all receivers
+ * Must be called before the first frame callback is added to any receiver
+ * @param            workers             worker threads, 0 means using the core count
+ * @return           false if the workers were started already
+ */
+func SetCallbackWorkers(workers int) bool {
+	return C.scrcpy_set_callback_workers(C.int(workers)) == 0
+}
+
 //export goScrcpyFrameImageCallback
 func goScrcpyFrameImageCallback(cToken *C.char, cDeviceId *C.char, cImgData *C.uint8_t, cImgDataLen C.uint32_t, cImgSize C.struct_scrcpy_rect, cScreenSize C.struct_scrcpy_rect) {
 	token := C.GoString(cToken)
@@ -457,6 +978,52 @@ func goScrcpyFrameImageCallback(cToken *C.char, cDeviceId *C.char, cImgData *C.u
 	wg.Wait()
 }
 
+//export goScrcpyRawFrameCallback
+func goScrcpyRawFrameCallback(cToken *C.char, cDeviceId *C.char, cFrame *C.struct_scrcpy_frame, cScreenSize C.struct_scrcpy_rect) {
+	token := C.GoString(cToken)
+	deviceId := C.GoString(cDeviceId)
+	receiverList, found := globalTokenAndReceiverMap[token]
+	if !found {
+		return
+	}
+	planes := int(cFrame.planes)
+	frame := &Frame{
+		Format:  PixelFormat(cFrame.format),
+		Width:   int(cFrame.width),
+		Height:  int(cFrame.height),
+		Planes:  make([][]byte, planes),
+		Strides: make([]int, planes),
+	}
+	// the planes are only valid within this call, copy them into go's ram
+	for i := 0; i < planes; i++ {
+		rows := frame.Height
+		if i > 0 {
+			// chroma planes of NV12/I420 are subsampled vertically
+			rows = (frame.Height + 1) / 2
+		}
+		frame.Strides[i] = int(cFrame.linesize[i])
+		frame.Planes[i] = C.GoBytes(unsafe.Pointer(cFrame.data[i]), C.int(frame.Strides[i]*rows))
+	}
+	if cFrame.dirty_rect_count >= 0 {
+		frame.DirtyRects = make([]Rect, int(cFrame.dirty_rect_count))
+		for i := range frame.DirtyRects {
+			rect := cFrame.dirty_rects[i]
+			frame.DirtyRects[i] = Rect{X: int(rect.x), Y: int(rect.y), Width: int(rect.width), Height: int(rect.height)}
+		}
+	}
+	screenSize := scrcpyRectToImageSize(cScreenSize)
+	var wg sync.WaitGroup
+	for _, r := range receiverList {
+		wg.Add(1)
+		receiveInstance := r
+		go func() {
+			defer wg.Done()
+			receiveInstance.invokeRawFrameCallbacks(deviceId, frame, screenSize)
+		}()
+	}
+	wg.Wait()
+}
+
 //export goScrcpyDeviceInfoCallback
 func goScrcpyDeviceInfoCallback(cToken *C.char, cDeviceId *C.char, cWidth C.int, cHeight int) {
 	token := C.GoString(cToken)
@@ -21,10 +21,186 @@ typedef struct scrcpy_rect {
     int height;
 } scrcpy_rect;
 
+// a frame image got from scrcpy_wait_next_frame or scrcpy_capture_snapshot
+typedef struct scrcpy_frame_info {
+    // increased by 1 for every frame of the device, starting from 1
+    // for snapshots it's increased for every decoded frame, so an unchanged seq means the same frame
+    uint64_t seq;
+    // bytes of the image data
+    uint32_t size;
+    scrcpy_rect img_size;
+    scrcpy_rect orig_size;
+} scrcpy_frame_info;
+
+// results of scrcpy_wait_next_frame
+#define SCRCPY_WAIT_FRAME_OK 0
+#define SCRCPY_WAIT_FRAME_TIMEOUT 1
+// info is filled, the frame is kept for waiting again with a bigger buffer
+#define SCRCPY_WAIT_FRAME_BUFFER_TOO_SMALL 2
+// the receiver is shutting down
+#define SCRCPY_WAIT_FRAME_CLOSED 3
+
+// results of scrcpy_capture_snapshot
+#define SCRCPY_SNAPSHOT_OK 0
+// the device is not connected or sent no frame yet
+#define SCRCPY_SNAPSHOT_NO_FRAME 1
+// info is filled with the size needed, the snapshot is not kept
+#define SCRCPY_SNAPSHOT_BUFFER_TOO_SMALL 2
+// scaling or encoding failed
+#define SCRCPY_SNAPSHOT_FAILED 3
+
+// a region of an image
+typedef struct scrcpy_area {
+    int x;
+    int y;
+    int width;
+    int height;
+} scrcpy_area;
+
+// counters and recent latency percentiles of a device's video pipeline
+typedef struct scrcpy_device_stats {
+    uint64_t bytes_received;
+    uint64_t packets;
+    uint64_t decoded_frames;
+    uint64_t encoded_frames;
+    uint64_t delivered_callbacks;
+    uint64_t dropped_frames;
+    // frames dropped by the delivery policy of the device, also counted in dropped_frames
+    uint64_t dropped_newest;
+    uint64_t dropped_oldest;
+    uint64_t coalesced_frames;
+    // frames the decoding thread waited for a free slot with SCRCPY_DELIVERY_BLOCK
+    uint64_t blocked_frames;
+    // frames waiting for callbacks
+    int queue_depth;
+    // packets received but not decoded yet
+    int packet_queue_depth;
+    // latencies in microseconds
+    int64_t recv_p50_us;
+    int64_t recv_p99_us;
+    int64_t decode_p50_us;
+    int64_t decode_p99_us;
+    int64_t convert_p50_us;
+    int64_t convert_p99_us;
+    int64_t callback_p50_us;
+    int64_t callback_p99_us;
+} scrcpy_device_stats;
+
 // callback handler for frame image
 typedef void (*scrcpy_frame_img_callback) 
     (char *token, char *device_id, uint8_t *img_data, uint32_t img_data_len, scrcpy_rect img_size, scrcpy_rect orig_size);
 
+// encoded formats of frame images
+#define SCRCPY_OUTPUT_FORMAT_PNG 0
+#define SCRCPY_OUTPUT_FORMAT_JPEG 1
+#define SCRCPY_OUTPUT_FORMAT_WEBP 2
+// use the encoder's default quality/compression level
+#define SCRCPY_OUTPUT_QUALITY_DEFAULT -1
+
+// pixel formats of raw frames
+#define SCRCPY_PIXEL_FORMAT_BGRA 0
+#define SCRCPY_PIXEL_FORMAT_RGB24 1
+#define SCRCPY_PIXEL_FORMAT_NV12 2
+#define SCRCPY_PIXEL_FORMAT_I420 3
+#define SCRCPY_MAX_FRAME_PLANES 3
+// changed regions beyond this count are reported as their bounding box
+#define SCRCPY_MAX_DIRTY_RECTS 32
+
+// what happens to a new frame of a device when `depth` frames are waiting for its callbacks or being delivered
+// the new frame is dropped
+#define SCRCPY_DELIVERY_DROP_NEWEST 0
+// the oldest frame waiting is dropped
+#define SCRCPY_DELIVERY_DROP_OLDEST 1
+// the frame waiting is replaced by the new one whether the queue is full or not, at most one frame waits
+#define SCRCPY_DELIVERY_COALESCE 2
+// the decoding thread waits until a frame is delivered, no frame is dropped
+// with scrcpy_enable_async_io the decoding threads are shared by the devices, a waiting device holds one of them
+#define SCRCPY_DELIVERY_BLOCK 3
+#define SCRCPY_DELIVERY_DEFAULT_DEPTH 4
+#define SCRCPY_DELIVERY_MAX_DEPTH 64
+
+// h264 decoder profiles
+// single threaded, ffmpeg's defaults
+#define SCRCPY_DECODER_PROFILE_DEFAULT 0
+// low delay flag and slice threads, a frame is output as soon as its packet is decoded
+#define SCRCPY_DECODER_PROFILE_LOW_LATENCY 1
+// frame threads sized to the core count, output is delayed by a frame per thread
+#define SCRCPY_DECODER_PROFILE_THROUGHPUT 2
+// skip the deblocking filter and allow non spec compliant speedups, with visible artifacts
+#define SCRCPY_DECODER_PROFILE_REDUCED_COST 3
+
+// a scaled frame in raw pixels
+typedef struct scrcpy_frame {
+    // @see SCRCPY_PIXEL_FORMAT_BGRA
+    int format;
+    int width;
+    int height;
+    // 1 for BGRA/RGB24, 2 for NV12(y, uv), 3 for I420(y, u, v)
+    int planes;
+    // only valid within the callback
+    uint8_t *data[SCRCPY_MAX_FRAME_PLANES];
+    // bytes per row of each plane
+    int linesize[SCRCPY_MAX_FRAME_PLANES];
+    // regions changed since the previous frame sent, in pixels of this frame, -1 if not tracked
+    // @see scrcpy_set_dirty_rects
+    int dirty_rect_count;
+    scrcpy_area dirty_rects[SCRCPY_MAX_DIRTY_RECTS];
+} scrcpy_frame;
+
+// callback handler for raw frame
+typedef void (*scrcpy_frame_raw_callback)
+    (char *token, char *device_id, scrcpy_frame *frame, scrcpy_rect orig_size);
+
+/*
+ * shared memory frame ring, @see scrcpy_export_shm_ring
+ * a scrcpy_shm_ring_header of SCRCPY_SHM_RING_HEADER_SIZE bytes, then slot_count slots of slot_stride bytes each.
+ * a slot is a scrcpy_shm_slot_header of SCRCPY_SHM_SLOT_HEADER_SIZE bytes followed by up to slot_size bytes of frame data.
+ * the frame with seq n is written into slot (n - 1) % slot_count. To read it without copying:
+ *   1. load slot.lock atomically(acquire), retry later if it's odd, it's being written
+ *   2. read the slot header and the data in place
+ *   3. load slot.lock atomically again(after an acquire fence), the frame was valid only if it didn't change
+ */
+#define SCRCPY_SHM_RING_MAGIC 0x52534353
+#define SCRCPY_SHM_RING_VERSION 1
+#define SCRCPY_SHM_RING_HEADER_SIZE 64
+#define SCRCPY_SHM_SLOT_HEADER_SIZE 128
+// kinds of frames in a shared memory ring
+#define SCRCPY_SHM_FRAME_IMAGE 0
+#define SCRCPY_SHM_FRAME_RAW 1
+
+typedef struct scrcpy_shm_ring_header {
+    // SCRCPY_SHM_RING_MAGIC once the ring is initialized
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    // bytes from one slot to the next
+    uint32_t slot_stride;
+    // max bytes of frame data in a slot, bigger frames are not published
+    uint32_t slot_size;
+    uint32_t reserved;
+    // seq of the newest frame published, 0 for none, updated atomically after the slot was written
+    uint64_t last_seq;
+} scrcpy_shm_ring_header;
+
+typedef struct scrcpy_shm_slot_header {
+    // seqlock of the slot, odd while being written, seq * 2 once the frame with seq was written
+    uint64_t lock;
+    // @see SCRCPY_SHM_FRAME_IMAGE
+    int32_t kind;
+    // SCRCPY_OUTPUT_FORMAT_PNG for images, SCRCPY_PIXEL_FORMAT_BGRA for raw frames
+    int32_t format;
+    // bytes of frame data
+    uint32_t size;
+    int32_t width;
+    int32_t height;
+    int32_t screen_width;
+    int32_t screen_height;
+    // planes of raw frames, from the start of the frame data
+    int32_t planes;
+    int32_t plane_offset[SCRCPY_MAX_FRAME_PLANES];
+    int32_t linesize[SCRCPY_MAX_FRAME_PLANES];
+} scrcpy_shm_slot_header;
+
 // callback for device screen size
 typedef void (*scrcpy_device_info_callback)
     (char *token, char *device_id, int screen_width, int screen_height);
@@ -60,6 +236,30 @@ SCRCPY_API void scrcpy_free_receiver(scrcpy_listener_t handle);
  */
 SCRCPY_API void scrcpy_start_receiver(scrcpy_listener_t handle, char* listen_address, int net_buffer_size, int video_buffer_size);
 
+/**
+ * Read the connections with async io on a small thread pool instead of threads per connection
+ * Decoding is done within another pool sized to the core count. Must be called before scrcpy_start_receiver.
+ * @param   handle      the receiver handle
+ * @param   io_threads  threads for network io, 0 means using the core count
+ */
+SCRCPY_API void scrcpy_enable_async_io(scrcpy_listener_t handle, int io_threads);
+
+/**
+ * Set the h264 decoder profile of devices without their own profile, must be called before scrcpy_start_receiver
+ * @param   handle          the handle
+ * @param   profile         @see SCRCPY_DECODER_PROFILE_DEFAULT
+ * @return  0 if ok, 1 if the profile is unknown
+ */
+SCRCPY_API int scrcpy_set_default_decoder_profile(scrcpy_listener_t handle, int profile);
+
+/**
+ * Set the worker threads invoking the frame callbacks, shared by the devices of all receivers
+ * Must be called before the first frame callback is registered on any receiver.
+ * @param   workers     worker threads, 0 means using the core count
+ * @return  0 if ok, 1 if the workers were started already
+ */
+SCRCPY_API int scrcpy_set_callback_workers(int workers);
+
 /**
  * Shutdown receiver
  * @param   handle    the receiver handle
@@ -109,6 +309,141 @@ SCRCPY_API void scrcpy_frame_register_callback(scrcpy_listener_t handle, char *d
  */
 SCRCPY_API void scrcpy_frame_unregister_all_callbacks(scrcpy_listener_t handle, char *device_id);
 
+/**
+ * Set the encoded format of frame images for a device, png with default compression level if not set
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   format          @see SCRCPY_OUTPUT_FORMAT_PNG
+ * @param   quality         png: compression level 0-9, 0 is the fastest and largest
+ *                          jpeg: quality 0-100
+ *                          webp: quality 1-100, lossless if above 100
+ *                          SCRCPY_OUTPUT_QUALITY_DEFAULT for the encoder's default
+ * @return  0 if ok, 1 if the format is unknown
+ */
+SCRCPY_API int scrcpy_set_output_format(scrcpy_listener_t handle, char *device_id, int format, int quality);
+
+/**
+ * Set the h264 decoder profile of a device, e.g. low latency for devices being controlled and throughput for recording
+ * The decoder is opened when the video socket connects, so it applies to the next connection of a connected device.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   profile         @see SCRCPY_DECODER_PROFILE_DEFAULT
+ * @return  0 if ok, 1 if the profile is unknown
+ */
+SCRCPY_API int scrcpy_set_decoder_profile(scrcpy_listener_t handle, char *device_id, int profile);
+
+/**
+ * Set how many frames of a device are queued for its frame image and raw frame callbacks, and what happens to new
+ * frames once the queue is full. SCRCPY_DELIVERY_DROP_NEWEST with SCRCPY_DELIVERY_DEFAULT_DEPTH is the default,
+ * SCRCPY_DELIVERY_COALESCE suits devices being controlled, SCRCPY_DELIVERY_BLOCK suits recording every frame.
+ * It applies to a device with callbacks once its queued frames were delivered.
+ * With scrcpy_enable_async_io a device waiting for its callbacks with SCRCPY_DELIVERY_BLOCK holds one of the decoding
+ * threads shared by all devices, so as many slow devices as decoding threads hold up the others too.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   depth           frames queued including the one being delivered, 1 to SCRCPY_DELIVERY_MAX_DEPTH,
+ *                          0 for SCRCPY_DELIVERY_DEFAULT_DEPTH. At least 2 for SCRCPY_DELIVERY_DROP_OLDEST and
+ *                          SCRCPY_DELIVERY_COALESCE, since the only slot of depth 1 is taken by the frame being delivered
+ * @param   policy          @see SCRCPY_DELIVERY_DROP_NEWEST
+ * @return  0 if ok, 1 if the depth or the policy is invalid
+ */
+SCRCPY_API int scrcpy_set_delivery_policy(scrcpy_listener_t handle, char *device_id, int depth, int policy);
+
+/**
+ * Only scale and encode the newest decoded frame of a device once its callbacks are ready for it
+ * Frames decoded while the callbacks are still busy are superseded by newer ones and counted as dropped.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   enabled         1 to enable, 0 to convert every decoded frame(the default)
+ */
+SCRCPY_API void scrcpy_set_latest_frame_only(scrcpy_listener_t handle, char *device_id, int enabled);
+
+/**
+ * Limit how many frames per second of a device are scaled, encoded and sent to callbacks, based on the video pts
+ * Frames over the limit are still decoded but counted as dropped.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   fps             max frames per second, 0 for no limit(the default)
+ */
+SCRCPY_API void scrcpy_set_max_fps(scrcpy_listener_t handle, char *device_id, int fps);
+
+/**
+ * Stop decoding a device's video while it has no frame image or raw frame callback
+ * The socket is still read, only the latest IDR packet(with SPS/PPS) and the packets after it are kept,
+ * they are decoded once a callback is registered. Frames are decoded for devices without callbacks by default.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   enabled         1 to enable, 0 to disable
+ */
+SCRCPY_API void scrcpy_set_drain_when_idle(scrcpy_listener_t handle, char *device_id, int enabled);
+
+/**
+ * Only decode the IDR packets of a device, the other packets are skipped before decoding and counted as dropped
+ * One frame per GOP is delivered, scaled to the configured image size. After disabling it, frames are delivered again
+ * from the next IDR.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   enabled         1 to enable, 0 to disable(the default)
+ */
+SCRCPY_API void scrcpy_set_keyframe_only(scrcpy_listener_t handle, char *device_id, int enabled);
+
+/**
+ * Keep the full quality path for a device whose frames are scaled down a lot
+ * When the image size set by scrcpy_set_image_size is a third of the screen or smaller on both sides, the deblocking
+ * filter is skipped while decoding and frames are scaled with an area filter instead of bicubic, unless this is enabled.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   enabled         1 to enable, 0 to take the low resolution path automatically(the default)
+ */
+SCRCPY_API void scrcpy_set_full_res_decoding(scrcpy_listener_t handle, char *device_id, int enabled);
+
+/**
+ * Skip decoded frames of a device identical to the last frame sent, judged by a hash of the decoded planes
+ * Skipped frames are not scaled, encoded or sent to the callbacks, and are counted as dropped.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   enabled         1 to enable, 0 to send every frame(the default)
+ * @param   heartbeat_ms    send an identical frame anyway if the last frame was sent this many ms ago, 0 for never
+ */
+SCRCPY_API void scrcpy_set_skip_identical_frames(scrcpy_listener_t handle, char *device_id, int enabled, int heartbeat_ms);
+
+/**
+ * Report the regions changed since the previous raw frame sent with the raw frames of a device
+ * The luma planes are compared in tiles of 32x32 screen pixels before scaling, see scrcpy_frame.dirty_rects.
+ * The first frame, and the first one delivered after frames were dropped by the delivery policy, are reported as changed
+ * entirely. Frame image(png/jpeg/webp) callbacks don't get the regions.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   enabled         1 to enable, 0 to disable(the default), dirty_rect_count is -1 then
+ */
+SCRCPY_API void scrcpy_set_dirty_rects(scrcpy_listener_t handle, char *device_id, int enabled);
+
+/**
+ * Stop scaling and encoding frames of a device continuously, only a reference of the latest decoded frame is kept
+ * Frame image, raw frame callbacks and scrcpy_wait_next_frame get no frame until it's disabled.
+ * Capture the frame with scrcpy_capture_snapshot. Packets are never drained in this mode.
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   enabled         1 to enable, 0 to disable(the default)
+ */
+SCRCPY_API void scrcpy_set_snapshot_mode(scrcpy_listener_t handle, char *device_id, int enabled);
+
+/**
+ * Register a callback handler for raw frames, png encoding is skipped if a device has raw frame callbacks only
+ * @param   handle          the handle
+ * @param   device_id       device id
+ * @param   pixel_format    @see SCRCPY_PIXEL_FORMAT_BGRA, shared by all raw frame callbacks of the device
+ * @param   handler         the pointer to the callback
+ */
+SCRCPY_API void scrcpy_frame_register_raw_callback(scrcpy_listener_t handle, char *device_id, int pixel_format, scrcpy_frame_raw_callback handler);
+
+/**
+ * Remove all raw frame callbacks for a device id
+ * @param   handle          the handle
+ * @param   device_id       device id
+ */
+SCRCPY_API void scrcpy_frame_unregister_all_raw_callbacks(scrcpy_listener_t handle, char *device_id);
+
 /**
  * Register a callback handler for device info
  * @param       handle      receiver handle
@@ -150,6 +485,63 @@ SCRCPY_API void scrcpy_device_send_ctrl_msg(scrcpy_listener_t handle, char *devi
  */
 SCRCPY_API void scrcpy_set_device_disconnected_callback(scrcpy_listener_t handle, scrcpy_device_disconnected_callback callback);
 
+/**
+ * Get the video pipeline stats of a device
+ * @param   handle              the receiver's handle
+ * @param   device_id           the device
+ * @param   stats               stats will be written into it
+ * @return  0 if ok, 1 if the device never sent any video
+ */
+SCRCPY_API int scrcpy_get_device_stats(scrcpy_listener_t handle, char *device_id, scrcpy_device_stats *stats);
+
+/**
+ * Wait for the newest frame image of a device newer than last_seq, instead of registering a frame callback
+ * Only the latest frame is kept for each device, frames newer than last_seq but replaced before the call are skipped.
+ * Frames are encoded for a device while a call is waiting or the last call returned within a second, with the format of
+ * scrcpy_set_output_format. Frames arriving after that are not kept, the next call gets the first frame arriving then.
+ * @param   handle              the receiver's handle
+ * @param   device_id           the device
+ * @param   last_seq            info.seq of the last frame got, 0 for the latest frame
+ * @param   timeout_ms          max time to wait, 0 for not waiting, -1 for waiting until a frame arrives
+ * @param   out_buffer          for receiving the image data
+ * @param   cap                 size of out_buffer
+ * @param   info                for receiving the seq, data size and image size of the frame, could be NULL
+ * @return  @see SCRCPY_WAIT_FRAME_OK
+ */
+SCRCPY_API int scrcpy_wait_next_frame(scrcpy_listener_t handle, char *device_id, uint64_t last_seq, int timeout_ms,
+        uint8_t *out_buffer, uint32_t cap, scrcpy_frame_info *info);
+
+/**
+ * Scale and encode the latest decoded frame of a device now, in the calling thread
+ * It works with or without scrcpy_set_snapshot_mode, which stops the continuous conversion for devices only captured.
+ * @param   handle              the receiver's handle
+ * @param   device_id           the device
+ * @param   width               image width, 0 for the configured image size or the screen size
+ * @param   height              image height, 0 for the configured image size or the screen size. A size bigger than the
+ *                              decoded frame is scaled down to fit it with the same aspect ratio, see info->img_size
+ * @param   format              @see SCRCPY_OUTPUT_FORMAT_PNG, -1 for the format and quality of scrcpy_set_output_format
+ * @param   quality             png compression level or jpeg/webp quality, SCRCPY_OUTPUT_QUALITY_DEFAULT for the encoder's default
+ * @param   out_buffer          for receiving the image data
+ * @param   cap                 size of out_buffer
+ * @param   info                for receiving the decoded frame number, data size and image size, could be NULL
+ * @return  @see SCRCPY_SNAPSHOT_OK
+ */
+SCRCPY_API int scrcpy_capture_snapshot(scrcpy_listener_t handle, char *device_id, int width, int height, int format, int quality,
+        uint8_t *out_buffer, uint32_t cap, scrcpy_frame_info *info);
+
+/**
+ * Publish the frames of a device into a named shared memory ring(file mapping), so local processes could map it
+ * and read frames without copying, @see scrcpy_shm_ring_header. Frame images are published as long as the ring exists,
+ * raw frames only while the device has raw frame callbacks. Frames bigger than slot_size are dropped.
+ * @param   handle              the receiver's handle
+ * @param   device_id           the device
+ * @param   name                name of the file mapping, e.g. "Local\\scrcpy_frames_<device id>"
+ * @param   slot_count          frames kept in the ring, 0 to stop exporting
+ * @param   slot_size           max bytes of a frame
+ * @return  0 if ok, 1 if the file mapping could not be created
+ */
+SCRCPY_API int scrcpy_export_shm_ring(scrcpy_listener_t handle, char *device_id, char *name, int slot_count, uint32_t slot_size);
+
 #ifdef __cplusplus
 }
 #endif